@@ -0,0 +1,38 @@
+#ifndef IN_PROCESS_COMPILER_H
+#define IN_PROCESS_COMPILER_H
+
+#include <string>
+
+#define IN_PROCESS_COMPILATION "IN_PROCESS_COMPILATION"
+
+class InProcessModule;
+
+//------------------------------------------------------------------------------
+// Runs the clang -> opt (Thrud) -> axtor pipeline inside the wrapper, without
+// temporary files or child processes.
+// The source is parsed once into an llvm::Module; every call to coarsen works
+// on a fresh clone of it, so the factors of one build share the frontend work.
+class InProcessCompiler {
+public:
+  InProcessCompiler(const std::string &source, const std::string &clangOptions);
+  ~InProcessCompiler();
+
+  bool isValid() const;
+
+  // Returns 0 on success, or the same error codes as compileWithAxtor. The
+  // analyses of analysisOptions, if any, run on the coarsened module.
+  int coarsen(const std::string &optOptions, const std::string &analysisOptions,
+              std::string &outputSource, std::string &clrLog);
+
+private:
+  InProcessModule *module;
+
+  InProcessCompiler(const InProcessCompiler &);
+  InProcessCompiler &operator=(const InProcessCompiler &);
+};
+
+// True if the wrapper was built with in-process support and the mode has
+// been requested through the environment.
+bool isInProcessCompilationEnabled();
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef LAUNCH_CONTEXT_H
+#define LAUNCH_CONTEXT_H
+
+#include "CL/cl.h"
+
+#include <map>
+#include <string>
+
+//------------------------------------------------------------------------------
+// The launch of a kernel as the Thrud analyses read it with -launch-context:
+// the NDRange the application enqueues and the values of its scalar
+// arguments. Arguments of 1, 2 or 4 bytes are kept, read as signed integers;
+// Thrud skips the ones that are not integers in the kernel. Wider arguments
+// are left out: they cannot be told apart from buffer handles, which change
+// from run to run.
+struct LaunchContext {
+  cl_uint workDim;
+  size_t globalSize[3];
+  size_t localSize[3];
+  std::map<cl_uint, long long> arguments;
+
+  LaunchContext() : workDim(0) {}
+};
+
+// True if OCL_LAUNCH_CONTEXT names the launch context file.
+bool isLaunchContextEnabled();
+
+// Stores the launch of the kernel in the OCL_LAUNCH_CONTEXT file, if it
+// changed. The analyses of the builds that follow, in this run or the next
+// ones, read it.
+void recordLaunchContext(const std::string &kernelName,
+                         const LaunchContext &context);
+
+// The entry of the kernel in the file, empty if it was never launched. Part of
+// the program cache key of the builds that run the analyses.
+std::string getLaunchContextEntry(const std::string &kernelName);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef LAUNCH_PROFILER_H
+#define LAUNCH_PROFILER_H
+
+#include "CL/cl.h"
+
+#include <string>
+
+#define OCL_ASYNC_PROFILING "OCL_ASYNC_PROFILING"
+#define OCL_TRACE_FILE "OCL_TRACE_FILE"
+#define OCL_TRACE_FORMAT "OCL_TRACE_FORMAT"
+
+//------------------------------------------------------------------------------
+// What the wrapper launched, as recorded in the trace. The strings are
+// interned with internProfileString.
+struct LaunchTraceInfo {
+  const char *kernelName;
+  const char *limitingFactor;
+  unsigned int coarseningFactor;
+  unsigned int coarseningDirection;
+  cl_uint workDim;
+  size_t globalSize[3];
+  // Zero if the local size was left to the implementation.
+  size_t localSize[3];
+};
+
+struct LaunchTraceSlot;
+
+// Returns a copy of the string that lives as long as the process.
+const char *internProfileString(const std::string &value);
+
+//------------------------------------------------------------------------------
+// Launch trace. With OCL_TRACE_FILE set, every launch is recorded with its
+// queued/submit/start/end timestamps in a preallocated buffer, which a
+// background thread writes to the file. OCL_TRACE_FORMAT selects the format:
+// "json" (the default) for the Chrome trace-event format read by Perfetto
+// and chrome://tracing, or "binary":
+//   header: "OCLTRACE" and the format version as a uint32
+//   string: uint8 1, uint32 id, uint32 length, the characters
+//   launch: uint8 2, uint32 kernel name id, uint32 limiting factor id,
+//           uint32 cf, uint32 direction, uint32 dimensions,
+//           uint64 global[3], uint64 local[3],
+//           uint64 queued, submit, start, end
+// All values are in host byte order; strings are defined before first use.
+bool isLaunchTraceEnabled();
+
+// Takes a slot of the trace buffer for a launch, or returns NULL if the
+// buffer is full and the launch is not traced.
+LaunchTraceSlot *reserveLaunchTrace(const LaunchTraceInfo &info);
+
+// Reads the timestamps of the completed command into the slot.
+void completeLaunchTrace(LaunchTraceSlot *slot, cl_event event);
+
+//------------------------------------------------------------------------------
+// Non-blocking launch timing. The duration of the command is read in the
+// completion callback of its event, queued in a lock-free ring buffer and
+// printed periodically by a background thread, in the same "kernelName
+// duration" format as the synchronous mode. The trace slot, if any, is
+// completed by the same callback. At exit the launches still running are
+// waited for up to a second, and the trace is closed.
+// Takes its own reference to the event.
+void profileLaunchAsync(cl_event event, const std::string &kernelName,
+                        LaunchTraceSlot *slot);
+
+// Prints the durations and writes the trace records collected so far.
+void flushLaunchProfiles();
+
+#endif
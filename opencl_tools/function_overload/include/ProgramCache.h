@@ -0,0 +1,56 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include "ReuseModel.h"
+
+#include <string>
+#include <vector>
+
+#define OCL_PROGRAM_CACHE "OCL_PROGRAM_CACHE"
+#define XDG_CACHE_HOME "XDG_CACHE_HOME"
+#define PROGRAM_CACHE_DIRECTORY "autocoarsening"
+// Beyond this size the least recently used entries are removed.
+#define PROGRAM_CACHE_MAX_BYTES (256LL << 20)
+
+//------------------------------------------------------------------------------
+// One coarsened build as stored on disk: the OpenCL C produced by axtor, the
+// device binary and the resources parsed from its build log.
+struct CachedProgram {
+  std::string source;
+  std::vector<unsigned char> binary;
+  bool hasResources;
+  int regs;
+  int smem;
+  int cmem;
+  bool isCacheDependent;
+  std::string cdaLog;
+  int memoryCost;
+  ReuseProfile reuseProfile;
+
+  CachedProgram()
+      : hasResources(false), regs(0), smem(0), cmem(0),
+        isCacheDependent(false), memoryCost(-1) {}
+};
+
+// Everything that determines the output of one build. The coarsening
+// direction and the other Thrud settings are part of the opt options.
+struct ProgramCacheKey {
+  std::string source;
+  std::string buildOptions;
+  std::string optOptions;
+  std::string analysisOptions;
+  unsigned int coarseningFactor;
+  std::string deviceName;
+  std::string driverVersion;
+};
+
+// False if OCL_PROGRAM_CACHE is set to "0" or "off".
+bool isProgramCacheEnabled();
+
+std::string computeProgramCacheKey(const ProgramCacheKey &key);
+// False if the entry is missing, truncated or malformed.
+bool loadCachedProgram(const std::string &key, CachedProgram &program);
+// Also trims the cache to PROGRAM_CACHE_MAX_BYTES.
+void storeCachedProgram(const std::string &key, const CachedProgram &program);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef REUSE_MODEL_H
+#define REUSE_MODEL_H
+
+#include <map>
+#include <string>
+
+//------------------------------------------------------------------------------
+// The replay of the accesses of -clr on the simulated caches for one factor,
+// with -cache-sim-factors. warps counts the warps of the original kernel the
+// replay covered.
+struct CacheSimulation {
+  long long warps;
+  long long requests;
+  long long l1Hits;
+  long long l2Hits;
+  long long dramTransactions;
+
+  CacheSimulation()
+      : warps(0), requests(0), l1Hits(0), l2Hits(0), dramTransactions(0) {}
+};
+
+// The cache line re-use of a kernel as -clr prints it: the reuse distances of
+// the accesses of the simulated tile, the number of distinct lines it touched
+// between two accesses to the same line. The lines that are not re-used are
+// not in distances.
+struct ReuseProfile {
+  // Warps of the simulated tile, of warpSize threads as -warp-size set them.
+  int warps;
+  int warpSize;
+  int lineSize;
+  long long accesses;
+  std::map<long long, long long> distances;
+  // By coarsening factor, if the cache simulation ran.
+  std::map<unsigned int, CacheSimulation> simulations;
+
+  ReuseProfile() : warps(0), warpSize(32), lineSize(0), accesses(0) {}
+
+  bool isValid() const {
+    return warps > 0 && warpSize > 0 && lineSize > 0 && accesses > 0;
+  }
+};
+
+// The profile printed before the verdict of -clr, invalid if there is none.
+ReuseProfile parseReuseProfile(const std::string &clrOutput);
+
+// The profile on one line, as the program cache stores it, and back.
+std::string formatReuseProfile(const ReuseProfile &profile);
+ReuseProfile readReuseProfile(const std::string &value);
+
+// The fraction of the accesses that hit the caches with CF 1 but miss them
+// with factor cf, between 0 and 1. If the cache simulation ran for both
+// factors, these are its extra DRAM transactions per original warp.
+// Otherwise the distances of the tile are scaled to the device: every
+// coarsened warp keeps the lines of cf warps live, and activeThreads
+// work-items share the L1 of a compute unit, all of them the L2. The caches
+// are the ARCH_L1_* and ARCH_L2_* ones, with random set mapping.
+float computeReusePenalty(const ReuseProfile &profile, unsigned int cf,
+                          int activeThreads, int baseActiveThreads);
+
+#endif
@@ -1,7 +1,10 @@
 #include "CL/cl.h"
 
+#include "LaunchProfiler.h"
+
 #include <string>
 #include <utility>
+#include <vector>
 
 #define OCL_BLOCK_SIZE_X "OCL_BLOCK_SIZE_X"
 #define OCL_BLOCK_SIZE_Y "OCL_BLOCK_SIZE_Y"
@@ -9,6 +12,17 @@
 #define OCL_COMPILER_OPTIONS "OCL_COMPILER_OPTIONS"
 #define TC_KERNEL_NAME "TC_KERNEL_NAME"
 #define OCL_REPETITIONS "OCL_REPETITIONS"
+#define OCL_COMPILE_THREADS "OCL_COMPILE_THREADS"
+#define OCL_LAZY_COARSENING "OCL_LAZY_COARSENING"
+#define OCL_CANDIDATE_FACTORS "OCL_CANDIDATE_FACTORS"
+#define OCL_DYNAMIC_COARSENING "OCL_DYNAMIC_COARSENING"
+#define OCL_LAUNCH_CONTEXT "OCL_LAUNCH_CONTEXT"
+#define OCL_CACHE_SIMULATION "OCL_CACHE_SIMULATION"
+// The hidden last parameters of the kernel under test in dynamic mode: the
+// factor, then the number of work-groups of the original NDRange in the
+// coarsening direction.
+#define COARSENING_FACTOR_ARG "thrud_coarsening_factor"
+#define COARSENING_GROUPS_ARG "thrud_coarsening_groups"
 #define CLC_DIRECTORY "/home/s1158370/src/libclc/"
 #define OCL_INPUT_FILE "/tmp/ocl_input.cl"
 #define OCL_OUTPUT_FILE "/tmp/ocl_output.cl"
@@ -54,6 +68,16 @@ typedef cl_kernel (*clCreateKernelFunction)
 #define CL_RELEASE_PROGRAM_NAME "clReleaseProgram"
 typedef cl_int (*clReleaseProgramFunction)(cl_program);
 
+#define CL_SET_KERNEL_ARG_NAME "clSetKernelArg"
+typedef cl_int (*clSetKernelArgFunction)
+  (cl_kernel,
+   cl_uint,
+   size_t,
+   const void*);
+
+#define CL_RELEASE_KERNEL_NAME "clReleaseKernel"
+typedef cl_int (*clReleaseKernelFunction)(cl_kernel);
+
 #define CL_CREATE_PROGRAM_WITH_SOURCE_NAME "clCreateProgramWithSource"
 typedef cl_program (*clCreateProgramWithSourceFunction)
   (cl_context, cl_uint, const char **, const size_t *, cl_int *);
@@ -101,6 +125,76 @@ typedef cl_command_queue (*clCreateCommandQueueFunction)
    cl_command_queue_properties,
    cl_int*);
 
+//------------------------------------------------------------------------------
+// The functions of the OpenCL library the wrappers forward to, resolved with
+// dlsym(RTLD_NEXT, ...) once per process.
+struct OriginalFunctions {
+  clCreateProgramWithSourceFunction createProgramWithSource;
+  clCreateProgramWithBinaryFunction createProgramWithBinary;
+  clBuildProgramFunction buildProgram;
+  clRetainProgramFunction retainProgram;
+  clReleaseProgramFunction releaseProgram;
+  clGetProgramInfoFunction getProgramInfo;
+  clGetProgramBuildInfoFunction getProgramBuildInfo;
+  clCreateKernelFunction createKernel;
+  clSetKernelArgFunction setKernelArg;
+  clReleaseKernelFunction releaseKernel;
+  clEnqueueNDRangeKernelFunction enqueueNDRangeKernel;
+  clCreateCommandQueueFunction createCommandQueue;
+};
+
+const OriginalFunctions &getOriginalFunctions();
+
+//------------------------------------------------------------------------------
+// The wrapper settings. The environment is read once per process: the
+// values cannot change between launches.
+struct WrapperConfig {
+  std::string kernelName;
+  std::string compilerOptions;
+  unsigned int maxCoarseningFactor;
+  // The factors built and searched by the model, in increasing order and
+  // starting with 1: OCL_CANDIDATE_FACTORS, or the powers of two up to
+  // maxCoarseningFactor.
+  std::vector<unsigned int> candidateFactors;
+  // The factor and direction of OCL_COMPILER_OPTIONS (or CF_OVERRIDE).
+  unsigned int coarseningFactor;
+  unsigned int coarseningDirection;
+  // The factor of every dimension: -coarsening-factors if given, otherwise
+  // coarseningFactor along coarseningDirection.
+  unsigned int coarseningFactors[3];
+  unsigned int repetitions;
+  unsigned int compileThreads;
+  bool threadLevelCoarsening;
+  bool lazyCoarsening;
+  // Build the kernel under test once, with its factor read from a hidden
+  // argument, instead of once per candidate factor.
+  bool dynamicCoarsening;
+  bool asyncProfiling;
+  // Launch trace file and format (OCL_TRACE_FILE, OCL_TRACE_FORMAT).
+  std::string traceFile;
+  std::string traceFormat;
+  // The launches the analyses read (OCL_LAUNCH_CONTEXT).
+  std::string launchContextFile;
+  // Replay the accesses of -clr on the caches below for every candidate
+  // factor (OCL_CACHE_SIMULATION).
+  bool cacheSimulation;
+  // Target architecture, per compute unit.
+  int computeUnits;
+  int maxActiveThreadsPerCU;
+  int maxGroupsPerCU;
+  int maxRegsPerCU;
+  int maxSMemPerCU;
+  // Caches the reuse model fits the reuse distances of -clr in: the L1 of a
+  // compute unit and the shared L2, in bytes.
+  int l1Size;
+  int l1Ways;
+  int l2Size;
+  int l2Ways;
+  int cacheLineSize;
+};
+
+const WrapperConfig &getWrapperConfig();
+
 
 //------------------------------------------------------------------------------
 // Support functions.
@@ -116,6 +210,7 @@ cl_context getProgramContext(cl_program program);
 cl_context getKernelContext(cl_kernel kernel);
 cl_device_id getDeviceFromContext(cl_context context, unsigned int deviceNumber);
 std::string getKernelName(cl_kernel kernel);
+std::string getDeviceInfoString(cl_device_id device, cl_device_info paramName);
 
 void verifyOutputCode(cl_int valueToCheck, const char* errorMessage);
 bool isError(cl_int valueToCheck);
@@ -128,7 +223,17 @@ unsigned long int computeEventDuration(cl_event* event);
 bool computeNDRangeDim(unsigned int dimensions,
                        const size_t* globalSize, const size_t* localSize,
                        size_t* newGlobalSize, size_t *newLocalSize);
+bool computeNDRangeDim(unsigned int dimensions,
+                       const size_t* globalSize, const size_t* localSize,
+                       size_t* newGlobalSize, size_t *newLocalSize,
+                       unsigned int CF, unsigned int CD);
+// Scales every dimension by its own factor.
+bool computeNDRangeDim(unsigned int dimensions,
+                       const size_t* globalSize, const size_t* localSize,
+                       size_t* newGlobalSize, size_t *newLocalSize,
+                       const unsigned int *factors);
 
+// Every repetition is recorded in the launch trace when traceInfo is given.
 void enqueueKernel(cl_command_queue command_queue,
                    cl_kernel kernel,
                    cl_uint work_dim,
@@ -139,7 +244,8 @@ void enqueueKernel(cl_command_queue command_queue,
                    const cl_event* event_wait_list,
                    cl_event* event,
                    unsigned int repetitions,
-                   const std::string &kernelName);
+                   const std::string &kernelName,
+                   const LaunchTraceInfo *traceInfo = NULL);
 
 void enqueueKernelSingleThread(cl_command_queue command_queue,
                                cl_kernel kernel,
@@ -171,15 +277,30 @@ void enqueueKernelNoTime(cl_command_queue command_queue,
 int compileWithAxtor(std::string &inputFile, 
                      std::string &clangOptions, std::string &optOptions, 
                      std::string &outputFile,
-                     int seed, bool cacheDependenceAnalysis);
+                     int seed, const std::string &analysisOptions);
 
 std::string buildPTXCommandLine(std::string &inputFile,
                                 std::string &compilerOptions,
                                 std::string &outputFile);
 
+// CLR_OPTIONS, reading the launch context file if there is one, and running
+// the cache simulation if enabled.
+std::string getAnalysisOptions();
+// The options of -symbolic-execution alone, run on every coarsened candidate
+// for its memory cost. Empty if CLR_OPTIONS does not ask for it.
+std::string getMemoryCostOptions();
+
 void splitCompilerOptions(std::string& clangOptions, std::string& oclOptions);
 
 std::pair<unsigned int,unsigned int>
 getCoarseningOptions(const std::string& compilerOptions);
+// Appends the COARSENING_FACTOR_ARG and COARSENING_GROUPS_ARG parameters to
+// the signature of the kernel in source. Returns false, leaving source as it
+// is, if it is not found.
+bool addCoarseningFactorArg(std::string& source, const std::string& kernelName);
+// Reads -coarsening-factors into factors[3]; returns false if it is missing
+// or has an entry that is not a positive number.
+bool getCoarseningFactorsOption(const std::string& compilerOptions,
+                                unsigned int *factors);
 std::pair<unsigned int,unsigned int>
 getVectorizationOptions(const std::string& compilerOptions);
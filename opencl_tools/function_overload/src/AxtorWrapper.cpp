@@ -1,9 +1,14 @@
 #include <CL/cl.h>
 
+#include "InProcessCompiler.h"
+#include "LaunchContext.h"
+#include "ProgramCache.h"
+#include "ReuseModel.h"
 #include "Utils.h"
 
 #include <stdlib.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <dlfcn.h>
 #include <iostream>
 #include <fstream>
@@ -14,19 +19,20 @@
 #include <map>
 #include <set>
 #include <algorithm>
-
-#include <pthread.h>
-void junk() {
-  int i;
-  i=pthread_getconcurrency();
-};
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 #define __AXTOR_DEBUG_PRINTXX 1
 #define PERFORM_AXTOR_COMPILE 1
 
 std::string compile(std::string &inputFile, const char *options, std::string &optOptions,
-                    std::string &outputFile, int seed, bool cacheDependenceAnalysis);
+                    std::string &outputFile, int seed, const std::string &analysisOptions,
+                    InProcessCompiler *inProcessCompiler,
+                    std::string &outputSource, std::string &clrOutput);
 cl_program compileAllCF(std::string &inputFile,
+                        const std::string &source,
                         const char *options,
 			std::string &outputFile,
 			int seed,
@@ -37,7 +43,10 @@ cl_program compileAllCF(std::string &inputFile,
 			cl_uint num_devices,
                         const cl_device_id *device_list,
                         void (*pfn_notify)(cl_program, void *),
-                        void *user_data);
+                        void *user_data,
+                        InProcessCompiler *inProcessCompiler,
+                        std::map<unsigned int, cl_program> &coarsenedPrograms,
+                        struct LazyCompilation **lazyCompilation);
 cl_program compileSingleCF(std::string &inputFile,
                            const char *options,
 			   std::string &optOptions,
@@ -50,20 +59,35 @@ cl_program compileSingleCF(std::string &inputFile,
                            const cl_device_id *device_list,
                            void (*pfn_notify)(cl_program, void *),
                            void *user_data,
-                           bool cacheDependenceAnalysis);
+                           const std::string &analysisOptions,
+                           InProcessCompiler *inProcessCompiler,
+                           std::string &clrOutput,
+                           std::string &outputSource);
+extern "C" cl_int clGetProgramInfoWithNoTypeCastHack(cl_program program,
+                                                     cl_program_info param_name,
+                                                     size_t param_value_size, void *param_value,
+                                                     size_t *param_value_size_ret);
 
 //------------------------------------------------------------------------------
 // OpenCL Runtime state data structures.
+struct LazyCompilation;
+
 struct ProgramDesc {
   cl_context context;
   std::string sourceStr;
   cl_program handle;
+  // The candidate builds of the coarsening sweep, by coarsening factor.
+  std::map<unsigned int, cl_program> coarsenedPrograms;
+  // The factors still to be compiled, in lazy mode.
+  LazyCompilation *lazyCompilation;
 
   ProgramDesc(cl_context context, std::string sourceStr)
-      : context(context), sourceStr(sourceStr), handle(0) {}
+      : context(context), sourceStr(sourceStr), handle(0),
+        lazyCompilation(NULL) {}
 
   ProgramDesc(cl_context context, cl_program handle)
-      : context(context), sourceStr(""), handle(handle) {}
+      : context(context), sourceStr(""), handle(handle),
+        lazyCompilation(NULL) {}
 
   bool isValid() const { return handle != 0; }
   bool isFromBinary() const { return sourceStr.empty(); }
@@ -71,6 +95,58 @@ struct ProgramDesc {
 
 typedef std::vector<ProgramDesc *> ProgramDescVec;
 
+// Value of a kernel argument as set by the application. A NULL value is a
+// local memory argument of the given size.
+struct KernelArg {
+  size_t size;
+  bool isNull;
+  std::vector<unsigned char> value;
+
+  KernelArg() : size(0), isNull(true) {}
+};
+
+// The NDRange a kernel was last launched with and what the wrapper turned it
+// into. Launches with the same NDRange reuse it as is.
+struct LaunchDesc {
+  bool isValid;
+  cl_uint workDim;
+  bool hasLocalSize;
+  size_t globalSize[3];
+  size_t localSize[3];
+  cl_kernel kernel;
+  bool hasNewLocalSize;
+  size_t newGlobalSize[3];
+  size_t newLocalSize[3];
+  // What the launch trace records, if enabled.
+  LaunchTraceInfo traceInfo;
+
+  LaunchDesc() : isValid(false) {}
+
+  bool matches(cl_uint dimensions, const size_t *global, const size_t *local) const {
+    return isValid && workDim == dimensions && hasLocalSize == (local != NULL) &&
+           memcmp(globalSize, global, dimensions * sizeof(size_t)) == 0 &&
+           (local == NULL || memcmp(localSize, local, dimensions * sizeof(size_t)) == 0);
+  }
+};
+
+// Kernels created by the application. The handle given to the application is
+// the one of the default build; the kernels of the same name in the
+// coarsened builds are created on demand and receive the same arguments.
+// Kernels that did not go through clCreateKernel have no program.
+struct KernelDesc {
+  ProgramDesc *program;
+  std::string name;
+  std::map<cl_uint, KernelArg> args;
+  std::map<unsigned int, cl_kernel> coarsenedKernels;
+  // Index of the COARSENING_GROUPS_ARG argument of the dynamic build, 0 if
+  // the kernel has none.
+  cl_uint groupsArg;
+  LaunchDesc launch;
+
+  KernelDesc(ProgramDesc *program, const std::string &name)
+      : program(program), name(name), groupsArg(0) {}
+};
+
 struct KernelResources {
   int regs;
   int smem;
@@ -79,14 +155,19 @@ struct KernelResources {
   int direction;
   bool isCacheDependent;
   std::string cdaLog;
+  // Memory cost per warp from the symbolic execution, -1 if unknown.
+  int memoryCost;
+  // Reuse distances from the cache line re-use analysis, of CF 1 only.
+  ReuseProfile reuseProfile;
   float occupancy;
   int activeThreadsByNumBlocks;
   int activeThreadsBySMem;
   int activeThreadsByRegs;
   int achievableActiveThreads;
 
-  KernelResources(int regs, int smem, int cmem, int cf, int direction, bool isCacheDependent, std::string cdaLog)
+  KernelResources(int regs, int smem, int cmem, int cf, int direction, bool isCacheDependent, std::string cdaLog, int memoryCost)
       : regs(regs), smem(smem), cmem(cmem), cf(cf), direction(direction), isCacheDependent(isCacheDependent), cdaLog(cdaLog),
+        memoryCost(memoryCost),
         occupancy(0.0), activeThreadsByNumBlocks(0), activeThreadsBySMem(0), activeThreadsByRegs(0), achievableActiveThreads(0) {}
 };
 
@@ -94,8 +175,13 @@ struct KernelLaunchConfig {
   int numBlocks;
   int numThreadsPerBlock;
   int gridDim[3];
+  int blockDim[3];
 
-  KernelLaunchConfig() {}
+  // Sizes of 1 in the dimensions beyond the launch.
+  KernelLaunchConfig() : numBlocks(1), numThreadsPerBlock(1) {
+    std::fill(gridDim, gridDim + 3, 1);
+    std::fill(blockDim, blockDim + 3, 1);
+  }
 
   KernelLaunchConfig(int numBlocks, int numThreadsPerBlock)
       : numBlocks(numBlocks), numThreadsPerBlock(numThreadsPerBlock) {}
@@ -108,6 +194,12 @@ static ProgramDescVec programs;
 static std::map<std::string, std::vector<KernelResources *>> kernelResources;
 static std::map<std::string, KernelLaunchConfig *> kernelLaunchConfig;
 static std::map<std::string, int> chosenCFs;
+static std::map<std::string, std::string> limitingFactors;
+static std::map<cl_kernel, KernelDesc *> kernels;
+static std::mutex kernelsMutex;
+static std::mutex lazyCompilationMutex;
+
+void releaseLazyCompilation(ProgramDesc *desc);
 //static std::map<std::string, int> kernelRequestedBlocksMap;
 
 // OpenCL functions.
@@ -116,8 +208,8 @@ static std::map<std::string, int> chosenCFs;
 extern "C" cl_kernel clCreateKernel(cl_program program, const char *kernel_name,
                                     cl_int *errcode_ret) {
   ProgramDesc *desc = reinterpret_cast<ProgramDesc *>(program);
-  clCreateKernelFunction originalCreateKernel;
-  *(void **)(&originalCreateKernel) = dlsym(RTLD_NEXT, CL_CREATE_KERNEL_NAME);
+  clCreateKernelFunction originalCreateKernel =
+      getOriginalFunctions().createKernel;
 
   cl_int errorCode;
   cl_kernel kernel =
@@ -126,16 +218,144 @@ extern "C" cl_kernel clCreateKernel(cl_program program, const char *kernel_name,
   if (errcode_ret)
     *errcode_ret = errorCode;
 
+  if (kernel != NULL) {
+    std::lock_guard<std::mutex> lock(kernelsMutex);
+    kernels[kernel] = new KernelDesc(desc, kernel_name);
+  }
+
   return kernel;
 }
 
+//------------------------------------------------------------------------------
+extern "C" cl_int clSetKernelArg(cl_kernel kernel, cl_uint arg_index,
+                                 size_t arg_size, const void *arg_value) {
+  clSetKernelArgFunction originalSetKernelArg =
+      getOriginalFunctions().setKernelArg;
+
+  cl_int errorCode =
+      originalSetKernelArg(kernel, arg_index, arg_size, arg_value);
+  if (errorCode != CL_SUCCESS)
+    return errorCode;
+
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  std::map<cl_kernel, KernelDesc *>::iterator desc = kernels.find(kernel);
+  if (desc == kernels.end())
+    return errorCode;
+
+  KernelArg &arg = desc->second->args[arg_index];
+  arg.size = arg_size;
+  arg.isNull = arg_value == NULL;
+  if (arg.isNull)
+    arg.value.clear();
+  else
+    arg.value.assign(static_cast<const unsigned char *>(arg_value),
+                     static_cast<const unsigned char *>(arg_value) + arg_size);
+
+  // Keep the kernels already swapped in up to date.
+  for (auto &coarsened : desc->second->coarsenedKernels)
+    dumpError(originalSetKernelArg(coarsened.second, arg_index, arg_size,
+                                   arg_value));
+
+  return errorCode;
+}
+
+//------------------------------------------------------------------------------
+extern "C" cl_int clReleaseKernel(cl_kernel kernel) {
+  clReleaseKernelFunction originalReleaseKernel =
+      getOriginalFunctions().releaseKernel;
+
+  // The coarsened kernels live as long as the application's handle.
+  cl_uint referenceCount = 0;
+  clGetKernelInfo(kernel, CL_KERNEL_REFERENCE_COUNT, sizeof(cl_uint),
+                  &referenceCount, NULL);
+  if (referenceCount == 1) {
+    std::lock_guard<std::mutex> lock(kernelsMutex);
+    std::map<cl_kernel, KernelDesc *>::iterator desc = kernels.find(kernel);
+    if (desc != kernels.end()) {
+      for (auto &coarsened : desc->second->coarsenedKernels)
+        originalReleaseKernel(coarsened.second);
+      delete desc->second;
+      kernels.erase(desc);
+    }
+  }
+
+  return dumpError(originalReleaseKernel(kernel));
+}
+
+//------------------------------------------------------------------------------
+// Returns the kernel of the build for the given coarsening factor, with the
+// arguments recorded so far, or NULL if there is no such build.
+cl_kernel getCoarsenedKernel(cl_kernel kernel, unsigned int coarseningFactor) {
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  std::map<cl_kernel, KernelDesc *>::iterator descIter = kernels.find(kernel);
+  if (descIter == kernels.end() || descIter->second->program == NULL)
+    return NULL;
+  KernelDesc *desc = descIter->second;
+
+  std::map<unsigned int, cl_kernel>::iterator coarsened =
+      desc->coarsenedKernels.find(coarseningFactor);
+  if (coarsened != desc->coarsenedKernels.end())
+    return coarsened->second;
+
+  std::map<unsigned int, cl_program>::iterator program =
+      desc->program->coarsenedPrograms.find(coarseningFactor);
+  if (program == desc->program->coarsenedPrograms.end())
+    return NULL;
+
+  clCreateKernelFunction originalCreateKernel =
+      getOriginalFunctions().createKernel;
+  clSetKernelArgFunction originalSetKernelArg =
+      getOriginalFunctions().setKernelArg;
+
+  cl_int errorCode;
+  cl_kernel result =
+      originalCreateKernel(program->second, desc->name.c_str(), &errorCode);
+  if (errorCode != CL_SUCCESS)
+    return NULL;
+
+  for (auto &arg : desc->args) {
+    errorCode = originalSetKernelArg(
+        result, arg.first, arg.second.size,
+        arg.second.isNull ? NULL : arg.second.value.data());
+    verifyOutputCode(errorCode, "Error copying the kernel arguments");
+  }
+
+  // A dynamic build has two more arguments than the application's kernel:
+  // the factor, which is set once for the kernel of each factor, and the
+  // number of work-groups, which is set at every new NDRange.
+  cl_uint numArgs = 0;
+  cl_uint dynamicNumArgs = 0;
+  clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+  clGetKernelInfo(result, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &dynamicNumArgs, NULL);
+  if (dynamicNumArgs == numArgs + 2) {
+    cl_uint factorArg = coarseningFactor;
+    errorCode = originalSetKernelArg(result, numArgs, sizeof(cl_uint), &factorArg);
+    verifyOutputCode(errorCode, "Error setting the coarsening factor argument");
+    desc->groupsArg = numArgs + 1;
+  }
+
+  desc->coarsenedKernels[coarseningFactor] = result;
+  return result;
+}
+
 //------------------------------------------------------------------------------
 extern "C" cl_int clReleaseProgram(cl_program program) {
   ProgramDesc *desc = reinterpret_cast<ProgramDesc *>(program);
 
-  clReleaseProgramFunction originalReleaseProgram;
-  *(void **)(&originalReleaseProgram) =
-      dlsym(RTLD_NEXT, CL_RELEASE_PROGRAM_NAME);
+  clReleaseProgramFunction originalReleaseProgram =
+      getOriginalFunctions().releaseProgram;
+
+  // The coarsened builds go with the last reference to the default one.
+  cl_uint referenceCount = 0;
+  clGetProgramInfoWithNoTypeCastHack(desc->handle, CL_PROGRAM_REFERENCE_COUNT,
+                                     sizeof(cl_uint), &referenceCount, NULL);
+  if (referenceCount == 1) {
+    releaseLazyCompilation(desc);
+    std::lock_guard<std::mutex> lock(kernelsMutex);
+    for (auto &coarsened : desc->coarsenedPrograms)
+      originalReleaseProgram(coarsened.second);
+    desc->coarsenedPrograms.clear();
+  }
 
   return dumpError(originalReleaseProgram(desc->handle));
 }
@@ -144,8 +364,8 @@ extern "C" cl_int clReleaseProgram(cl_program program) {
 extern "C" cl_int clRetainProgram(cl_program program) {
   ProgramDesc *desc = reinterpret_cast<ProgramDesc *>(program);
 
-  clRetainProgramFunction originalRetainProgram;
-  *(void **)(&originalRetainProgram) = dlsym(RTLD_NEXT, CL_RETAIN_PROGRAM_NAME);
+  clRetainProgramFunction originalRetainProgram =
+      getOriginalFunctions().retainProgram;
 
   return dumpError(originalRetainProgram(desc->handle));
 }
@@ -155,9 +375,8 @@ extern "C" cl_int clGetProgramInfoWithNoTypeCastHack(cl_program program,
                                                      cl_program_info param_name,
                                                      size_t param_value_size, void *param_value,
                                                      size_t *param_value_size_ret) {
-  clGetProgramInfoFunction originalGetProgramInfo;
-  *(void **)(&originalGetProgramInfo) =
-      dlsym(RTLD_NEXT, CL_GET_PROGRAM_INFO_NAME);
+  clGetProgramInfoFunction originalGetProgramInfo =
+      getOriginalFunctions().getProgramInfo;
   return originalGetProgramInfo(program, param_name, param_value_size,
                                 param_value, param_value_size_ret);
 }
@@ -168,9 +387,8 @@ extern "C" cl_int clGetProgramInfo(cl_program program,
                                    size_t *param_value_size_ret) {
   ProgramDesc *desc = reinterpret_cast<ProgramDesc *>(program);
 
-  clGetProgramInfoFunction originalGetProgramInfo;
-  *(void **)(&originalGetProgramInfo) =
-      dlsym(RTLD_NEXT, CL_GET_PROGRAM_INFO_NAME);
+  clGetProgramInfoFunction originalGetProgramInfo =
+      getOriginalFunctions().getProgramInfo;
   return originalGetProgramInfo(desc->handle, param_name, param_value_size,
                                 param_value, param_value_size_ret);
 }
@@ -182,9 +400,8 @@ cl_int clGetProgramBuildInfoWithNoTypeCastHack(cl_program program, cl_device_id
                                                void *param_value,
                                                size_t *param_value_size_ret) {
 
-  clGetProgramBuildInfoFunction originalGetProgramBuildInfo;
-  *(void **)(&originalGetProgramBuildInfo) =
-      dlsym(RTLD_NEXT, CL_GET_PROGRAM_BUILD_INFO_NAME);
+  clGetProgramBuildInfoFunction originalGetProgramBuildInfo =
+      getOriginalFunctions().getProgramBuildInfo;
   return dumpError(originalGetProgramBuildInfo(program, device, param_name,
                                                param_value_size, param_value,
                                                param_value_size_ret));
@@ -207,9 +424,8 @@ clCreateProgramWithBinary(cl_context context, cl_uint num_devices,
                           const cl_device_id *device_list,
                           const size_t *lengths, const unsigned char **binaries,
                           cl_int *binary_status, cl_int *errcode_ret) {
-  clCreateProgramWithBinaryFunction originalCreateProgramWithBinary;
-  *(void **)(&originalCreateProgramWithBinary) =
-      dlsym(RTLD_NEXT, CL_CREATE_PROGRAM_WITH_BINARY_NAME);
+  clCreateProgramWithBinaryFunction originalCreateProgramWithBinary =
+      getOriginalFunctions().createProgramWithBinary;
   cl_program realHandle = originalCreateProgramWithBinary(
       context, num_devices, device_list, lengths, binaries, binary_status,
       errcode_ret);
@@ -288,12 +504,11 @@ extern "C" cl_int clBuildProgram(cl_program program, cl_uint num_devices_param,
   int seed = rand() % 100000;
 
   // Get pointer to original function call.
-  clBuildProgramFunction originalBuildProgram;
-  *(void **)(&originalBuildProgram) = dlsym(RTLD_NEXT, CL_BUILD_PROGRAM_NAME);
+  clBuildProgramFunction originalBuildProgram =
+      getOriginalFunctions().buildProgram;
 
-  clCreateProgramWithSourceFunction originalCreateProgramWithSource;
-  *(void **)(&originalCreateProgramWithSource) =
-      dlsym(RTLD_NEXT, CL_CREATE_PROGRAM_WITH_SOURCE_NAME);
+  clCreateProgramWithSourceFunction originalCreateProgramWithSource =
+      getOriginalFunctions().createProgramWithSource;
 
   // Get the source file name.
   std::string inputFile = getMangledFileName(OCL_INPUT_FILE, seed);
@@ -317,20 +532,33 @@ extern "C" cl_int clBuildProgram(cl_program program, cl_uint num_devices_param,
     return CL_SUCCESS;
   }
 
-  // Dump the program.
-  writeFile(inputFile, desc->sourceStr);
+  // Parse the program once when the pipeline runs in-process, dump it for
+  // the external toolchain otherwise.
+  InProcessCompiler *inProcessCompiler = NULL;
+  if (isInProcessCompilationEnabled()) {
+    std::string clangOptions(options != NULL ? options : "");
+    std::string oclOptions;
+    splitCompilerOptions(clangOptions, oclOptions);
+    inProcessCompiler = new InProcessCompiler(desc->sourceStr, clangOptions);
+  } else {
+    writeFile(inputFile, desc->sourceStr);
+  }
 
   // Compile the program.
-  std::string testMaxCoarseningFactor = getEnvString("MAX_COARSENING_FACTOR");
+  const WrapperConfig &config = getWrapperConfig();
+  unsigned int maxCoarseningFactor = config.maxCoarseningFactor;
 #ifdef __AXTOR_DEBUG_PRINT
   std::cout << "Options: " << (options != NULL ? options : "") << std::endl;
-  std::cout << "MaxCoarseningFactor is: " << testMaxCoarseningFactor << std::endl;
+  std::cout << "MaxCoarseningFactor is: " << maxCoarseningFactor << std::endl;
 #endif
-  int maxCoarseningFactor = 0;
-  if (!testMaxCoarseningFactor.empty()) {
-    maxCoarseningFactor = std::stoi(testMaxCoarseningFactor);
+  // In lazy mode only CF 1 is built now, the other factors are compiled
+  // once the launch configuration is known. A dynamic build leaves nothing
+  // to compile later.
+  bool lazyCoarsening = maxCoarseningFactor > 0 && config.lazyCoarsening && !config.dynamicCoarsening;
+  desc->handle = compileAllCF(inputFile, desc->sourceStr, options, outputFile, seed, maxCoarseningFactor, desc->context, originalCreateProgramWithSource, originalBuildProgram, num_devices, device_list, pfn_notify, user_data, inProcessCompiler, desc->coarsenedPrograms, lazyCoarsening ? &desc->lazyCompilation : NULL);
+  if (desc->lazyCompilation == NULL) {
+    delete inProcessCompiler;
   }
-  desc->handle = compileAllCF(inputFile, options, outputFile, seed, maxCoarseningFactor, desc->context, originalCreateProgramWithSource, originalBuildProgram, num_devices, device_list, pfn_notify, user_data);
 
   cl_bool param_val;
   clGetDeviceInfo(*device_list, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &param_val, NULL);
@@ -376,24 +604,426 @@ void parseBuildLog(std::string buildLog, std::string kernelName, int& regs, int&
   }
 }
 
-bool parseCacheDependence(const int seed, std::string & cdaLog) {
-  std::string inputFile = getMangledFileName(CLR_FILE, seed);
-  std::string outputFile = inputFile + ".grepResult";
+// The verdict of the cache line re-use analysis is the last line it prints.
+bool parseCacheDependence(const std::string &clrOutput, std::string & cdaLog) {
   std::string searchStr = "No cache line re-use detected, OK to coarsen";
-  //std::string cmd = "grep \"" + searchStr + "\" " + cdaFileName + " > " + cdaGrepFileName;
-  std::string cmd = "tail -1 " + inputFile + " > " + outputFile;
-  system(cmd.c_str());
-  size_t resultSize;
-  char* resultPtr = readFile(outputFile.c_str(), &resultSize);
-  cdaLog.assign(resultPtr, resultSize > 1 && resultPtr[resultSize-2] == '\n' ? resultSize - 2 : resultSize);
-#ifndef __AXTOR_DEBUG_PRINT
-  std::string removeString = "rm " + inputFile + " && rm " + outputFile;
-  system(removeString.c_str()); //retain intermediate files in debug mode
-#endif
+  size_t lineEnd = clrOutput.find_last_not_of("\n");
+  size_t lineStart = lineEnd == std::string::npos ? std::string::npos : clrOutput.find_last_of('\n', lineEnd);
+  lineStart = lineStart == std::string::npos ? 0 : lineStart + 1;
+  cdaLog = lineEnd == std::string::npos ? "" : clrOutput.substr(lineStart, lineEnd - lineStart + 1);
   return cdaLog.find(searchStr) == std::string::npos;
 }
 
+// The memory cost printed by -symbolic-execution, if it ran with the analysis.
+int parseMemoryCost(const std::string &clrOutput) {
+  std::string searchStr = "Memory cost per warp: ";
+  size_t position = clrOutput.rfind(searchStr);
+  if (position == std::string::npos) {
+    return -1;
+  }
+  return atoi(clrOutput.c_str() + position + searchStr.size());
+}
+
+//------------------------------------------------------------------------------
+// One candidate build of the coarsening sweep. Every job has its own seed so
+// that the temporary files of concurrent workers do not collide.
+struct CompilationJob {
+  unsigned int coarseningFactor;
+  std::string optOptions;
+  // The verdict of -clr is taken from the CF 1 build.
+  bool cacheDependenceAnalysis;
+  // The opt analyses run on the coarsened IR of the job, none if empty.
+  std::string analysisOptions;
+  int seed;
+  std::string inputFile;
+  std::string outputFile;
+  cl_program program;
+  std::string clrOutput;
+  std::string buildLog;
+  bool failed;
+  bool fromCache;
+  // Resources of the kernel under test, if the program contains it.
+  bool hasResources;
+  int regs;
+  int smem;
+  int cmem;
+  bool isCacheDependent;
+  std::string cdaLog;
+  int memoryCost;
+  ReuseProfile reuseProfile;
+  // Compiler of the job's own source, if it is not the program's.
+  InProcessCompiler *inProcessCompiler;
+
+  CompilationJob(unsigned int coarseningFactor, const std::string &optOptions,
+                 bool cacheDependenceAnalysis, int seed)
+      : coarseningFactor(coarseningFactor), optOptions(optOptions),
+        cacheDependenceAnalysis(cacheDependenceAnalysis),
+        analysisOptions(cacheDependenceAnalysis ? getAnalysisOptions()
+                                                : getMemoryCostOptions()),
+        seed(seed),
+        inputFile(getMangledFileName(OCL_INPUT_FILE, seed)),
+        outputFile(getMangledFileName(OCL_OUTPUT_FILE, seed)), program(0),
+        failed(false), fromCache(false), hasResources(false), regs(0),
+        smem(0), cmem(0), isCacheDependent(false), memoryCost(-1),
+        inProcessCompiler(NULL) {}
+};
+
+//------------------------------------------------------------------------------
+// Everything needed to compile the remaining factors of a program at its
+// first launch. The jobs run on a background thread; the enqueue thread
+// merges them once done is set.
+struct LazyCompilation {
+  std::string source;
+  std::string options;
+  std::string optOptions;
+  int coarseningDirection;
+  unsigned int maxCoarseningFactor;
+  int seed;
+  cl_context context;
+  clCreateProgramWithSourceFunction originalCreateProgramWithSource;
+  clBuildProgramFunction originalBuildProgram;
+  std::vector<cl_device_id> devices;
+  InProcessCompiler *inProcessCompiler;
+  std::vector<CompilationJob> jobs;
+  std::thread worker;
+  std::atomic<bool> done;
+  bool started;
+
+  LazyCompilation() : done(false), started(false) {}
+
+  ~LazyCompilation() {
+    if (worker.joinable()) {
+      worker.join();
+    }
+    delete inProcessCompiler;
+  }
+};
+
+//------------------------------------------------------------------------------
+std::string getBuildLog(cl_program program, cl_device_id device) {
+  size_t buildLogSize;
+  cl_int errorCode = clGetProgramBuildInfoWithNoTypeCastHack(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogSize);
+  verifyOutputCode(errorCode, "Error querying the build log size");
+  char* buildLogData = new char[buildLogSize+1];
+  errorCode = clGetProgramBuildInfoWithNoTypeCastHack(program, device, CL_PROGRAM_BUILD_LOG, buildLogSize, buildLogData, NULL);
+  verifyOutputCode(errorCode, "Error querying the build log");
+  buildLogData[buildLogSize] = '\0';
+  std::string buildLog(buildLogData);
+  delete [] buildLogData;
+  return buildLog;
+}
+
+//------------------------------------------------------------------------------
+std::vector<unsigned char> getProgramBinary(cl_program program) {
+  size_t binarySize = 0;
+  cl_int errorCode = clGetProgramInfoWithNoTypeCastHack(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+  verifyOutputCode(errorCode, "Error querying the program binary size");
+  std::vector<unsigned char> binary(binarySize);
+  unsigned char *binaryData = binary.data();
+  errorCode = clGetProgramInfoWithNoTypeCastHack(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binaryData, NULL);
+  verifyOutputCode(errorCode, "Error querying the program binary");
+  return binary;
+}
+
+//------------------------------------------------------------------------------
+// Fills in the resources of the kernel under test from the build log and the
+// output of the cache line re-use analysis.
+void parseJobResources(CompilationJob &job, const std::string &kernelName) {
+  // test whether kernel to be tested is in this file (program might keep kernels in separate .cl files)
+  size_t buildLogKernelName = job.buildLog.find("Function properties for " + kernelName);
+  job.hasResources = buildLogKernelName != std::string::npos;
+  if (job.hasResources) {
+    parseBuildLog(job.buildLog, kernelName, job.regs, job.smem, job.cmem);
+  }
+  job.isCacheDependent = job.cacheDependenceAnalysis ? parseCacheDependence(job.clrOutput, job.cdaLog) : false;
+  job.memoryCost = !job.analysisOptions.empty() ? parseMemoryCost(job.clrOutput) : -1;
+  job.reuseProfile = job.cacheDependenceAnalysis ? parseReuseProfile(job.clrOutput) : ReuseProfile();
+}
+
+//------------------------------------------------------------------------------
+// Creates and builds the program from a cached device binary. Returns 0 if
+// the driver rejects the binary, so that the caller can rebuild it.
+cl_program createProgramFromCache(const CachedProgram &cached,
+                                  const std::string &oclOptions,
+                                  cl_context context,
+                                  clBuildProgramFunction originalBuildProgram,
+                                  cl_uint num_devices,
+                                  const cl_device_id *device_list,
+                                  void (*pfn_notify)(cl_program, void *),
+                                  void *user_data) {
+  clCreateProgramWithBinaryFunction originalCreateProgramWithBinary =
+      getOriginalFunctions().createProgramWithBinary;
+
+  const unsigned char *binary = cached.binary.data();
+  size_t binarySize = cached.binary.size();
+  cl_int binaryStatus;
+  cl_int errorCode;
+  cl_program program = originalCreateProgramWithBinary(
+      context, num_devices, device_list, &binarySize, &binary, &binaryStatus, &errorCode);
+  if (errorCode != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+    return 0;
+  }
+
+  errorCode = originalBuildProgram(program, num_devices, device_list,
+                                   oclOptions.c_str(), pfn_notify, user_data);
+  if (errorCode != CL_SUCCESS) {
+    // clReleaseProgram is interposed and expects a ProgramDesc.
+    clReleaseProgramFunction originalReleaseProgram =
+        getOriginalFunctions().releaseProgram;
+    originalReleaseProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+//------------------------------------------------------------------------------
+// Runs the jobs on at most OCL_COMPILE_THREADS workers (one per hardware
+// thread by default). Failures are recorded in the job, not propagated.
+void runCompilationJobs(std::vector<CompilationJob> &jobs,
+                        const std::string &source,
+                        const std::string &kernelName,
+                        const char *options,
+                        cl_context context,
+                        clCreateProgramWithSourceFunction originalCreateProgramWithSource,
+                        clBuildProgramFunction originalBuildProgram,
+                        cl_uint num_devices,
+                        const cl_device_id *device_list,
+                        void (*pfn_notify)(cl_program, void *),
+                        void *user_data,
+                        InProcessCompiler *inProcessCompiler) {
+  unsigned int workersNumber = std::thread::hardware_concurrency();
+  if (getWrapperConfig().compileThreads > 0) {
+    workersNumber = getWrapperConfig().compileThreads;
+  }
+  workersNumber = std::max(1u, std::min<unsigned int>(workersNumber, jobs.size()));
+
+  // Binaries are device specific: the cache is only used for single device
+  // builds.
+  bool useCache = num_devices == 1 && isProgramCacheEnabled();
+  ProgramCacheKey cacheKey;
+  std::string oclOptions;
+  if (useCache) {
+    std::string clangOptions(options);
+    splitCompilerOptions(clangOptions, oclOptions);
+    cacheKey.source = source;
+    cacheKey.buildOptions = options;
+    cacheKey.deviceName = getDeviceInfoString(*device_list, CL_DEVICE_NAME);
+    cacheKey.driverVersion = getDeviceInfoString(*device_list, CL_DRIVER_VERSION);
+  }
+
+  std::atomic<unsigned int> nextJob(0);
+  auto worker = [&]() {
+    for (unsigned int index = nextJob++; index < jobs.size(); index = nextJob++) {
+      CompilationJob &job = jobs[index];
+      std::string key;
+      if (useCache) {
+        ProgramCacheKey jobKey = cacheKey;
+        jobKey.optOptions = job.optOptions;
+        // The file name of the launch context is the same in every run, its
+        // entry is what the analyses see.
+        jobKey.analysisOptions = (!job.analysisOptions.empty() ? job.analysisOptions + "\n" + getLaunchContextEntry(kernelName) : "") + "\n" + getEnvString("OCCUPANCY_REDUCTION");
+        jobKey.coarseningFactor = job.coarseningFactor;
+        key = computeProgramCacheKey(jobKey);
+
+        CachedProgram cached;
+        if (loadCachedProgram(key, cached)) {
+          job.program = createProgramFromCache(cached, oclOptions, context, originalBuildProgram, num_devices, device_list, pfn_notify, user_data);
+        }
+        if (job.program != 0) {
+          job.fromCache = true;
+          job.hasResources = cached.hasResources;
+          job.regs = cached.regs;
+          job.smem = cached.smem;
+          job.cmem = cached.cmem;
+          job.isCacheDependent = cached.isCacheDependent;
+          job.cdaLog = cached.cdaLog;
+          job.memoryCost = cached.memoryCost;
+          job.reuseProfile = cached.reuseProfile;
+          continue;
+        }
+      }
+
+      try {
+        std::string outputSource;
+        job.program = compileSingleCF(job.inputFile, options, job.optOptions, job.outputFile, job.seed, context, originalCreateProgramWithSource, originalBuildProgram,
+                                      num_devices, device_list, pfn_notify, user_data, job.analysisOptions,
+                                      job.inProcessCompiler != NULL ? job.inProcessCompiler : inProcessCompiler,
+                                      job.clrOutput, outputSource);
+        job.buildLog = getBuildLog(job.program, *device_list);
+        parseJobResources(job, kernelName);
+
+        if (useCache) {
+          CachedProgram cached;
+          cached.source = outputSource;
+          cached.binary = getProgramBinary(job.program);
+          cached.hasResources = job.hasResources;
+          cached.regs = job.regs;
+          cached.smem = job.smem;
+          cached.cmem = job.cmem;
+          cached.isCacheDependent = job.isCacheDependent;
+          cached.cdaLog = job.cdaLog;
+          cached.memoryCost = job.memoryCost;
+          cached.reuseProfile = job.reuseProfile;
+          storeCachedProgram(key, cached);
+        }
+      } catch (int e) {
+        job.failed = true;
+      }
+    }
+  };
+
+#ifdef __AXTOR_DEBUG_PRINT
+  std::cout << "Compiling " << jobs.size() << " programs on " << workersNumber << " workers" << std::endl;
+#endif
+  std::vector<std::thread> workers;
+  for (unsigned int index = 1; index < workersNumber; ++index) {
+    workers.push_back(std::thread(worker));
+  }
+  worker();
+  for (std::thread &thread : workers) {
+    thread.join();
+  }
+}
+
+//------------------------------------------------------------------------------
+std::string setCoarseningFactorOption(const std::string &optOptions, unsigned int coarseningFactor) {
+  const std::string cfFlag = " -coarsening-factor ";
+  std::string result = " " + optOptions;
+  size_t flagPos = result.find(cfFlag);
+  size_t argPos = flagPos == std::string::npos ? std::string::npos :
+                  result.find_first_not_of(" \t\n\r\\", flagPos + cfFlag.length());
+  if (argPos == std::string::npos)
+    return result.substr(0, flagPos) + cfFlag + std::to_string(coarseningFactor);
+  size_t argEndPos = result.find(" ", argPos);
+  result.replace(argPos, argEndPos-argPos, std::to_string(coarseningFactor));
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Appends the candidate builds for the factors of OCL_CANDIDATE_FACTORS
+// (powers of two by default) between firstCF and lastCF, skipping the ones
+// rejected by isValidFactor if given. The cache line re-use analysis runs
+// with CF 1.
+void addCandidateJobs(std::vector<CompilationJob> &jobs, const std::string &optOptions, int seed,
+                      unsigned int firstCF, unsigned int lastCF,
+                      std::function<bool(unsigned int)> isValidFactor = nullptr) {
+  const std::vector<unsigned int> &candidateFactors = getWrapperConfig().candidateFactors;
+  unsigned int ordinal = 0;
+  for (unsigned int coarseningFactor : candidateFactors) {
+    // The seed of a factor does not depend on the range being built.
+    ++ordinal;
+    if (coarseningFactor < firstCF || coarseningFactor > lastCF) {
+      continue;
+    }
+    if (isValidFactor && !isValidFactor(coarseningFactor)) {
+      continue;
+    }
+    std::string cfOptions = setCoarseningFactorOption(optOptions, coarseningFactor);
+#ifdef __AXTOR_DEBUG_PRINT
+    std::cout << "For CF = " << coarseningFactor << " new build string is: " << cfOptions << std::endl;
+#endif
+    jobs.push_back(CompilationJob(coarseningFactor, cfOptions, coarseningFactor == 1, seed * 100 + ordinal));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Every job gets its own copy of the source, the sed commands of the
+// external toolchain edit it in place.
+void writeJobInputs(std::vector<CompilationJob> &jobs, unsigned int jobsNumber, const std::string &source) {
+  for (unsigned int index = 0; index < jobsNumber; ++index) {
+    writeFile(jobs[index].inputFile, source);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Removes the copies of writeJobInputs and the output of axtor once the jobs
+// are done.
+void removeJobFiles(std::vector<CompilationJob> &jobs, unsigned int jobsNumber) {
+  for (unsigned int index = 0; index < jobsNumber; ++index) {
+    unlink(jobs[index].inputFile.c_str());
+    unlink(jobs[index].outputFile.c_str());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Merges the results of the candidate jobs in factor order, stopping at the
+// first failure as the sequential sweep did.
+void mergeCandidateJobs(std::vector<CompilationJob> &jobs, unsigned int jobsNumber,
+                        const std::string &kernelName, int coarseningDirection,
+                        std::map<unsigned int, cl_program> &coarsenedPrograms) {
+  clReleaseProgramFunction originalReleaseProgram =
+      getOriginalFunctions().releaseProgram;
+
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  bool sweepFailed = false;
+  for (unsigned int index = 0; index < jobsNumber; ++index) {
+    CompilationJob &job = jobs[index];
+    if (sweepFailed || job.failed) {
+      if (!sweepFailed) {
+        std::cout << "Caught exception when compiling for cf " << job.coarseningFactor << "\n";
+      }
+      sweepFailed = true;
+      if (job.program != 0) {
+        originalReleaseProgram(job.program);
+      }
+      continue;
+    }
+    // Kept to swap in the kernel of the chosen factor at launch time.
+    coarsenedPrograms[job.coarseningFactor] = job.program;
+#ifdef __AXTOR_DEBUG_PRINT
+    std::cout << "Build log size is " << job.buildLog.size() << (job.fromCache ? " (cached)" : "") << std::endl;
+    std::cout << "Build log:\n" << job.buildLog << std::endl;
+#endif
+
+    if (job.hasResources) {
+#ifdef __AXTOR_DEBUG_PRINT
+      std::cout << "Kernel " << kernelName << " with cf " << job.coarseningFactor << ": " << job.regs << " regs " << job.smem << " smem " << job.cmem << " cmem" << std::endl;
+      std::cout << "     --------------------------------    \n";
+#endif
+      KernelResources *resources = new KernelResources(job.regs, job.smem, job.cmem, job.coarseningFactor, coarseningDirection, job.isCacheDependent, job.cdaLog, job.memoryCost);
+      resources->reuseProfile = job.reuseProfile;
+      kernelResources[kernelName].push_back(resources);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// The dynamic build, kept as the one of CF 1, runs any factor: it is shared by
+// every candidate factor up to maxCoarseningFactor, with the same resources.
+void shareDynamicBuild(const std::string &kernelName, unsigned int maxCoarseningFactor,
+                       int coarseningDirection,
+                       std::map<unsigned int, cl_program> &coarsenedPrograms) {
+  clRetainProgramFunction originalRetainProgram =
+      getOriginalFunctions().retainProgram;
+
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  std::map<unsigned int, cl_program>::iterator dynamicBuild = coarsenedPrograms.find(1);
+  if (dynamicBuild == coarsenedPrograms.end()) {
+    return;
+  }
+  KernelResources *resources = NULL;
+  for (KernelResources *candidate : kernelResources[kernelName]) {
+    if (candidate->cf == 1) {
+      resources = candidate;
+    }
+  }
+
+  for (unsigned int coarseningFactor : getWrapperConfig().candidateFactors) {
+    if (coarseningFactor == 1 || coarseningFactor > maxCoarseningFactor) {
+      continue;
+    }
+    // Every entry of coarsenedPrograms is released with the program.
+    originalRetainProgram(dynamicBuild->second);
+    coarsenedPrograms[coarseningFactor] = dynamicBuild->second;
+    if (resources != NULL) {
+      kernelResources[kernelName].push_back(new KernelResources(resources->regs, resources->smem, resources->cmem, coarseningFactor, coarseningDirection, resources->isCacheDependent, resources->cdaLog, -1));
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
 cl_program compileAllCF(std::string &inputFile,
+                        const std::string &source,
                         const char *options,
 			std::string &outputFile,
 			int seed,
@@ -404,129 +1034,131 @@ cl_program compileAllCF(std::string &inputFile,
 			cl_uint num_devices,
                         const cl_device_id *device_list,
                         void (*pfn_notify)(cl_program, void *),
-                        void *user_data)
+                        void *user_data,
+                        InProcessCompiler *inProcessCompiler,
+                        std::map<unsigned int, cl_program> &coarsenedPrograms,
+                        LazyCompilation **lazyCompilation)
 {
-  std::string optOptionsOriginal = getEnvString(OCL_COMPILER_OPTIONS);
+  std::string optOptionsOriginal = getWrapperConfig().compilerOptions;
   // std::cout << "Entering compileAllCF with OCL_COMPILER_OPTIONS=" << optOptionsOriginal << std::endl;
-  std::string kernelName = getEnvString(TC_KERNEL_NAME);
-  
+  std::string kernelName = getWrapperConfig().kernelName;
+
+  std::string verboseOptions(options != NULL ? options : "");
+  if (verboseOptions.find("-cl-nv-verbose") == std::string::npos) {
+    verboseOptions.append(" -cl-nv-verbose");
+  }
+
+  // The candidate factors first, in increasing order, then the default
+  // compile with the original build string.
+  std::vector<CompilationJob> jobs;
+  int coarseningDirection = 0;
+  // In dynamic mode a single build, with the factor as a hidden argument,
+  // replaces the candidate builds. Thread level coarsening cannot loop over
+  // the threads of a work-group across a barrier.
+  std::string dynamicSource = source;
+  bool isDynamic = maxCoarseningFactor > 0 && getWrapperConfig().dynamicCoarsening &&
+                   (!getWrapperConfig().threadLevelCoarsening || source.find("barrier") == std::string::npos);
+  if (isDynamic && !addCoarseningFactorArg(dynamicSource, kernelName)) {
+    // Programs without the kernel under test are built as they are.
+    if (!kernelName.empty() && source.find(kernelName) != std::string::npos) {
+      std::cout << "Error: cannot find the signature of kernel " << kernelName << " for " OCL_DYNAMIC_COARSENING << std::endl;
+      exit(1);
+    }
+    isDynamic = false;
+  }
+  InProcessCompiler *dynamicCompiler = NULL;
   if (maxCoarseningFactor > 0) {
     
-    const std::string cfFlag = " -coarsening-factor ";
-    const std::string cdFlag = " -coarsening-direction ";
-    size_t cfStart = optOptionsOriginal.find(cfFlag);
-    size_t cdStart = optOptionsOriginal.find(cdFlag);
-    size_t cdArgStartPos = optOptionsOriginal.find_first_not_of(" \t\n\r\\", cdStart + cdFlag.length());
-    size_t cdArgEndPos = optOptionsOriginal.find(" ", cdArgStartPos);
-    int coarseningDirection = std::stoi(optOptionsOriginal.substr(cdArgStartPos, cdArgEndPos-cdArgStartPos));
+    // readWrapperConfig turns the sweep off without -coarsening-factor.
+    coarseningDirection = getCoarseningOptions(optOptionsOriginal).second;
     
-    std::string verboseOptions(options != NULL ? options : "");
-    if (verboseOptions.find("-cl-nv-verbose") == std::string::npos) {
-      verboseOptions.append(" -cl-nv-verbose");
-    }
-    std::string optOptions = optOptionsOriginal;
-    size_t buildLogSize;
 #ifdef __AXTOR_DEBUG_PRINT
     std::cout << "Entering compile function for coarsening kernel " << kernelName << " with coarsening direction " << coarseningDirection << " and build string: " << optOptionsOriginal << std::endl;
 #endif
-    for (unsigned int coarseningFactor = 1; coarseningFactor <= maxCoarseningFactor; coarseningFactor <<= 1) {
-      bool cacheDependenceAnalysis = coarseningFactor == 1;
-      // setup
-      size_t argPos = optOptions.find_first_not_of(" \t\n\r\\", cfStart + cfFlag.length());
-      size_t argEndPos = optOptions.find(" ", argPos);
-      optOptions.replace(argPos, argEndPos-argPos, std::to_string(coarseningFactor));
-
-#ifdef __AXTOR_DEBUG_PRINT
-      std::cout << "For CF = " << coarseningFactor << " new build string is: " << optOptions << std::endl;
-#endif
-      // set up buildString (optOptions)
-      // call compile
-      cl_program program;
-      try {
-        program = compileSingleCF(inputFile, verboseOptions.c_str(), optOptions, outputFile, seed, context, originalCreateProgramWithSource, originalBuildProgram,
-                                             num_devices, device_list, pfn_notify, user_data, cacheDependenceAnalysis);
-      } catch (int e) {
-        std::cout << "Caught exception when compiling for cf " << coarseningFactor << "\n";
-        break;
-      }
-      cl_int errorCode = clGetProgramBuildInfoWithNoTypeCastHack(program, *device_list, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogSize);
-      //cl_build_status sts;
-      //cl_int errorCode = clGetProgramBuildInfoWithNoTypeCastHack(program, NULL, CL_PROGRAM_BUILD_STATUS, 0, NULL, &buildLogSize);
-      verifyOutputCode(errorCode, "Error querying the build log size");
-      char* buildLogData = new char[buildLogSize+1];
-      errorCode = clGetProgramBuildInfoWithNoTypeCastHack(program, *device_list, CL_PROGRAM_BUILD_LOG, buildLogSize, buildLogData, NULL);
-
-      verifyOutputCode(errorCode, "Error querying the build log");
-      std::string buildLog(buildLogData);
-      delete [] buildLogData;
-#ifdef __AXTOR_DEBUG_PRINT
-      std::cout << "Build log size is " << buildLogSize << std::endl;
-      std::cout << "Build log:\n" << buildLog << std::endl;
-#endif
-
-      // test whether kernel to be tested is in this file (program might keep kernels in separate .cl files)
-      size_t buildLogKernelName = buildLog.find("Function properties for " + kernelName);
-      if (buildLogKernelName != std::string::npos) {
-	int regs = 0;
-	int smem = 0;
-	int cmem = 0;
-	parseBuildLog(buildLog, kernelName, regs, smem, cmem);
-	std::string cdaLog;
-	bool isCacheDependent = cacheDependenceAnalysis ? parseCacheDependence(seed, cdaLog) : false;
-
-#ifdef __AXTOR_DEBUG_PRINT
-	std::cout << "Kernel " << kernelName << " with cf " << coarseningFactor << ": " << regs << " regs " << smem << " smem " << cmem << " cmem" << std::endl;
-	std::cout << "     --------------------------------    \n";
-#endif
-	kernelResources[kernelName].push_back(new KernelResources(regs, smem, cmem, coarseningFactor, coarseningDirection, isCacheDependent, cdaLog));
+    if (isDynamic) {
+      std::string dynamicOptions = setCoarseningFactorOption(optOptionsOriginal, 1) + " -coarsening-factor-arg " COARSENING_FACTOR_ARG
+                                   " -coarsening-groups-arg " COARSENING_GROUPS_ARG;
+      jobs.push_back(CompilationJob(1, dynamicOptions, true, seed * 100 + 1));
+      if (inProcessCompiler != NULL) {
+        std::string clangOptions(options != NULL ? options : "");
+        std::string oclOptions;
+        splitCompilerOptions(clangOptions, oclOptions);
+        dynamicCompiler = new InProcessCompiler(dynamicSource, clangOptions);
+        jobs.back().inProcessCompiler = dynamicCompiler;
       }
+    } else {
+      addCandidateJobs(jobs, optOptionsOriginal, seed, 1, lazyCompilation != NULL ? 1 : maxCoarseningFactor);
     }
   }
 
   // re-set original build string
-  // call compile and return its output
 #ifdef __AXTOR_DEBUG_PRINT
   std::cout << "Now running default compile with build string: " << optOptionsOriginal << std::endl;
 #endif
+  jobs.push_back(CompilationJob(0, optOptionsOriginal, false, seed));
+  // The build the application gets runs no analysis.
+  jobs.back().analysisOptions = "";
+  jobs.back().inputFile = inputFile;
+  jobs.back().outputFile = outputFile;
+
+  if (inProcessCompiler == NULL) {
+    writeJobInputs(jobs, jobs.size() - 1, isDynamic ? dynamicSource : source);
+  }
 
-  std::string verboseOptions(options != NULL ? options : "");
-  if (verboseOptions.find("-cl-nv-verbose") == std::string::npos) {
-    verboseOptions.append(" -cl-nv-verbose");
+  runCompilationJobs(jobs, source, kernelName, verboseOptions.c_str(), context, originalCreateProgramWithSource, originalBuildProgram,
+                     num_devices, device_list, pfn_notify, user_data, inProcessCompiler);
+  delete dynamicCompiler;
+  if (inProcessCompiler == NULL) {
+    removeJobFiles(jobs, jobs.size() - 1);
   }
-  size_t buildLogSize;
-  cl_program result = compileSingleCF(inputFile, verboseOptions.c_str()/*options*/, optOptionsOriginal, outputFile, seed, context, originalCreateProgramWithSource, originalBuildProgram,
-                                      num_devices, device_list, pfn_notify, user_data, false);
 
-  cl_int errorCode = clGetProgramBuildInfoWithNoTypeCastHack(result, *device_list, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogSize);
-  verifyOutputCode(errorCode, "Error querying the build log size");
-  char* buildLogData = new char[buildLogSize+1];
-  errorCode = clGetProgramBuildInfoWithNoTypeCastHack(result, *device_list, CL_PROGRAM_BUILD_LOG, buildLogSize, buildLogData, NULL);
+  mergeCandidateJobs(jobs, jobs.size() - 1, kernelName, coarseningDirection, coarsenedPrograms);
+  if (isDynamic) {
+    shareDynamicBuild(kernelName, maxCoarseningFactor, coarseningDirection, coarsenedPrograms);
+  }
 
-  verifyOutputCode(errorCode, "Error querying the build log");
-  std::string buildLog(buildLogData);
+  if (lazyCompilation != NULL) {
+    LazyCompilation *lazy = new LazyCompilation();
+    lazy->source = source;
+    lazy->options = verboseOptions;
+    lazy->optOptions = optOptionsOriginal;
+    lazy->coarseningDirection = coarseningDirection;
+    lazy->maxCoarseningFactor = maxCoarseningFactor;
+    lazy->seed = seed;
+    lazy->context = context;
+    lazy->originalCreateProgramWithSource = originalCreateProgramWithSource;
+    lazy->originalBuildProgram = originalBuildProgram;
+    lazy->devices.assign(device_list, device_list + num_devices);
+    lazy->inProcessCompiler = inProcessCompiler;
+    *lazyCompilation = lazy;
+  }
+
+  // the output of the default compile is returned
+  CompilationJob &defaultJob = jobs.back();
+  if (defaultJob.failed) {
+    throw 20;
+  }
+  cl_program result = defaultJob.program;
 #ifdef __AXTOR_DEBUG_PRINT
-  std::cout << "Build log: " << buildLog << std::endl;
+  std::cout << "Build log: " << defaultJob.buildLog << std::endl;
 #endif
 
-  size_t buildLogKernelName = buildLog.find("Function properties for " + kernelName);
-  if (buildLogKernelName != std::string::npos) {
-    int regs = 0;
-    int smem = 0;
-    int cmem = 0;
-    parseBuildLog(buildLog, kernelName, regs, smem, cmem);
+  if (defaultJob.hasResources) {
     if (kernelResources[kernelName].empty()) {
       // else, it already exists in the map
       // coarsening factor and direction would have to be parsed,
       // but the maths in calculateOccupancies() will work if cf is set to 1
-      kernelResources[kernelName].push_back(new KernelResources(regs, smem, cmem, 1, 1, false, ""));
+      kernelResources[kernelName].push_back(new KernelResources(defaultJob.regs, defaultJob.smem, defaultJob.cmem, 1, 1, false, "", -1));
     }
   }
 
   size_t bin_sz;
-  errorCode = clGetProgramInfoWithNoTypeCastHack(result, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &bin_sz, NULL);
+  cl_int errorCode = clGetProgramInfoWithNoTypeCastHack(result, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &bin_sz, NULL);
+  verifyOutputCode(errorCode, "Error querying the program binary size");
   // Read binary (PTX file) to memory buffer
   char *bin = (char *)malloc(bin_sz);
   errorCode = clGetProgramInfoWithNoTypeCastHack(result, CL_PROGRAM_BINARIES, sizeof(char *), &bin, NULL);
+  verifyOutputCode(errorCode, "Error querying the program binary");
   //unsigned char* bin = new unsigned char[bin_sz+1];
   //errorCode = clGetProgramInfoWithNoTypeCastHack(result, CL_PROGRAM_BINARIES, bin_sz, bin, NULL);
 
@@ -537,7 +1169,6 @@ cl_program compileAllCF(std::string &inputFile,
   fclose(fp);
 #endif
 
-  delete [] buildLogData;
   //delete [] bin;
   free(bin);
 
@@ -556,36 +1187,35 @@ cl_program compileSingleCF(std::string &inputFile,
                            const cl_device_id *device_list,
                            void (*pfn_notify)(cl_program, void *),
                            void *user_data,
-                           bool cacheDependenceAnalysis)
+                           const std::string &analysisOptions,
+                           InProcessCompiler *inProcessCompiler,
+                           std::string &clrOutput,
+                           std::string &outputSource)
 {
-  std::string oclOptions = compile(inputFile, options, optOptions, outputFile, seed, cacheDependenceAnalysis);
+  std::string oclOptions = compile(inputFile, options, optOptions, outputFile, seed, analysisOptions,
+                                   inProcessCompiler, outputSource, clrOutput);
 
   // Create the new program.
-  size_t outputSize;
-  const char *outputProgram;
+  const char *outputProgram = outputSource.c_str();
+  size_t outputSize = outputSource.size();
   cl_int errorCode;
 
-#ifdef PERFORM_AXTOR_COMPILE
-  outputProgram = readFile(outputFile.c_str(), &outputSize);
-#else
-  outputProgram = readFile(inputFile.c_str(), &outputSize); // read from file not processed by axtor
-#endif
- 
   cl_program program = originalCreateProgramWithSource(
-      context, 1, (const char **)&outputProgram, &outputSize, &errorCode);
+      context, 1, &outputProgram, &outputSize, &errorCode);
   verifyOutputCode(errorCode, "Error creating the new program");
 
   // Build the new program.
   errorCode = originalBuildProgram(program, num_devices, device_list,
                                    oclOptions.c_str(), pfn_notify, user_data);
   verifyOutputCode(errorCode, "Error building the new program");
-  delete[] outputProgram;
   return program;
 }
 
 //------------------------------------------------------------------------------
 std::string compile(std::string &inputFile, const char *options, std::string &optOptions,
-                    std::string &outputFile, int seed, bool cacheDependenceAnalysis) {
+                    std::string &outputFile, int seed, const std::string &analysisOptions,
+                    InProcessCompiler *inProcessCompiler,
+                    std::string &outputSource, std::string &clrOutput) {
   // Compile the program.
 
   if (options == NULL)
@@ -603,13 +1233,41 @@ std::string compile(std::string &inputFile, const char *options, std::string &op
 #ifdef __AXTOR_DEBUG_PRINT
   std::cout << "clangOptions: " << clangOptions << std::endl << "optOptions: " << optOptions << std::endl << "oclOptions: " << oclOptions << std::endl;
 #endif
+  if (inProcessCompiler != NULL) {
+    if (inProcessCompiler->coarsen(optOptions, analysisOptions, outputSource, clrOutput)) {
+      std::cout << "Error compiling with axtor\n";
+      exit(1);
+    }
+    return oclOptions;
+  }
+
 #ifdef PERFORM_AXTOR_COMPILE
-  if (compileWithAxtor(inputFile, clangOptions, optOptions, outputFile, seed, cacheDependenceAnalysis)) { //TODO: comment out
+  if (compileWithAxtor(inputFile, clangOptions, optOptions, outputFile, seed, analysisOptions)) { //TODO: comment out
     std::cout << "Error compiling with axtor\n";
     exit(1);
   }
 #endif
 
+  size_t outputSize;
+#ifdef PERFORM_AXTOR_COMPILE
+  char *outputProgram = readFile(outputFile.c_str(), &outputSize);
+#else
+  char *outputProgram = readFile(inputFile.c_str(), &outputSize); // read from file not processed by axtor
+#endif
+  outputSource.assign(outputProgram);
+  delete[] outputProgram;
+
+  if (!analysisOptions.empty()) {
+    std::string clrFile = getMangledFileName(CLR_FILE, seed);
+    char *clrProgram = readFile(clrFile.c_str(), &outputSize);
+    clrOutput.assign(clrProgram);
+    delete[] clrProgram;
+#ifndef __AXTOR_DEBUG_PRINT
+    std::string removeString = "rm " + clrFile;
+    system(removeString.c_str()); //retain intermediate files in debug mode
+#endif
+  }
+
   return oclOptions;
 }
 
@@ -639,22 +1297,25 @@ void calculateOccupancies(cl_uint work_dim, const size_t *global_work_size, cons
     numBlocks *= klc->gridDim[i];
   }
   for (int i = 0; i < work_dim; i++) {
+    klc->blockDim[i] = local_work_size[i];
     originalThreadsPerBlock *= local_work_size[i];
   }
   klc->numBlocks = numBlocks;
   klc->numThreadsPerBlock = originalThreadsPerBlock;
-  kernelLaunchConfig.emplace(kernelName, klc);
+  // The factors are checked against the latest NDRange of the kernel.
+  KernelLaunchConfig *&storedConfig = kernelLaunchConfig[kernelName];
+  delete storedConfig;
+  storedConfig = klc;
 
-  std::string applyThreadLevelCoarseningStr = getEnvString("THREAD_LEVEL_COARSENING");
-  bool isThreadLevelCoarsening = !applyThreadLevelCoarseningStr.empty();
+  const WrapperConfig &config = getWrapperConfig();
+  bool isThreadLevelCoarsening = config.threadLevelCoarsening;
 
 
   // set up device
-  //const int computeUnits = stoi(getEnvString("ARCH_COMPUTE_UNITS", "15")); // not needed here
-  const int maxActiveThreadsPerSMX = stoi(getEnvString("ARCH_ACTIVE_THREADS_PER_CU", "2048"));
-  const int maxBlocksPerSMX = stoi(getEnvString("ARCH_GROUPS_PER_CU", "16"));
-  const int maxRegsPerSMX = stoi(getEnvString("ARCH_REGS_PER_CU", "65536"));
-  const int maxSMemPerSMX = stoi(getEnvString("ARCH_SMEM_PER_CU", "49152"));
+  const int maxActiveThreadsPerSMX = config.maxActiveThreadsPerCU;
+  const int maxBlocksPerSMX = config.maxGroupsPerCU;
+  const int maxRegsPerSMX = config.maxRegsPerCU;
+  const int maxSMemPerSMX = config.maxSMemPerCU;
 
   for (std::vector<KernelResources*>::reverse_iterator coarsening = coarsenings.rbegin(); coarsening != coarsenings.rend(); coarsening++) {
     int threadsPerBlock = isThreadLevelCoarsening ? (originalThreadsPerBlock / (*coarsening)->cf) : originalThreadsPerBlock;
@@ -682,6 +1343,54 @@ void calculateOccupancies(cl_uint work_dim, const size_t *global_work_size, cons
 
 }
 
+//------------------------------------------------------------------------------
+// Largest factor allowed by the launch configuration: enough blocks left to
+// fill the device.
+void computeCoarseningBounds(const std::string &kernelName, int &maxCFByInputSize) {
+  // set up device
+  const int computeUnits = getWrapperConfig().computeUnits;
+  const int maxActiveThreadsPerSMX = getWrapperConfig().maxActiveThreadsPerCU;
+  const int maxBlocksPerSMX = getWrapperConfig().maxGroupsPerCU;
+
+  KernelLaunchConfig *config = kernelLaunchConfig[kernelName];
+  int maxExecutedBlocksPerRound = std::min(maxBlocksPerSMX, maxActiveThreadsPerSMX / config->numThreadsPerBlock) * computeUnits;
+  maxCFByInputSize = config->numBlocks < maxExecutedBlocksPerRound ? 1 : config->numBlocks / maxExecutedBlocksPerRound;
+}
+
+//------------------------------------------------------------------------------
+// The kernels built for one factor have no remainder handling: the grid, and
+// the block in thread level coarsening, must be divisible by the factor in
+// the coarsening direction. The dynamic build of block level coarsening skips
+// the work-groups beyond the original grid, which is then rounded up. Any
+// factor can be used, not just powers of two.
+bool isDivisibleFactor(const std::string &kernelName, unsigned int coarseningDirection, unsigned int cf) {
+  KernelLaunchConfig *config = kernelLaunchConfig[kernelName];
+  if (coarseningDirection >= 3) {
+    return false;
+  }
+  if (getWrapperConfig().threadLevelCoarsening) {
+    return config->gridDim[coarseningDirection] % cf == 0 && config->blockDim[coarseningDirection] % cf == 0;
+  }
+  return config->gridDim[coarseningDirection] % cf == 0 ||
+         (getWrapperConfig().dynamicCoarsening && cf <= (unsigned int)config->gridDim[coarseningDirection]);
+}
+
+//------------------------------------------------------------------------------
+// Memory cost per work-item of the application: a coarsened warp does the
+// work of cf warps. Negative if unknown.
+inline float getMemoryCost(const KernelResources *resources) {
+  return resources->memoryCost < 0 ? -1.0f : (float)resources->memoryCost / resources->cf;
+}
+
+// Factors are ranked by occupancy, then by memory cost among the factors with
+// the same number of active threads.
+inline bool isBetterCoarsening(int activeThreads, float memoryCost, int bestActiveThreads, float bestMemoryCost) {
+  if (activeThreads != bestActiveThreads) {
+    return activeThreads > bestActiveThreads;
+  }
+  return memoryCost >= 0 && bestMemoryCost >= 0 && memoryCost < bestMemoryCost;
+}
+
 //------------------------------------------------------------------------------
 void applyCoarseningModel(std::string kernelName) {
   std::vector<KernelResources*> coarsenings = kernelResources[kernelName];
@@ -694,91 +1403,247 @@ void applyCoarseningModel(std::string kernelName) {
     std::cout << "Did not store the number of requested blocks for kernel " << kernelName << std::endl;
   }
 
-  // set up device
-  const int computeUnits = stoi(getEnvString("ARCH_COMPUTE_UNITS", "15"));
-  const int maxActiveThreadsPerSMX = stoi(getEnvString("ARCH_ACTIVE_THREADS_PER_CU", "2048"));
-  const int maxBlocksPerSMX = stoi(getEnvString("ARCH_GROUPS_PER_CU", "16"));
-  const int maxRegsPerSMX = stoi(getEnvString("ARCH_REGS_PER_CU", "65536"));
-  const int maxSMemPerSMX = stoi(getEnvString("ARCH_SMEM_PER_CU", "49152"));
-
   int numBlocks = kernelLaunchConfig[kernelName]->numBlocks;
-  int originalThreadsPerBlock = kernelLaunchConfig[kernelName]->numThreadsPerBlock;
-  int maxExecutedBlocksPerRound = std::min(maxBlocksPerSMX, maxActiveThreadsPerSMX / originalThreadsPerBlock) * computeUnits;
-  int maxCFByInputSize = numBlocks < maxExecutedBlocksPerRound ? 1 : numBlocks / maxExecutedBlocksPerRound;
-  unsigned int maxCFByInputDivisibility = 1;
+  int maxCFByInputSize = 1;
   const unsigned int coarseningDirection = coarsenings.front()->direction; // TODO: this assumes constant direction among all coarsened kernels
-  while (kernelLaunchConfig[kernelName]->gridDim[coarseningDirection] > maxCFByInputDivisibility && kernelLaunchConfig[kernelName]->gridDim[coarseningDirection] % maxCFByInputDivisibility == 0) {
-    maxCFByInputDivisibility <<= 1;
-  }
+  computeCoarseningBounds(kernelName, maxCFByInputSize);
 
+  // The best factor overall, and the best one the launch configuration
+  // allows.
   int chosenCF = 0;
   int chosenCFMaxActiveThreads = 0;
+  float chosenCFMemoryCost = -1.0f;
   std::string limitingFactor;
+  int validCF = 0;
+  int validCFMaxActiveThreads = 0;
+  float validCFMemoryCost = -1.0f;
+  std::string validLimitingFactor;
   std::string prevLimitingFactor;
-  int maxCFByInputSize_maxActiveThreads = 0;
-  int maxCFByInputDivisibility_maxActiveThreads = 0;
+  std::string prevValidLimitingFactor;
+
+  // With the reuse distances of CF 1 the re-use a factor loses to the caches
+  // discounts its active threads, instead of keeping the kernel at CF 1.
+  const KernelResources *baseCoarsening = coarsenings.front();
+  bool hasReuseProfile = baseCoarsening->cf == 1 && baseCoarsening->reuseProfile.isValid();
 
   std::cout << "Found the following coarsenings for kernel " << kernelName << ": " << std::endl;
   for (std::vector<KernelResources*>::reverse_iterator coarsening = coarsenings.rbegin(); coarsening != coarsenings.rend(); coarsening++) {
     int achievableActiveThreads = (*coarsening)->achievableActiveThreads;
+    float memoryCost = getMemoryCost(*coarsening);
+    float reusePenalty = hasReuseProfile ? computeReusePenalty(baseCoarsening->reuseProfile, (*coarsening)->cf, achievableActiveThreads, baseCoarsening->achievableActiveThreads) : 0.0f;
+    achievableActiveThreads = (int)(achievableActiveThreads * (1.0f - reusePenalty));
     
     std::cout << (*coarsening)->cf << ": " << (*coarsening)->regs << " regs " << (*coarsening)->smem << " smem " << (*coarsening)->cmem << " cmem";// << std::endl;
     std::cout << "\tactive threads by regs: " << (*coarsening)->activeThreadsByRegs << ", block limit: " << (*coarsening)->activeThreadsByNumBlocks
               << ", smem: " << (*coarsening)->activeThreadsBySMem
-              << ", occupancy => " << ((*coarsening)->occupancy) << "%" << std::endl;
-    
-    if ((*coarsening)->cf == maxCFByInputSize) {
-      maxCFByInputSize_maxActiveThreads = achievableActiveThreads;
+              << ", occupancy => " << ((*coarsening)->occupancy) << "%";
+    if (memoryCost >= 0) {
+      std::cout << ", memory cost per work-item: " << memoryCost;
     }
-    if ((*coarsening)->cf == maxCFByInputDivisibility) {
-      maxCFByInputDivisibility_maxActiveThreads = achievableActiveThreads;
+    if (reusePenalty > 0) {
+      std::cout << ", re-use lost to the caches: " << (reusePenalty * 100) << "%";
     }
+    std::cout << std::endl;
     
-    if (achievableActiveThreads > chosenCFMaxActiveThreads) {
+    std::string currentLimitingFactor = getPotentialLimitingFactor((*coarsening)->activeThreadsByRegs, (*coarsening)->activeThreadsBySMem, (*coarsening)->activeThreadsByNumBlocks);
+    if (isBetterCoarsening(achievableActiveThreads, memoryCost, chosenCFMaxActiveThreads, chosenCFMemoryCost)) {
       chosenCF = (*coarsening)->cf;
       chosenCFMaxActiveThreads = achievableActiveThreads;
-      limitingFactor = prevLimitingFactor.empty() ? getPotentialLimitingFactor((*coarsening)->activeThreadsByRegs, (*coarsening)->activeThreadsBySMem, (*coarsening)->activeThreadsByNumBlocks) : prevLimitingFactor;
+      chosenCFMemoryCost = memoryCost;
+      limitingFactor = prevLimitingFactor.empty() ? currentLimitingFactor : prevLimitingFactor;
+    }
+    prevLimitingFactor = currentLimitingFactor;
+
+    bool isValid = (*coarsening)->cf <= maxCFByInputSize && isDivisibleFactor(kernelName, coarseningDirection, (*coarsening)->cf);
+    if (isValid && isBetterCoarsening(achievableActiveThreads, memoryCost, validCFMaxActiveThreads, validCFMemoryCost)) {
+      validCF = (*coarsening)->cf;
+      validCFMaxActiveThreads = achievableActiveThreads;
+      validCFMemoryCost = memoryCost;
+      validLimitingFactor = prevValidLimitingFactor.empty() ? currentLimitingFactor : prevValidLimitingFactor;
+    }
+    if (isValid) {
+      prevValidLimitingFactor = currentLimitingFactor;
     }
-    prevLimitingFactor = getPotentialLimitingFactor((*coarsening)->activeThreadsByRegs, (*coarsening)->activeThreadsBySMem, (*coarsening)->activeThreadsByNumBlocks);
   }
   if (chosenCF > maxCFByInputSize) {
-    chosenCF = maxCFByInputSize;
-    chosenCFMaxActiveThreads = maxCFByInputSize_maxActiveThreads;
+    chosenCF = validCF;
+    chosenCFMaxActiveThreads = validCFMaxActiveThreads;
     limitingFactor = "input size (" + std::to_string(numBlocks) + " blocks)";
-  } else if (chosenCF > maxCFByInputDivisibility) {
-    chosenCF = maxCFByInputDivisibility;
-    chosenCFMaxActiveThreads = maxCFByInputDivisibility_maxActiveThreads;
+  } else if (chosenCF != validCF) {
+    chosenCF = validCF;
+    chosenCFMaxActiveThreads = validCFMaxActiveThreads;
     limitingFactor = "input divisibility";
   }
   int theoreticalCF = chosenCF;
-  if (coarsenings.front()->cf == 1 && coarsenings.front()->isCacheDependent) {
+  if (coarsenings.front()->cf == 1 && coarsenings.front()->isCacheDependent && !hasReuseProfile) {
     limitingFactor = "cache line re-use (" + coarsenings.front()->cdaLog + ")";
     chosenCF = 1;
   }
   std::cout << "Program has " << (coarsenings.front()->isCacheDependent ? "" : "no ") << "cache line re-use" << std::endl;
   std::cout << "Model prediction for kernel//blocks//theoretical cf//chosen cf//dir//limiting factor: " << kernelName << "\t" << numBlocks << "\t" << theoreticalCF << "\t" << chosenCF << "\t" << coarseningDirection << "\t" << limitingFactor << std::endl;
   chosenCFs[kernelName] = chosenCF;
+  limitingFactors[kernelName] = limitingFactor;
 }
 
-cl_int clEnqueueNDRangeKernel(
-    cl_command_queue command_queue, cl_kernel kernel, cl_uint work_dim,
-    const size_t *global_work_offset, const size_t *global_work_size,
-    const size_t *local_work_size, cl_uint num_events_in_wait_list,
-    const cl_event *event_wait_list, cl_event *event) {
+//------------------------------------------------------------------------------
+LazyCompilation *getLazyCompilation(cl_kernel kernel) {
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  std::map<cl_kernel, KernelDesc *>::iterator desc = kernels.find(kernel);
+  if (desc == kernels.end() || desc->second->program == NULL) {
+    return NULL;
+  }
+  return desc->second->program->lazyCompilation;
+}
 
-  // Setup the event to measure the kernel execution time.
-  bool isEventNull = false;
-  if (event == NULL) {
-    isEventNull = true;
-    event = new cl_event();
+//------------------------------------------------------------------------------
+// Starts compiling, in the background, the factors that the launch
+// configuration does not rule out. The baseline keeps running meanwhile.
+void startLazyCompilation(cl_kernel kernel, const std::string &kernelName) {
+  std::lock_guard<std::mutex> lock(lazyCompilationMutex);
+  LazyCompilation *lazy = getLazyCompilation(kernel);
+  if (lazy == NULL || lazy->started) {
+    return;
+  }
+  lazy->started = true;
+
+  int maxCFByInputSize = 1;
+  computeCoarseningBounds(kernelName, maxCFByInputSize);
+  unsigned int lastCF = std::min(lazy->maxCoarseningFactor, (unsigned int)maxCFByInputSize);
+  unsigned int coarseningDirection = lazy->coarseningDirection;
+  addCandidateJobs(lazy->jobs, lazy->optOptions, lazy->seed, 2, lastCF,
+                   [kernelName, coarseningDirection](unsigned int cf) {
+                     return isDivisibleFactor(kernelName, coarseningDirection, cf);
+                   });
+#ifdef __AXTOR_DEBUG_PRINT
+  std::cout << "Lazily compiling " << lazy->jobs.size() << " factors up to " << lastCF << " for kernel " << kernelName << std::endl;
+#endif
+  if (lazy->jobs.empty()) {
+    lazy->done = true;
+    return;
+  }
+
+  if (lazy->inProcessCompiler == NULL) {
+    writeJobInputs(lazy->jobs, lazy->jobs.size(), lazy->source);
+  }
+  lazy->worker = std::thread([lazy, kernelName]() {
+    // The application has already been notified of its build.
+    runCompilationJobs(lazy->jobs, lazy->source, kernelName, lazy->options.c_str(), lazy->context,
+                       lazy->originalCreateProgramWithSource, lazy->originalBuildProgram,
+                       lazy->devices.size(), lazy->devices.data(), NULL, NULL, lazy->inProcessCompiler);
+    if (lazy->inProcessCompiler == NULL) {
+      removeJobFiles(lazy->jobs, lazy->jobs.size());
+    }
+    lazy->done = true;
+  });
+}
+
+//------------------------------------------------------------------------------
+// Returns false while the factors of the kernel's program are still being
+// compiled. Once they are done, their resources and programs are merged with
+// the ones of CF 1.
+bool mergeLazyCompilation(cl_kernel kernel, const std::string &kernelName) {
+  std::lock_guard<std::mutex> lock(lazyCompilationMutex);
+  LazyCompilation *lazy = getLazyCompilation(kernel);
+  if (lazy == NULL) {
+    return true;
+  }
+  if (!lazy->done) {
+    return false;
+  }
+
+  if (lazy->worker.joinable()) {
+    lazy->worker.join();
+  }
+  ProgramDesc *desc = NULL;
+  {
+    std::lock_guard<std::mutex> kernelsLock(kernelsMutex);
+    desc = kernels[kernel]->program;
+  }
+  mergeCandidateJobs(lazy->jobs, lazy->jobs.size(), kernelName, lazy->coarseningDirection, desc->coarsenedPrograms);
+  desc->lazyCompilation = NULL;
+  delete lazy;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+void releaseLazyCompilation(ProgramDesc *desc) {
+  std::lock_guard<std::mutex> lock(lazyCompilationMutex);
+  LazyCompilation *lazy = desc->lazyCompilation;
+  if (lazy == NULL) {
+    return;
+  }
+  if (lazy->worker.joinable()) {
+    lazy->worker.join();
+  }
+
+  clReleaseProgramFunction originalReleaseProgram =
+      getOriginalFunctions().releaseProgram;
+  for (CompilationJob &job : lazy->jobs) {
+    if (job.program != 0) {
+      originalReleaseProgram(job.program);
+    }
+  }
+  desc->lazyCompilation = NULL;
+  delete lazy;
+}
+
+//------------------------------------------------------------------------------
+KernelDesc *getKernelDesc(cl_kernel kernel) {
+  std::lock_guard<std::mutex> lock(kernelsMutex);
+  KernelDesc *&desc = kernels[kernel];
+  if (desc == NULL) {
+    desc = new KernelDesc(NULL, getKernelName(kernel));
   }
+  return desc;
+}
 
-  std::string kernelName = getKernelName(kernel);
-  std::string envKernelName = getEnvString("TC_KERNEL_NAME");
+//------------------------------------------------------------------------------
+// Records, for the analyses of the next builds, the NDRange and the scalar
+// arguments of the kernel as the default build runs it.
+void recordKernelLaunch(KernelDesc *desc, cl_uint work_dim,
+                        const size_t *global_work_size, const size_t *local_work_size) {
+  LaunchContext context;
+  context.workDim = work_dim;
+  memcpy(context.globalSize, global_work_size, work_dim * sizeof(size_t));
+  memcpy(context.localSize, local_work_size, work_dim * sizeof(size_t));
+  {
+    std::lock_guard<std::mutex> lock(kernelsMutex);
+    for (const auto &arg : desc->args) {
+      const KernelArg &value = arg.second;
+      if (value.isNull || value.value.size() != value.size) {
+        continue;
+      }
+      if (value.size == sizeof(cl_char)) {
+        cl_char integer;
+        memcpy(&integer, value.value.data(), sizeof(integer));
+        context.arguments[arg.first] = integer;
+      } else if (value.size == sizeof(cl_short)) {
+        cl_short integer;
+        memcpy(&integer, value.value.data(), sizeof(integer));
+        context.arguments[arg.first] = integer;
+      } else if (value.size == sizeof(cl_int)) {
+        cl_int integer;
+        memcpy(&integer, value.value.data(), sizeof(integer));
+        context.arguments[arg.first] = integer;
+      }
+    }
+  }
+  recordLaunchContext(desc->name, context);
+}
 
-  size_t *newGlobalSize = new size_t[work_dim];
-  size_t *newLocalSize = new size_t[work_dim];
-  size_t *real_local_work_size = new size_t[work_dim];
+//------------------------------------------------------------------------------
+// Runs the model for a new NDRange and stores the kernel and sizes to launch
+// in the kernel's launch descriptor.
+bool prepareLaunch(KernelDesc *desc, cl_kernel kernel, cl_uint work_dim,
+                   const size_t *global_work_size, const size_t *local_work_size) {
+  const WrapperConfig &config = getWrapperConfig();
+  const std::string &kernelName = desc->name;
+  LaunchDesc &launch = desc->launch;
+  launch.isValid = false;
+  launch.kernel = kernel;
+  launch.hasNewLocalSize = true;
+
+  size_t real_local_work_size[3];
 
   // handle the case that local_work_size is NULL - take a best guess
   if (local_work_size == NULL) {
@@ -796,62 +1661,136 @@ cl_int clEnqueueNDRangeKernel(
     memcpy(real_local_work_size, local_work_size, work_dim * sizeof(size_t));
   }
 
-  if (kernelName != envKernelName) {
+  bool isCompilationPending = false;
+  unsigned int launchedCoarseningFactor = 1;
+  std::string limitingFactor;
+  if (kernelName != config.kernelName) {
 #ifdef __AXTOR_DEBUG_PRINT
     std::cout << "No coarsening for: " << kernelName << "\n";
     std::cout << "gws " << work_dim << " " << global_work_size[0] << "\n";
 #endif
-    memcpy(newGlobalSize, global_work_size, work_dim * sizeof(size_t));
-    memcpy(newLocalSize, real_local_work_size, work_dim * sizeof(size_t));
+    memcpy(launch.newGlobalSize, global_work_size, work_dim * sizeof(size_t));
+    memcpy(launch.newLocalSize, real_local_work_size, work_dim * sizeof(size_t));
   } else {
-    calculateOccupancies(work_dim, global_work_size, real_local_work_size, kernelName);
-    std::string testMaxCoarseningFactor = getEnvString("MAX_COARSENING_FACTOR");
-    int maxCoarseningFactor = 0;
-    if (!testMaxCoarseningFactor.empty()) {
-      maxCoarseningFactor = std::stoi(testMaxCoarseningFactor);
+    unsigned int maxCoarseningFactor = config.maxCoarseningFactor;
+    unsigned int coarseningFactor = config.coarseningFactor;
+    bool isModelChoice = false;
+    if (isLaunchContextEnabled()) {
+      recordKernelLaunch(desc, work_dim, global_work_size, real_local_work_size);
     }
-    if (maxCoarseningFactor > 0) {
+    // In lazy mode the default build runs until the other factors are ready.
+    isCompilationPending = maxCoarseningFactor > 0 && !mergeLazyCompilation(kernel, kernelName);
+    calculateOccupancies(work_dim, global_work_size, real_local_work_size, kernelName);
+    if (isCompilationPending) {
+      startLazyCompilation(kernel, kernelName);
+    } else if (maxCoarseningFactor > 0) {
       applyCoarseningModel(kernelName);
       if (chosenCFs.count(kernelName) > 0) {
         // select coarsening factor chosen by model prediction
-        setenv("CF_OVERRIDE", std::to_string(chosenCFs[kernelName]).c_str(), 1);
+        coarseningFactor = chosenCFs[kernelName];
+        isModelChoice = true;
+        // and launch the kernel built for it
+        cl_kernel coarsenedKernel = getCoarsenedKernel(kernel, coarseningFactor);
+        if (coarsenedKernel != NULL) {
+          launch.kernel = coarsenedKernel;
+        } else {
+          std::cout << "No build for cf " << coarseningFactor << ", launching the default kernel\n";
+        }
+        limitingFactor = limitingFactors[kernelName];
       }
     }
-    bool NDRangeResult =
+    launchedCoarseningFactor = coarseningFactor;
+    // The model only searches the factors along the coarsening direction;
+    // otherwise every dimension is scaled as the kernel was built.
+    bool NDRangeResult = isModelChoice ?
+        computeNDRangeDim(work_dim, global_work_size, real_local_work_size,
+                          launch.newGlobalSize, launch.newLocalSize,
+                          coarseningFactor, config.coarseningDirection) :
         computeNDRangeDim(work_dim, global_work_size, real_local_work_size,
-                          newGlobalSize, newLocalSize);
+                          launch.newGlobalSize, launch.newLocalSize);
 
     if (NDRangeResult == false) {
-      if (memcmp(global_work_size, newGlobalSize, work_dim * sizeof(size_t)) ==
+      if (memcmp(global_work_size, launch.newGlobalSize, work_dim * sizeof(size_t)) ==
           0) {
-        newLocalSize = NULL;
+        launch.hasNewLocalSize = false;
       } else {
         std::cout << "Cannot apply coarsening when local work size is null\n";
-        return 1;
+        return false;
       }
     }
+
+    // The dynamic build of block level coarsening skips the work-groups
+    // beyond the original grid, so the grid is rounded up to the factor.
+    unsigned int direction = config.coarseningDirection;
+    if (launch.kernel != kernel && desc->groupsArg > 0 && direction < work_dim) {
+      cl_uint groups = global_work_size[direction] / real_local_work_size[direction];
+      if (!config.threadLevelCoarsening) {
+        launch.newGlobalSize[direction] = (groups + coarseningFactor - 1) / coarseningFactor * real_local_work_size[direction];
+      }
+      cl_int errorCode = getOriginalFunctions().setKernelArg(launch.kernel, desc->groupsArg, sizeof(cl_uint), &groups);
+      verifyOutputCode(errorCode, "Error setting the work-group count argument");
+    }
   }
 
-  std::string repetitionsString = getEnvString(OCL_REPETITIONS);
-  unsigned int repetitions;
-  if (repetitionsString != "")
-    std::istringstream(repetitionsString) >> repetitions;
-  else
-    repetitions = 1;
+  // The decision is final unless factors are still being compiled.
+  launch.workDim = work_dim;
+  launch.hasLocalSize = local_work_size != NULL;
+  memcpy(launch.globalSize, global_work_size, work_dim * sizeof(size_t));
+  if (launch.hasLocalSize) {
+    memcpy(launch.localSize, local_work_size, work_dim * sizeof(size_t));
+  }
+  launch.isValid = !isCompilationPending;
+
+  if (isLaunchTraceEnabled()) {
+    LaunchTraceInfo &info = launch.traceInfo;
+    info.kernelName = internProfileString(kernelName);
+    info.limitingFactor = internProfileString(limitingFactor);
+    info.coarseningFactor = launchedCoarseningFactor;
+    info.coarseningDirection = config.coarseningDirection;
+    info.workDim = work_dim;
+    memcpy(info.globalSize, global_work_size, work_dim * sizeof(size_t));
+    for (unsigned int index = 0; index < work_dim; ++index) {
+      info.localSize[index] = launch.hasLocalSize ? local_work_size[index] : 0;
+    }
+  }
+  return true;
+}
 
-  enqueueKernel(command_queue, kernel, work_dim, global_work_offset,
-                newGlobalSize, newLocalSize, num_events_in_wait_list,
-                event_wait_list, event, repetitions, kernelName);
+//------------------------------------------------------------------------------
+cl_int clEnqueueNDRangeKernel(
+    cl_command_queue command_queue, cl_kernel kernel, cl_uint work_dim,
+    const size_t *global_work_offset, const size_t *global_work_size,
+    const size_t *local_work_size, cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event) {
+  if (work_dim >= 4) {
+    std::cout << "4 or more dimensions are not supported by the wrapper.\n";
+    exit(1);
+  }
 
+  // Setup the event to measure the kernel execution time.
+  cl_event localEvent;
+  bool isEventNull = event == NULL;
   if (isEventNull) {
-    clReleaseEvent(*event);
-    delete event;
-    event = NULL;
+    event = &localEvent;
+  }
+
+  // Fast path: same kernel, same NDRange as the last launch.
+  KernelDesc *desc = getKernelDesc(kernel);
+  LaunchDesc &launch = desc->launch;
+  if (!launch.matches(work_dim, global_work_size, local_work_size) &&
+      !prepareLaunch(desc, kernel, work_dim, global_work_size, local_work_size)) {
+    return 1;
   }
 
-  delete[] newGlobalSize;
-  delete[] newLocalSize;
-  delete[] real_local_work_size;
+  enqueueKernel(command_queue, launch.kernel, work_dim, global_work_offset,
+                launch.newGlobalSize, launch.hasNewLocalSize ? launch.newLocalSize : NULL,
+                num_events_in_wait_list, event_wait_list, event,
+                getWrapperConfig().repetitions, desc->name,
+                isLaunchTraceEnabled() ? &launch.traceInfo : NULL);
+
+  if (isEventNull) {
+    clReleaseEvent(*event);
+  }
 
   return CL_SUCCESS;
 }
@@ -861,9 +1800,8 @@ cl_command_queue clCreateCommandQueue(cl_context context, cl_device_id device,
                                       cl_command_queue_properties properties,
                                       cl_int *errcode_ret) {
   // Get pointer to original function calls.
-  clCreateCommandQueueFunction originalclCreateCommandQueue;
-  *(void **)(&originalclCreateCommandQueue) =
-      dlsym(RTLD_NEXT, CL_CREATE_COMMAND_QUEUE_NAME);
+  clCreateCommandQueueFunction originalclCreateCommandQueue =
+      getOriginalFunctions().createCommandQueue;
 
   properties = properties | CL_QUEUE_PROFILING_ENABLE;
 
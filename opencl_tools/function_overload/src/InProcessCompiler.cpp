@@ -0,0 +1,382 @@
+#include "InProcessCompiler.h"
+
+#include "Utils.h"
+
+#include <iostream>
+
+#ifdef AXTOR_IN_PROCESS
+
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Lex/PreprocessorOptions.h"
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "axtor/Axtor.h"
+#include "axtor_ocl/OCLBackend.h"
+#include "axtor_ocl/OCLModuleInfo.h"
+
+#include <cctype>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#define IN_PROCESS_SOURCE_NAME "ocl_input.cl"
+#define CLEAR_OPTION_LISTS_NAME "clearThrudOptionLists"
+
+using namespace llvm;
+
+// The pass registry and the cl::opt values of the Thrud passes are global to
+// the process: the whole pipeline runs under this lock.
+static std::mutex pipelineMutex;
+
+//------------------------------------------------------------------------------
+struct InProcessModule {
+  LLVMContext context;
+  std::unique_ptr<Module> module;
+};
+
+//------------------------------------------------------------------------------
+// One element of an opt-like command line: either a registered pass or a
+// standard -O<n> pipeline.
+struct PipelineStep {
+  const PassInfo *pass;
+  unsigned int optLevel;
+};
+
+struct Pipeline {
+  std::vector<PipelineStep> steps;
+  std::vector<std::string> flags;
+};
+
+// Support functions.
+//------------------------------------------------------------------------------
+static void initializeLLVM() {
+  static std::once_flag initialized;
+  std::call_once(initialized, []() {
+    PassRegistry &registry = *PassRegistry::getPassRegistry();
+    initializeCore(registry);
+    initializeScalarOpts(registry);
+    initializeVectorization(registry);
+    initializeIPO(registry);
+    initializeAnalysis(registry);
+    initializeIPA(registry);
+    initializeTransformUtils(registry);
+    initializeInstCombine(registry);
+    initializeTarget(registry);
+    axtor::initialize(true);
+  });
+}
+
+//------------------------------------------------------------------------------
+static bool loadPlugin(const std::string &path) {
+  static std::set<std::string> loaded;
+  if (loaded.count(path) != 0)
+    return true;
+
+  std::string error;
+  if (sys::DynamicLibrary::LoadLibraryPermanently(path.c_str(), &error)) {
+    std::cout << "Cannot load " << path << ": " << error << "\n";
+    return false;
+  }
+  loaded.insert(path);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Same rewriting as the two sed commands of compileWithAxtor: the first
+// match on every line only.
+static std::string makeInlineStatic(const std::string &source) {
+  std::istringstream input(source);
+  std::string result;
+  std::string line;
+  while (std::getline(input, line)) {
+    size_t position = line.find("__inline");
+    if (position != std::string::npos)
+      line.replace(position, 8, "inline");
+
+    size_t staticPosition = line.find("static inline");
+    position = line.find("inline");
+    if (staticPosition == std::string::npos && position != std::string::npos)
+      line.replace(position, 6, "static inline");
+
+    result += line + "\n";
+  }
+  return result;
+}
+
+//------------------------------------------------------------------------------
+static std::vector<std::string> tokenize(const std::string &options) {
+  std::istringstream iss(options);
+  return std::vector<std::string>(std::istream_iterator<std::string>(iss),
+                                  std::istream_iterator<std::string>());
+}
+
+//------------------------------------------------------------------------------
+// Splits an opt command line into passes and cl::opt flags, loading the
+// plugins named by -load on the way.
+static bool parsePipeline(const std::string &options, Pipeline &pipeline) {
+  std::vector<std::string> tokens = tokenize(options);
+  PassRegistry *registry = PassRegistry::getPassRegistry();
+
+  for (unsigned int index = 0; index < tokens.size(); ++index) {
+    const std::string &token = tokens[index];
+
+    if (token == "-load") {
+      if (index + 1 == tokens.size() || !loadPlugin(tokens[++index]))
+        return false;
+      continue;
+    }
+
+    if (token.size() == 3 && token[0] == '-' && token[1] == 'O' &&
+        isdigit(token[2])) {
+      PipelineStep step = {nullptr, static_cast<unsigned int>(token[2] - '0')};
+      pipeline.steps.push_back(step);
+      continue;
+    }
+
+    size_t nameStart = token.find_first_not_of('-');
+    const PassInfo *info = nullptr;
+    if (token[0] == '-' && nameStart != std::string::npos &&
+        token.find('=') == std::string::npos)
+      info = registry->getPassInfo(token.substr(nameStart));
+    if (info != nullptr) {
+      PipelineStep step = {info, 0};
+      pipeline.steps.push_back(step);
+      continue;
+    }
+
+    // An option, possibly followed by its value.
+    pipeline.flags.push_back(token);
+    if (index + 1 < tokens.size() && tokens[index + 1][0] != '-')
+      pipeline.flags.push_back(tokens[++index]);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Every pipeline parses its flags into the same cl::opt globals: the values of
+// the lists of the previous pipeline would pile up otherwise. Thrud clears its
+// own lists; LLVM 3.9 and later can reset every option.
+static void resetOptions() {
+#if LLVM_VERSION_MAJOR > 3 || (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 9)
+  cl::ResetAllOptionOccurrences();
+#endif
+  void *clearOptionLists =
+      sys::DynamicLibrary::SearchForAddressOfSymbol(CLEAR_OPTION_LISTS_NAME);
+  if (clearOptionLists != nullptr)
+    reinterpret_cast<void (*)()>(clearOptionLists)();
+}
+
+//------------------------------------------------------------------------------
+static void applyFlags(const std::vector<std::string> &flags) {
+  resetOptions();
+  if (flags.empty())
+    return;
+
+  std::vector<const char *> argv;
+  argv.push_back("axtorwrapper");
+  for (const std::string &flag : flags)
+    argv.push_back(flag.c_str());
+  cl::ParseCommandLineOptions(argv.size(), &argv[0]);
+}
+
+//------------------------------------------------------------------------------
+static void addOptimizationLevel(legacy::PassManager &passManager,
+                                 unsigned int optLevel) {
+  PassManagerBuilder builder;
+  builder.OptLevel = optLevel;
+  if (optLevel > 1)
+    builder.Inliner = createFunctionInliningPass(optLevel > 2 ? 275 : 225);
+  else
+    builder.Inliner = createAlwaysInlinerPass();
+  builder.populateModulePassManager(passManager);
+}
+
+//------------------------------------------------------------------------------
+// Runs the pipeline on the module. If log is given the output of the last
+// pass of the pipeline, as printed by Pass::print, is stored in it.
+static bool runPipeline(const std::string &options, Module &module,
+                        bool removeDeadCode, std::string *log) {
+  Pipeline pipeline;
+  if (!parsePipeline(options, pipeline))
+    return false;
+  applyFlags(pipeline.flags);
+
+  legacy::PassManager passManager;
+  Pass *lastPass = nullptr;
+  for (const PipelineStep &step : pipeline.steps) {
+    if (step.pass == nullptr) {
+      addOptimizationLevel(passManager, step.optLevel);
+      continue;
+    }
+    lastPass = step.pass->createPass();
+    passManager.add(lastPass);
+  }
+  if (removeDeadCode)
+    passManager.add(createDeadCodeEliminationPass());
+
+  passManager.run(module);
+
+  if (log != nullptr && lastPass != nullptr) {
+    raw_string_ostream stream(*log);
+    lastPass->print(stream, &module);
+    stream.flush();
+  }
+
+  return !verifyModule(module, &errs());
+}
+
+// InProcessCompiler.
+//------------------------------------------------------------------------------
+InProcessCompiler::InProcessCompiler(const std::string &source,
+                                     const std::string &clangOptions)
+    : module(new InProcessModule()) {
+  std::lock_guard<std::mutex> lock(pipelineMutex);
+  initializeLLVM();
+
+  std::string oclHeader = getEnvString("OCL_HEADER");
+  std::vector<std::string> arguments = {"-x", "cl",
+                                        "-triple", "spir-unknown-unknown",
+                                        "-include", oclHeader,
+                                        "-O0", "-fno-builtin"};
+  std::vector<std::string> userArguments = tokenize(clangOptions);
+  arguments.insert(arguments.end(), userArguments.begin(),
+                   userArguments.end());
+  arguments.push_back(IN_PROCESS_SOURCE_NAME);
+
+  std::vector<const char *> argv;
+  for (const std::string &argument : arguments)
+    argv.push_back(argument.c_str());
+
+  clang::CompilerInstance compiler;
+  compiler.createDiagnostics();
+  if (!clang::CompilerInvocation::CreateFromArgs(
+          compiler.getInvocation(), &argv[0], &argv[0] + argv.size(),
+          compiler.getDiagnostics()))
+    return;
+
+  compiler.getPreprocessorOpts().addRemappedFile(
+      IN_PROCESS_SOURCE_NAME,
+      MemoryBuffer::getMemBufferCopy(makeInlineStatic(source)).release());
+
+  clang::EmitLLVMOnlyAction action(&module->context);
+  if (!compiler.ExecuteAction(action))
+    return;
+
+  std::unique_ptr<Module> parsedModule(action.takeModule());
+  module->module = std::move(parsedModule);
+}
+
+//------------------------------------------------------------------------------
+InProcessCompiler::~InProcessCompiler() {
+  std::lock_guard<std::mutex> lock(pipelineMutex);
+  delete module;
+}
+
+//------------------------------------------------------------------------------
+bool InProcessCompiler::isValid() const { return module->module != nullptr; }
+
+//------------------------------------------------------------------------------
+int InProcessCompiler::coarsen(const std::string &optOptions,
+                               const std::string &analysisOptions,
+                               std::string &outputSource, std::string &clrLog) {
+  if (!isValid()) {
+    std::cout << "&&&&& FRONTEND_FAILURE!";
+    return 1;
+  }
+
+  std::lock_guard<std::mutex> lock(pipelineMutex);
+  std::unique_ptr<Module> clone(CloneModule(module->module.get()));
+
+  // Opt with coarsening.
+  if (!runPipeline(optOptions, *clone, true, nullptr)) {
+    std::cout << "&&&&& OPT_FAILURE!";
+    return 2;
+  }
+
+  if (!analysisOptions.empty()) {
+    // The analysis runs on its own copy, as the external clr invocation
+    // does not write its module back.
+    std::unique_ptr<Module> analyzed(CloneModule(clone.get()));
+    if (!runPipeline(analysisOptions, *analyzed, false,
+                     &clrLog)) {
+      std::cout << "&&&&& CACHE_LINE_REUSE_ANALYSIS_FAILURE!";
+      return 4;
+    }
+  }
+
+  std::string oredOptions = getEnvString("OCCUPANCY_REDUCTION");
+  if (!oredOptions.empty() &&
+      !runPipeline(oredOptions, *clone, false, nullptr)) {
+    std::cout << "&&&&& OCCUPANCY_REDUCTION_FAILURE!";
+    return 6;
+  }
+
+  // Axtor.
+  std::ostringstream output;
+  axtor::OCLBackend backend;
+  axtor::OCLModuleInfo moduleInfo =
+      axtor::OCLModuleInfo::createTestInfo(clone.get(), output);
+  axtor::translateModule(backend, moduleInfo);
+  outputSource = output.str();
+  if (outputSource.empty()) {
+    std::cout << "&&&&& AXTOR_FAILURE!";
+    return 3;
+  }
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+bool isInProcessCompilationEnabled() {
+  return !getEnvString(IN_PROCESS_COMPILATION).empty();
+}
+
+#else
+
+// The wrapper has been built without AXTOR_IN_PROCESS: the external
+// toolchain is always used.
+//------------------------------------------------------------------------------
+InProcessCompiler::InProcessCompiler(const std::string &,
+                                     const std::string &)
+    : module(nullptr) {}
+
+InProcessCompiler::~InProcessCompiler() {}
+
+bool InProcessCompiler::isValid() const { return false; }
+
+int InProcessCompiler::coarsen(const std::string &, const std::string &, std::string &,
+                               std::string &) {
+  std::cout << "&&&&& FRONTEND_FAILURE!";
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+bool isInProcessCompilationEnabled() {
+  if (!getEnvString(IN_PROCESS_COMPILATION).empty())
+    std::cout << "In-process compilation is not available in this build, "
+                 "using the external toolchain\n";
+  return false;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "LaunchContext.h"
+
+#include "Utils.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+static std::mutex launchContextMutex;
+
+// Support functions.
+//------------------------------------------------------------------------------
+// The text of every entry of the file, by kernel.
+static std::map<std::string, std::string> readEntries(const std::string &path) {
+  std::map<std::string, std::string> entries;
+  std::ifstream stream(path.c_str());
+  std::string line;
+  std::string kernelName;
+  while (std::getline(stream, line)) {
+    std::istringstream fields(line);
+    std::string field;
+    if (!(fields >> field))
+      continue;
+    if (field == "kernel") {
+      fields >> kernelName;
+      entries[kernelName].clear();
+    }
+    if (!kernelName.empty())
+      entries[kernelName] += line + "\n";
+  }
+  return entries;
+}
+
+//------------------------------------------------------------------------------
+// The entries of the file, read at the first use.
+static std::map<std::string, std::string> &getEntries() {
+  static std::map<std::string, std::string> entries =
+      readEntries(getWrapperConfig().launchContextFile);
+  return entries;
+}
+
+//------------------------------------------------------------------------------
+static std::string formatEntry(const std::string &kernelName,
+                               const LaunchContext &context) {
+  std::stringstream entry;
+  entry << "kernel " << kernelName << "\n"
+        << "work_dim " << context.workDim << "\n";
+  entry << "global_size";
+  for (unsigned int index = 0; index < 3; ++index)
+    entry << " " << (index < context.workDim ? context.globalSize[index] : 1);
+  entry << "\nlocal_size";
+  for (unsigned int index = 0; index < 3; ++index)
+    entry << " " << (index < context.workDim ? context.localSize[index] : 1);
+  entry << "\n";
+  for (const auto &argument : context.arguments)
+    entry << "arg " << argument.first << " " << argument.second << "\n";
+  return entry.str();
+}
+
+//------------------------------------------------------------------------------
+// The file is written to a private file first and renamed into place, so
+// that an analysis running meanwhile never reads a partial file.
+static void writeEntries(const std::string &path,
+                         const std::map<std::string, std::string> &entries) {
+  std::stringstream tmpPath;
+  tmpPath << path << ".tmp" << getpid();
+  std::ofstream stream(tmpPath.str().c_str());
+  if (!stream.is_open()) {
+    std::cout << "Cannot write the launch context to " << path << "\n";
+    return;
+  }
+  for (const auto &entry : entries)
+    stream << entry.second;
+  stream.close();
+  if (!stream || rename(tmpPath.str().c_str(), path.c_str()) != 0) {
+    std::cout << "Cannot write the launch context to " << path << "\n";
+    unlink(tmpPath.str().c_str());
+  }
+}
+
+// Launch context.
+//------------------------------------------------------------------------------
+bool isLaunchContextEnabled() {
+  return !getWrapperConfig().launchContextFile.empty();
+}
+
+//------------------------------------------------------------------------------
+void recordLaunchContext(const std::string &kernelName,
+                         const LaunchContext &context) {
+  if (!isLaunchContextEnabled())
+    return;
+
+  std::string entry = formatEntry(kernelName, context);
+  std::lock_guard<std::mutex> lock(launchContextMutex);
+  std::map<std::string, std::string> &entries = getEntries();
+  if (entries[kernelName] == entry)
+    return;
+  entries[kernelName] = entry;
+  writeEntries(getWrapperConfig().launchContextFile, entries);
+}
+
+//------------------------------------------------------------------------------
+std::string getLaunchContextEntry(const std::string &kernelName) {
+  if (!isLaunchContextEnabled())
+    return "";
+
+  std::lock_guard<std::mutex> lock(launchContextMutex);
+  std::map<std::string, std::string> &entries = getEntries();
+  std::map<std::string, std::string>::const_iterator entry =
+      entries.find(kernelName);
+  return entry != entries.end() ? entry->second : "";
+}
@@ -0,0 +1,551 @@
+#include "LaunchProfiler.h"
+
+#include "Utils.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
+#define RING_BUFFER_SIZE 8192
+#define TRACE_BUFFER_SIZE 16384
+#define TRACE_WRITE_BUFFER_SIZE 65536
+#define TRACE_FORMAT_VERSION 1
+#define FLUSH_PERIOD_MS 100
+#define EXIT_WAIT_MS 1000
+
+//------------------------------------------------------------------------------
+struct LaunchRecord {
+  const char *kernelName;
+  unsigned long duration;
+};
+
+//------------------------------------------------------------------------------
+// Bounded multi-producer queue after D. Vyukov: every cell carries a sequence
+// number that tells producers and the consumer whose turn it is. Producers
+// never block, a full buffer rejects the record. Size must be a power of two.
+template <typename T, size_t Size> class RingBuffer {
+public:
+  RingBuffer() : tail(0), head(0) {
+    for (size_t index = 0; index < Size; ++index)
+      cells[index].sequence.store(index, std::memory_order_relaxed);
+  }
+
+  bool push(const T &value) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[position & (Size - 1)];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+      if (difference == 0) {
+        if (tail.compare_exchange_weak(position, position + 1,
+                                       std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Single consumer.
+  bool pop(T &value) {
+    Cell &cell = cells[head & (Size - 1)];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if ((intptr_t)sequence - (intptr_t)(head + 1) < 0)
+      return false;
+    value = cell.value;
+    cell.sequence.store(head + Size, std::memory_order_release);
+    ++head;
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  Cell cells[Size];
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) size_t head;
+};
+
+//------------------------------------------------------------------------------
+struct LaunchTraceSlot {
+  LaunchTraceInfo info;
+  cl_ulong queued;
+  cl_ulong submit;
+  cl_ulong start;
+  cl_ulong end;
+  std::atomic<bool> ready;
+};
+
+//------------------------------------------------------------------------------
+// Fixed array of trace slots, allocated once. Launches reserve consecutive
+// slots and mark them ready once their timestamps are known, possibly out of
+// order; the consumer writes the ready prefix and hands the slots back.
+class TraceBuffer {
+public:
+  TraceBuffer()
+      : slots(new LaunchTraceSlot[TRACE_BUFFER_SIZE]), reserved(0),
+        written(0) {
+    for (size_t index = 0; index < TRACE_BUFFER_SIZE; ++index)
+      slots[index].ready.store(false, std::memory_order_relaxed);
+  }
+
+  LaunchTraceSlot *reserve() {
+    size_t position = reserved.load(std::memory_order_relaxed);
+    do {
+      if (position - written.load(std::memory_order_acquire) >=
+          TRACE_BUFFER_SIZE)
+        return NULL;
+    } while (!reserved.compare_exchange_weak(position, position + 1,
+                                             std::memory_order_relaxed));
+    return &slots[position % TRACE_BUFFER_SIZE];
+  }
+
+  // Single consumer.
+  template <typename Writer> void drain(Writer &writer) {
+    size_t position = written.load(std::memory_order_relaxed);
+    for (; position < reserved.load(std::memory_order_acquire); ++position) {
+      LaunchTraceSlot &slot = slots[position % TRACE_BUFFER_SIZE];
+      if (!slot.ready.load(std::memory_order_acquire))
+        break;
+      writer.write(slot);
+      slot.ready.store(false, std::memory_order_relaxed);
+      written.store(position + 1, std::memory_order_release);
+    }
+  }
+
+private:
+  std::unique_ptr<LaunchTraceSlot[]> slots;
+  std::atomic<size_t> reserved;
+  std::atomic<size_t> written;
+};
+
+//------------------------------------------------------------------------------
+// Formats the trace records into a fixed buffer, written to the file when it
+// fills up.
+class TraceWriter {
+public:
+  TraceWriter(const std::string &path, bool binary)
+      : binary(binary), isFirstRecord(true), used(0) {
+    file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+      std::cout << "Cannot open the trace file " << path << "\n";
+      return;
+    }
+    if (binary) {
+      uint32_t version = TRACE_FORMAT_VERSION;
+      append("OCLTRACE", 8);
+      append(&version, sizeof(version));
+    } else {
+      appendFormat("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+  }
+
+  ~TraceWriter() { close(); }
+
+  // Ends the trace; later records are ignored.
+  void close() {
+    if (file == NULL)
+      return;
+    if (!binary)
+      appendFormat("\n]}\n");
+    flush();
+    fclose(file);
+    file = NULL;
+  }
+
+  bool isValid() const { return file != NULL; }
+
+  void write(const LaunchTraceSlot &slot) {
+    if (file == NULL)
+      return;
+    if (binary)
+      writeBinary(slot);
+    else
+      writeJson(slot);
+  }
+
+  void flush() {
+    if (file == NULL)
+      return;
+    if (used != 0)
+      fwrite(buffer, 1, used, file);
+    used = 0;
+    fflush(file);
+  }
+
+private:
+  void append(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size != 0) {
+      if (used == TRACE_WRITE_BUFFER_SIZE) {
+        fwrite(buffer, 1, used, file);
+        used = 0;
+      }
+      size_t chunk = std::min(size, TRACE_WRITE_BUFFER_SIZE - used);
+      memcpy(buffer + used, bytes, chunk);
+      used += chunk;
+      bytes += chunk;
+      size -= chunk;
+    }
+  }
+
+  void appendFormat(const char *format, ...) {
+    char text[256];
+    va_list arguments;
+    va_start(arguments, format);
+    int size = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    append(text, std::min<size_t>(size, sizeof(text) - 1));
+  }
+
+  void appendJsonString(const char *value) {
+    append("\"", 1);
+    for (const char *c = value; *c != '\0'; ++c) {
+      if (*c == '"' || *c == '\\') {
+        append("\\", 1);
+        append(c, 1);
+      } else if (static_cast<unsigned char>(*c) < 0x20) {
+        appendFormat("\\u%04x", *c);
+      } else {
+        append(c, 1);
+      }
+    }
+    append("\"", 1);
+  }
+
+  void appendSizes(const size_t *sizes, cl_uint dimensions) {
+    append("[", 1);
+    for (cl_uint index = 0; index < dimensions; ++index)
+      appendFormat(index == 0 ? "%zu" : ",%zu", sizes[index]);
+    append("]", 1);
+  }
+
+  void writeJson(const LaunchTraceSlot &slot) {
+    const LaunchTraceInfo &info = slot.info;
+    append(isFirstRecord ? "\n" : ",\n", isFirstRecord ? 1 : 2);
+    isFirstRecord = false;
+
+    append("{\"name\":", 8);
+    appendJsonString(info.kernelName);
+    appendFormat(",\"cat\":\"kernel\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cf\":%u,"
+                 "\"direction\":%u,\"global\":",
+                 slot.start / 1000.0, (slot.end - slot.start) / 1000.0,
+                 info.coarseningFactor, info.coarseningDirection);
+    appendSizes(info.globalSize, info.workDim);
+    append(",\"local\":", 9);
+    appendSizes(info.localSize, info.workDim);
+    appendFormat(",\"queued\":%llu,\"submit\":%llu,\"start\":%llu,"
+                 "\"end\":%llu,\"limiting_factor\":",
+                 (unsigned long long)slot.queued,
+                 (unsigned long long)slot.submit,
+                 (unsigned long long)slot.start,
+                 (unsigned long long)slot.end);
+    appendJsonString(info.limitingFactor);
+    append("}}", 2);
+  }
+
+  uint32_t getStringId(const char *value) {
+    std::map<const char *, uint32_t>::iterator id = stringIds.find(value);
+    if (id != stringIds.end())
+      return id->second;
+
+    uint8_t type = 1;
+    uint32_t newId = stringIds.size();
+    uint32_t length = strlen(value);
+    append(&type, sizeof(type));
+    append(&newId, sizeof(newId));
+    append(&length, sizeof(length));
+    append(value, length);
+    stringIds[value] = newId;
+    return newId;
+  }
+
+  void writeBinary(const LaunchTraceSlot &slot) {
+    const LaunchTraceInfo &info = slot.info;
+    uint32_t kernelName = getStringId(info.kernelName);
+    uint32_t limitingFactor = getStringId(info.limitingFactor);
+
+    uint8_t type = 2;
+    uint32_t fields[] = {kernelName, limitingFactor, info.coarseningFactor,
+                         info.coarseningDirection, info.workDim};
+    uint64_t sizes[6] = {0, 0, 0, 0, 0, 0};
+    for (cl_uint index = 0; index < info.workDim && index < 3; ++index) {
+      sizes[index] = info.globalSize[index];
+      sizes[3 + index] = info.localSize[index];
+    }
+    uint64_t timestamps[] = {slot.queued, slot.submit, slot.start, slot.end};
+    append(&type, sizeof(type));
+    append(fields, sizeof(fields));
+    append(sizes, sizeof(sizes));
+    append(timestamps, sizeof(timestamps));
+  }
+
+  FILE *file;
+  bool binary;
+  bool isFirstRecord;
+  char buffer[TRACE_WRITE_BUFFER_SIZE];
+  size_t used;
+  std::map<const char *, uint32_t> stringIds;
+};
+
+//------------------------------------------------------------------------------
+// Never destroyed: the callbacks of the launches still running at exit may
+// come after the static destructors. finish runs at exit instead.
+class LaunchProfiler {
+public:
+  LaunchProfiler()
+      : dropped(0), droppedTraces(0), pending(0), finished(false),
+        stopping(false) {
+    const WrapperConfig &config = getWrapperConfig();
+    if (!config.traceFile.empty()) {
+      traceWriter.reset(
+          new TraceWriter(config.traceFile, config.traceFormat == "binary"));
+      if (traceWriter->isValid())
+        traceBuffer.reset(new TraceBuffer());
+    }
+
+    flusher = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(flusherMutex);
+      while (!stopping) {
+        flusherCondition.wait_for(lock,
+                                  std::chrono::milliseconds(FLUSH_PERIOD_MS));
+        flush();
+      }
+    });
+  }
+
+  // Waits a while for the pending callbacks, then prints the last durations
+  // and ends the trace. Later records are dropped.
+  void finish() {
+    {
+      std::lock_guard<std::mutex> lock(flusherMutex);
+      stopping = true;
+    }
+    flusherCondition.notify_one();
+    flusher.join();
+    for (int waited = 0; pending.load(std::memory_order_acquire) != 0 &&
+                         waited < EXIT_WAIT_MS;
+         waited += FLUSH_PERIOD_MS)
+      std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_PERIOD_MS));
+    flush();
+
+    std::lock_guard<std::mutex> lock(consumerMutex);
+    finished = true;
+    if (traceWriter != nullptr)
+      traceWriter->close();
+  }
+
+  // Launches whose completion callback has not run yet.
+  void addPending() { pending.fetch_add(1, std::memory_order_relaxed); }
+  void removePending() { pending.fetch_sub(1, std::memory_order_release); }
+
+  void record(const LaunchRecord &record) {
+    if (!records.push(record))
+      dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  LaunchTraceSlot *reserveTrace() {
+    if (traceBuffer == nullptr)
+      return NULL;
+    LaunchTraceSlot *slot = traceBuffer->reserve();
+    if (slot == NULL && !getWrapperConfig().asyncProfiling) {
+      // Synchronous launches can afford to wait for the writer.
+      flush();
+      slot = traceBuffer->reserve();
+    }
+    if (slot == NULL)
+      droppedTraces.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+  }
+
+  // The whole batch is written at once.
+  void flush() {
+    std::lock_guard<std::mutex> lock(consumerMutex);
+    if (finished)
+      return;
+    std::ostringstream batch;
+    LaunchRecord record;
+    while (records.pop(record))
+      batch << record.kernelName << " " << record.duration << "\n";
+    unsigned long droppedNumber = dropped.exchange(0);
+    if (droppedNumber != 0)
+      batch << "Dropped " << droppedNumber << " launch records\n";
+    droppedNumber = droppedTraces.exchange(0);
+    if (droppedNumber != 0)
+      batch << "Dropped " << droppedNumber << " launch trace records\n";
+    std::string output = batch.str();
+    if (!output.empty())
+      std::cout << output << std::flush;
+
+    if (traceBuffer != nullptr) {
+      traceBuffer->drain(*traceWriter);
+      traceWriter->flush();
+    }
+  }
+
+private:
+  RingBuffer<LaunchRecord, RING_BUFFER_SIZE> records;
+  std::atomic<unsigned long> dropped;
+  std::atomic<unsigned long> droppedTraces;
+  std::atomic<unsigned long> pending;
+  bool finished;
+  std::unique_ptr<TraceBuffer> traceBuffer;
+  std::unique_ptr<TraceWriter> traceWriter;
+  std::mutex consumerMutex;
+
+  std::thread flusher;
+  std::mutex flusherMutex;
+  std::condition_variable flusherCondition;
+  bool stopping;
+};
+
+static void finishLaunchProfiler();
+
+// Built in static storage rather than with new, which does not honour the
+// alignment of the ring buffer in C++11.
+static LaunchProfiler &getLaunchProfiler() {
+  static std::aligned_storage<sizeof(LaunchProfiler),
+                              alignof(LaunchProfiler)>::type storage;
+  static LaunchProfiler *profiler = NULL;
+  static std::once_flag created;
+  std::call_once(created, []() {
+    profiler = new (&storage) LaunchProfiler();
+    atexit(finishLaunchProfiler);
+  });
+  return *profiler;
+}
+
+static void finishLaunchProfiler() { getLaunchProfiler().finish(); }
+
+// Support functions.
+//------------------------------------------------------------------------------
+// Runs on a thread of the OpenCL implementation as well: no blocking calls,
+// no exceptions.
+static void readTimestamps(LaunchTraceSlot *slot, cl_event event,
+                           cl_int status) {
+  cl_profiling_info names[] = {
+      CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+      CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+  cl_ulong *values[] = {&slot->queued, &slot->submit, &slot->start,
+                        &slot->end};
+  for (unsigned int index = 0; index < 4; ++index) {
+    *values[index] = 0;
+    if (status == CL_COMPLETE)
+      clGetEventProfilingInfo(event, names[index], sizeof(cl_ulong),
+                              values[index], NULL);
+  }
+}
+
+//------------------------------------------------------------------------------
+static unsigned long readDuration(cl_event event, cl_int status) {
+  cl_ulong start, end;
+  if (status == CL_COMPLETE &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                              sizeof(cl_ulong), &start, NULL) == CL_SUCCESS &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                              sizeof(cl_ulong), &end, NULL) == CL_SUCCESS)
+    return static_cast<unsigned long>(end - start);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+static void CL_CALLBACK onLaunchComplete(cl_event event, cl_int status,
+                                         void *userData) {
+  LaunchRecord record = {static_cast<const char *>(userData),
+                         readDuration(event, status)};
+  getLaunchProfiler().record(record);
+  getLaunchProfiler().removePending();
+  clReleaseEvent(event);
+}
+
+//------------------------------------------------------------------------------
+// The slot may be reused as soon as it is marked ready.
+static void CL_CALLBACK onTracedLaunchComplete(cl_event event, cl_int status,
+                                               void *userData) {
+  LaunchTraceSlot *slot = static_cast<LaunchTraceSlot *>(userData);
+  readTimestamps(slot, event, status);
+  LaunchRecord record = {slot->info.kernelName,
+                         static_cast<unsigned long>(slot->end - slot->start)};
+  slot->ready.store(true, std::memory_order_release);
+  getLaunchProfiler().record(record);
+  getLaunchProfiler().removePending();
+  clReleaseEvent(event);
+}
+
+// Launch profiler.
+//------------------------------------------------------------------------------
+const char *internProfileString(const std::string &value) {
+  static std::set<std::string> strings;
+  static std::mutex stringsMutex;
+  std::lock_guard<std::mutex> lock(stringsMutex);
+  return strings.insert(value).first->c_str();
+}
+
+//------------------------------------------------------------------------------
+bool isLaunchTraceEnabled() { return !getWrapperConfig().traceFile.empty(); }
+
+//------------------------------------------------------------------------------
+LaunchTraceSlot *reserveLaunchTrace(const LaunchTraceInfo &info) {
+  LaunchTraceSlot *slot = getLaunchProfiler().reserveTrace();
+  if (slot != NULL)
+    slot->info = info;
+  return slot;
+}
+
+//------------------------------------------------------------------------------
+void completeLaunchTrace(LaunchTraceSlot *slot, cl_event event) {
+  readTimestamps(slot, event, CL_COMPLETE);
+  slot->ready.store(true, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+void profileLaunchAsync(cl_event event, const std::string &kernelName,
+                        LaunchTraceSlot *slot) {
+  const char *name =
+      slot != NULL ? slot->info.kernelName : internProfileString(kernelName);
+
+  clRetainEvent(event);
+  getLaunchProfiler().addPending();
+  cl_int errorCode =
+      slot != NULL
+          ? clSetEventCallback(event, CL_COMPLETE, onTracedLaunchComplete, slot)
+          : clSetEventCallback(event, CL_COMPLETE, onLaunchComplete,
+                               const_cast<char *>(name));
+  if (errorCode != CL_SUCCESS) {
+    getLaunchProfiler().removePending();
+    clReleaseEvent(event);
+    if (slot != NULL) {
+      readTimestamps(slot, event, errorCode);
+      slot->ready.store(true, std::memory_order_release);
+    }
+    LaunchRecord record = {name, 0};
+    getLaunchProfiler().record(record);
+  }
+}
+
+//------------------------------------------------------------------------------
+void flushLaunchProfiles() { getLaunchProfiler().flush(); }
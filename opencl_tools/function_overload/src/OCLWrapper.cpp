@@ -27,35 +27,36 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue command_queue,
 #endif
 
   // Setup the event to measure the kernel execution time.
+  cl_event localEvent;
   bool isEventNull = (event == NULL);
-  if(isEventNull) {
-    event = new cl_event();
-    clRetainEvent(*event);
-  }
+  if(isEventNull)
+    event = &localEvent;
 
   std::string kernelName = getKernelName(kernel);
 
-  size_t* newGlobalSize = new size_t [work_dim];
-  size_t* newLocalSize = new size_t [work_dim];
-
-  std::string repetitionsString = getEnvString(OCL_REPETITIONS);
-  unsigned int repetitions;
-  if(repetitionsString != "")
-    std::istringstream(repetitionsString) >> repetitions;
-  else
-    repetitions = 1;
+  // The kernel runs as built by the application.
+  LaunchTraceInfo traceInfo;
+  bool isTraced = isLaunchTraceEnabled();
+  if(isTraced) {
+    traceInfo.kernelName = internProfileString(kernelName);
+    traceInfo.limitingFactor = internProfileString("");
+    traceInfo.coarseningFactor = 1;
+    traceInfo.coarseningDirection = 0;
+    traceInfo.workDim = work_dim;
+    for(unsigned int index = 0; index < work_dim && index < 3; ++index) {
+      traceInfo.globalSize[index] = global_work_size[index];
+      traceInfo.localSize[index] =
+        local_work_size != NULL ? local_work_size[index] : 0;
+    }
+  }
 
   enqueueKernel(command_queue, kernel, work_dim, global_work_offset,
                 global_work_size, local_work_size, num_events_in_wait_list,
-                event_wait_list, event, repetitions, kernelName);
+                event_wait_list, event, getWrapperConfig().repetitions,
+                kernelName, isTraced ? &traceInfo : NULL);
 
-  if(isEventNull) {
+  if(isEventNull)
     clReleaseEvent(*event);
-    delete event;
-  }
-
-  delete [] newGlobalSize;
-  delete [] newLocalSize;
 
   return CL_SUCCESS;
 }
@@ -70,9 +71,8 @@ cl_command_queue clCreateCommandQueue(cl_context context,
 #endif
 
   // Get pointer to original function calls.
-  clCreateCommandQueueFunction originalclCreateCommandQueue;
-    *(void **)(&originalclCreateCommandQueue) =
-    dlsym(RTLD_NEXT, CL_CREATE_COMMAND_QUEUE_NAME);
+  clCreateCommandQueueFunction originalclCreateCommandQueue =
+    getOriginalFunctions().createCommandQueue;
 
   properties = properties | CL_QUEUE_PROFILING_ENABLE;
 
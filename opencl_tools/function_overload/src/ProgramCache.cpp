@@ -0,0 +1,283 @@
+#include "ProgramCache.h"
+
+#include "Utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#define SOURCE_EXTENSION ".cl"
+#define BINARY_EXTENSION ".bin"
+#define RESOURCES_EXTENSION ".res"
+
+// Support functions.
+//------------------------------------------------------------------------------
+// 64-bit FNV-1a, stable across runs and compilers.
+static uint64_t hashString(const std::string &data, uint64_t hash) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+//------------------------------------------------------------------------------
+// Size and modification time of a file the build depends on, so that
+// rebuilding libThrud or editing the OpenCL header invalidates the entries.
+static std::string getFileStamp(const std::string &path) {
+  struct stat info;
+  std::stringstream stamp;
+  stamp << path;
+  if (stat(path.c_str(), &info) == 0)
+    stamp << ":" << info.st_size << ":" << info.st_mtime;
+  return stamp.str();
+}
+
+//------------------------------------------------------------------------------
+static std::string getPluginStamps(const std::string &options) {
+  std::istringstream iss(options);
+  std::vector<std::string> tokens((std::istream_iterator<std::string>(iss)),
+                                  std::istream_iterator<std::string>());
+  std::string stamps;
+  for (unsigned int index = 0; index + 1 < tokens.size(); ++index) {
+    if (tokens[index] == "-load")
+      stamps += getFileStamp(tokens[index + 1]) + ";";
+  }
+  return stamps;
+}
+
+//------------------------------------------------------------------------------
+static std::string getCacheDirectory() {
+  std::string base = getEnvString(XDG_CACHE_HOME);
+  if (base.empty()) {
+    std::string home = getEnvString("HOME");
+    if (home.empty())
+      return "";
+    base = home + "/.cache";
+  }
+  return base + "/" + PROGRAM_CACHE_DIRECTORY;
+}
+
+//------------------------------------------------------------------------------
+static bool createDirectories(const std::string &path) {
+  for (size_t position = path.find('/', 1); ;
+       position = path.find('/', position + 1)) {
+    std::string prefix = path.substr(0, position);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+    if (position == std::string::npos)
+      return true;
+  }
+}
+
+//------------------------------------------------------------------------------
+static bool readWholeFile(const std::string &path, std::string &data) {
+  std::ifstream stream(path.c_str(), std::ios::binary);
+  if (!stream.is_open())
+    return false;
+  data.assign(std::istreambuf_iterator<char>(stream),
+              std::istreambuf_iterator<char>());
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Entries are written to a private file first and renamed into place, so
+// concurrent builders never see a partial entry.
+static bool writeWholeFile(const std::string &path, const char *data,
+                           size_t size) {
+  std::stringstream tmpPath;
+  tmpPath << path << ".tmp" << getpid() << "_"
+          << std::hash<std::thread::id>()(std::this_thread::get_id());
+  std::ofstream stream(tmpPath.str().c_str(), std::ios::binary);
+  if (!stream.is_open())
+    return false;
+  stream.write(data, size);
+  stream.close();
+  if (!stream || rename(tmpPath.str().c_str(), path.c_str()) != 0) {
+    unlink(tmpPath.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Removes the entries whose resources were least recently read or written,
+// and the incomplete ones first, until the cache fits PROGRAM_CACHE_MAX_BYTES.
+static void trimCache(const std::string &directory) {
+  DIR *handle = opendir(directory.c_str());
+  if (handle == NULL)
+    return;
+  // Last use and size of every entry, by key.
+  std::map<std::string, std::pair<time_t, long long>> entries;
+  long long total = 0;
+  while (struct dirent *file = readdir(handle)) {
+    std::string name = file->d_name;
+    size_t dot = name.find('.');
+    struct stat info;
+    if (dot == 0 || dot == std::string::npos ||
+        stat((directory + "/" + name).c_str(), &info) != 0 ||
+        !S_ISREG(info.st_mode))
+      continue;
+    std::pair<time_t, long long> &entry = entries[name.substr(0, dot)];
+    entry.second += info.st_size;
+    total += info.st_size;
+    if (name.substr(dot) == RESOURCES_EXTENSION)
+      entry.first = info.st_mtime;
+  }
+  closedir(handle);
+  if (total <= PROGRAM_CACHE_MAX_BYTES)
+    return;
+
+  std::vector<std::pair<time_t, std::string>> byUse;
+  for (const auto &entry : entries)
+    byUse.push_back(std::make_pair(entry.second.first, entry.first));
+  std::sort(byUse.begin(), byUse.end());
+  for (size_t index = 0;
+       index < byUse.size() && total > PROGRAM_CACHE_MAX_BYTES; ++index) {
+    // The resources go first, so that no reader sees a complete entry.
+    std::string path = directory + "/" + byUse[index].second;
+    unlink((path + RESOURCES_EXTENSION).c_str());
+    unlink((path + BINARY_EXTENSION).c_str());
+    unlink((path + SOURCE_EXTENSION).c_str());
+    total -= entries[byUse[index].second].second;
+  }
+}
+
+// Program cache.
+//------------------------------------------------------------------------------
+bool isProgramCacheEnabled() {
+  std::string value = getEnvString(OCL_PROGRAM_CACHE);
+  return value != "0" && value != "off" && !getCacheDirectory().empty();
+}
+
+//------------------------------------------------------------------------------
+std::string computeProgramCacheKey(const ProgramCacheKey &key) {
+  std::stringstream fields;
+  fields << key.source << '\0' << key.buildOptions << '\0' << key.optOptions
+         << '\0' << key.analysisOptions << '\0' << key.coarseningFactor << '\0'
+         << key.deviceName << '\0' << key.driverVersion << '\0'
+         << getEnvString("THREAD_LEVEL_COARSENING") << '\0'
+         << getFileStamp(getEnvString("OCL_HEADER")) << '\0'
+         << getPluginStamps(key.optOptions + " " + key.analysisOptions);
+
+  // Two FNV-1a hashes with different offset bases. They are not independent,
+  // and the entries do not store the fields to detect a collision, but 128
+  // bits make an accidental one unlikely in a cache of this size.
+  std::string data = fields.str();
+  char digest[33];
+  snprintf(digest, sizeof(digest), "%016llx%016llx",
+           (unsigned long long)hashString(data, 14695981039346656037ULL),
+           (unsigned long long)hashString(data, 0x84222325cbf29ce4ULL));
+  return digest;
+}
+
+//------------------------------------------------------------------------------
+bool loadCachedProgram(const std::string &key, CachedProgram &program) {
+  std::string path = getCacheDirectory() + "/" + key;
+  std::string binary;
+  std::string resources;
+  if (!readWholeFile(path + SOURCE_EXTENSION, program.source) ||
+      !readWholeFile(path + BINARY_EXTENSION, binary) ||
+      !readWholeFile(path + RESOURCES_EXTENSION, resources) || binary.empty())
+    return false;
+
+  program.binary.assign(binary.begin(), binary.end());
+
+  // The first line holds the sizes of the three files, so that a truncated
+  // entry is not taken for one with fewer fields.
+  std::istringstream stream(resources);
+  std::string field;
+  size_t sourceSize = 0;
+  size_t binarySize = 0;
+  size_t fieldsSize = 0;
+  if (!(stream >> field >> sourceSize >> binarySize >> fieldsSize) ||
+      field != "entry" || stream.get() != '\n' ||
+      sourceSize != program.source.size() || binarySize != binary.size() ||
+      fieldsSize != resources.size() - (size_t)stream.tellg())
+    return false;
+
+  bool complete = false;
+  while (!complete && stream >> field) {
+    if (field == "resources") {
+      stream >> program.hasResources;
+    } else if (field == "regs") {
+      stream >> program.regs;
+    } else if (field == "smem") {
+      stream >> program.smem;
+    } else if (field == "cmem") {
+      stream >> program.cmem;
+    } else if (field == "cache_dependent") {
+      stream >> program.isCacheDependent;
+    } else if (field == "memory_cost") {
+      stream >> program.memoryCost;
+    } else if (field == "reuse_profile") {
+      // Empty when there is none: the rest of the line only.
+      std::string profile;
+      std::getline(stream, profile);
+      program.reuseProfile = readReuseProfile(profile);
+    } else if (field == "cda_log") {
+      // The log is last, and may span several lines.
+      stream.get();
+      program.cdaLog.assign(std::istreambuf_iterator<char>(stream),
+                            std::istreambuf_iterator<char>());
+      if (!program.cdaLog.empty())
+        program.cdaLog.erase(program.cdaLog.size() - 1);
+      complete = true;
+    } else {
+      return false;
+    }
+    if (stream.fail())
+      return false;
+  }
+  if (complete)
+    utime((path + RESOURCES_EXTENSION).c_str(), NULL);
+  return complete;
+}
+
+//------------------------------------------------------------------------------
+void storeCachedProgram(const std::string &key, const CachedProgram &program) {
+  std::string directory = getCacheDirectory();
+  if (!createDirectories(directory)) {
+    std::cout << "Cannot create the program cache in " << directory << "\n";
+    return;
+  }
+
+  std::stringstream fields;
+  fields << "resources " << program.hasResources << "\n"
+         << "regs " << program.regs << "\n"
+         << "smem " << program.smem << "\n"
+         << "cmem " << program.cmem << "\n"
+         << "cache_dependent " << program.isCacheDependent << "\n"
+         << "memory_cost " << program.memoryCost << "\n"
+         << "reuse_profile " << formatReuseProfile(program.reuseProfile) << "\n"
+         << "cda_log " << program.cdaLog << "\n";
+
+  std::stringstream resources;
+  resources << "entry " << program.source.size() << " "
+            << program.binary.size() << " " << fields.str().size() << "\n"
+            << fields.str();
+
+  // The resources are written last: their presence marks a complete entry.
+  std::string path = directory + "/" + key;
+  if (writeWholeFile(path + SOURCE_EXTENSION, program.source.data(),
+                     program.source.size()) &&
+      writeWholeFile(path + BINARY_EXTENSION,
+                     reinterpret_cast<const char *>(program.binary.data()),
+                     program.binary.size()) &&
+      writeWholeFile(path + RESOURCES_EXTENSION, resources.str().data(),
+                     resources.str().size()))
+    trimCache(directory);
+}
@@ -0,0 +1,193 @@
+#include "ReuseModel.h"
+
+#include "Utils.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <sstream>
+
+// Support functions.
+//------------------------------------------------------------------------------
+// The probability that a line re-used after distance other lines is still in
+// a cache of the given sets and ways: fewer than ways of them map to its set.
+static double getHitProbability(double distance, int sets, int ways) {
+  if (sets <= 1)
+    return distance < ways ? 1.0 : 0.0;
+
+  long long lines = (long long)distance;
+  double p = 1.0 / sets;
+  double probability = 0.0;
+  for (int k = 0; k < ways && k <= lines; ++k) {
+    double logTerm = lgamma(lines + 1.0) - lgamma(k + 1.0) -
+                     lgamma(lines - k + 1.0) + k * log(p) +
+                     (lines - k) * log1p(-p);
+    probability += exp(logTerm);
+  }
+  return std::min(probability, 1.0);
+}
+
+//------------------------------------------------------------------------------
+static int getSets(int size, int ways, int lineSize) {
+  return std::max(size / (std::max(ways, 1) * lineSize), 1);
+}
+
+//------------------------------------------------------------------------------
+// The fraction of the re-used lines of the profile that one of the caches
+// still holds, with activeThreads work-items of cf replicas each sharing the
+// compute units.
+static double getServedReuses(const ReuseProfile &profile, unsigned int cf,
+                              int activeThreads) {
+  const WrapperConfig &config = getWrapperConfig();
+  int lineSize = std::max(config.cacheLineSize, 1);
+  double scale = (double)profile.lineSize / lineSize *
+                 std::max(activeThreads / profile.warpSize, 1) * cf / profile.warps;
+  int l1Sets = getSets(config.l1Size, config.l1Ways, lineSize);
+  int l2Sets = getSets(config.l2Size, config.l2Ways, lineSize);
+
+  double served = 0.0;
+  for (const auto &distance : profile.distances) {
+    double l1Distance = distance.first * scale;
+    double l2Distance = l1Distance * config.computeUnits;
+    double l1Miss = 1.0 - getHitProbability(l1Distance, l1Sets, config.l1Ways);
+    double l2Miss = 1.0 - getHitProbability(l2Distance, l2Sets, config.l2Ways);
+    served += distance.second * (1.0 - l1Miss * l2Miss);
+  }
+  return served;
+}
+
+//------------------------------------------------------------------------------
+// "Cache simulation of CF <cf>: <w> warps, <r> requests, <h> L1 hits (p%),
+// <h> L2 hits (p%), <d> DRAM transactions", once per factor.
+static void parseCacheSimulations(const std::string &clrOutput,
+                                  size_t position, ReuseProfile &profile) {
+  std::string prefix = "Cache simulation of CF ";
+  while ((position = clrOutput.find(prefix, position)) != std::string::npos) {
+    position += prefix.size();
+    size_t lineEnd = clrOutput.find('\n', position);
+    std::istringstream fields(clrOutput.substr(position, lineEnd - position));
+    unsigned int cf;
+    char colon;
+    std::string word;
+    CacheSimulation simulation;
+    if (fields >> cf >> colon >> simulation.warps >> word >>
+        simulation.requests >> word >> simulation.l1Hits >> word >> word >>
+        word >> simulation.l2Hits >> word >> word >> word >>
+        simulation.dramTransactions)
+      profile.simulations[cf] = simulation;
+  }
+}
+
+// Reuse profile.
+//------------------------------------------------------------------------------
+ReuseProfile parseReuseProfile(const std::string &clrOutput) {
+  ReuseProfile profile;
+  std::string header = "Reuse profile: ";
+  size_t position = clrOutput.rfind(header);
+  if (position == std::string::npos)
+    return profile;
+
+  std::istringstream stream(clrOutput.substr(position + header.size()));
+  std::string line;
+  std::getline(stream, line);
+  std::istringstream headerFields(line);
+  std::string word;
+  headerFields >> profile.warps >> word >> word >> profile.warpSize >> word >>
+      profile.lineSize >> word >> word >> profile.accesses;
+
+  // One line per symbol: "Reuse distances of [A]: n accesses, r reuses (p%):
+  // d:c d:c".
+  while (std::getline(stream, line) &&
+         line.compare(0, 19, "Reuse distances of ") == 0) {
+    size_t distancesStart = line.find("%):");
+    if (distancesStart == std::string::npos)
+      continue;
+    std::istringstream fields(line.substr(distancesStart + 3));
+    std::string field;
+    while (fields >> field) {
+      size_t separator = field.find(':');
+      if (separator == std::string::npos)
+        continue;
+      long long distance = atoll(field.c_str());
+      profile.distances[distance] += atoll(field.c_str() + separator + 1);
+    }
+  }
+  if (!headerFields || !profile.isValid())
+    return ReuseProfile();
+  parseCacheSimulations(clrOutput, position, profile);
+  return profile;
+}
+
+//------------------------------------------------------------------------------
+std::string formatReuseProfile(const ReuseProfile &profile) {
+  if (!profile.isValid())
+    return "";
+  std::stringstream value;
+  value << profile.warps << " " << profile.lineSize << " " << profile.accesses
+        << " warp:" << profile.warpSize;
+  for (const auto &distance : profile.distances)
+    value << " " << distance.first << ":" << distance.second;
+  for (const auto &simulation : profile.simulations)
+    value << " sim:" << simulation.first << ":" << simulation.second.warps
+          << ":" << simulation.second.requests << ":"
+          << simulation.second.l1Hits << ":" << simulation.second.l2Hits
+          << ":" << simulation.second.dramTransactions;
+  return value.str();
+}
+
+//------------------------------------------------------------------------------
+ReuseProfile readReuseProfile(const std::string &value) {
+  ReuseProfile profile;
+  std::istringstream fields(value);
+  if (!(fields >> profile.warps >> profile.lineSize >> profile.accesses))
+    return ReuseProfile();
+  std::string field;
+  while (fields >> field) {
+    size_t separator = field.find(':');
+    if (field.compare(0, 5, "warp:") == 0) {
+      profile.warpSize = atoi(field.c_str() + 5);
+    } else if (field.compare(0, 4, "sim:") == 0) {
+      std::istringstream values(field.substr(4));
+      unsigned int cf;
+      char colon;
+      CacheSimulation simulation;
+      if (values >> cf >> colon >> simulation.warps >> colon >>
+          simulation.requests >> colon >> simulation.l1Hits >> colon >>
+          simulation.l2Hits >> colon >> simulation.dramTransactions)
+        profile.simulations[cf] = simulation;
+    } else if (separator != std::string::npos) {
+      profile.distances[atoll(field.c_str())] =
+          atoll(field.c_str() + separator + 1);
+    }
+  }
+  return profile.isValid() ? profile : ReuseProfile();
+}
+
+// Reuse model.
+//------------------------------------------------------------------------------
+float computeReusePenalty(const ReuseProfile &profile, unsigned int cf,
+                          int activeThreads, int baseActiveThreads) {
+  if (!profile.isValid() || cf <= 1)
+    return 0.0f;
+
+  std::map<unsigned int, CacheSimulation>::const_iterator base =
+      profile.simulations.find(1);
+  std::map<unsigned int, CacheSimulation>::const_iterator coarsened =
+      profile.simulations.find(cf);
+  if (base != profile.simulations.end() &&
+      coarsened != profile.simulations.end() && base->second.warps > 0 &&
+      base->second.requests > 0 && coarsened->second.warps > 0) {
+    double baseMisses =
+        (double)base->second.dramTransactions / base->second.warps;
+    double misses =
+        (double)coarsened->second.dramTransactions / coarsened->second.warps;
+    double requests = (double)base->second.requests / base->second.warps;
+    return (float)std::min(std::max((misses - baseMisses) / requests, 0.0),
+                           1.0);
+  }
+
+  double lost = getServedReuses(profile, 1, baseActiveThreads) -
+                getServedReuses(profile, cf, activeThreads);
+  return (float)std::min(std::max(lost / profile.accesses, 0.0), 1.0);
+}
@@ -1,13 +1,19 @@
 #include "Utils.h"
 
+#include "LaunchProfiler.h"
+
 #include <CL/cl.h>
 #include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <dlfcn.h>
 #include <iostream>
 #include <iterator>
 #include <fstream>
+#include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string.h>
@@ -89,6 +95,162 @@ std::string getEnvString(const char *name, const char *defValue) {
 }
 
 // OpenCL functions.
+//------------------------------------------------------------------------------
+template <typename FunctionType>
+static void resolveFunction(FunctionType &function, const char *name) {
+  *(void **)(&function) = dlsym(RTLD_NEXT, name);
+}
+
+static OriginalFunctions resolveOriginalFunctions() {
+  OriginalFunctions functions;
+  resolveFunction(functions.createProgramWithSource,
+                  CL_CREATE_PROGRAM_WITH_SOURCE_NAME);
+  resolveFunction(functions.createProgramWithBinary,
+                  CL_CREATE_PROGRAM_WITH_BINARY_NAME);
+  resolveFunction(functions.buildProgram, CL_BUILD_PROGRAM_NAME);
+  resolveFunction(functions.retainProgram, CL_RETAIN_PROGRAM_NAME);
+  resolveFunction(functions.releaseProgram, CL_RELEASE_PROGRAM_NAME);
+  resolveFunction(functions.getProgramInfo, CL_GET_PROGRAM_INFO_NAME);
+  resolveFunction(functions.getProgramBuildInfo,
+                  CL_GET_PROGRAM_BUILD_INFO_NAME);
+  resolveFunction(functions.createKernel, CL_CREATE_KERNEL_NAME);
+  resolveFunction(functions.setKernelArg, CL_SET_KERNEL_ARG_NAME);
+  resolveFunction(functions.releaseKernel, CL_RELEASE_KERNEL_NAME);
+  resolveFunction(functions.enqueueNDRangeKernel,
+                  CL_ENQUEUE_NDRANGE_KERNEL_NAME);
+  resolveFunction(functions.createCommandQueue, CL_CREATE_COMMAND_QUEUE_NAME);
+  return functions;
+}
+
+const OriginalFunctions &getOriginalFunctions() {
+  static const OriginalFunctions functions = resolveOriginalFunctions();
+  return functions;
+}
+
+//------------------------------------------------------------------------------
+// Parses a whole non-negative decimal number, returns false on anything else.
+static bool parseUnsigned(const std::string &text, unsigned long &value) {
+  const char *begin = text.c_str();
+  char *end = NULL;
+  errno = 0;
+  value = strtoul(begin, &end, 10);
+  while (end != begin && isspace((unsigned char)*end))
+    ++end;
+  return end != begin && *end == '\0' && errno == 0 &&
+         text.find('-') == std::string::npos;
+}
+
+// The value of the variable as a number up to INT_MAX, defValue if it is unset
+// or empty. Anything else is reported and ignored.
+static unsigned long getEnvUnsigned(const char *name, unsigned long defValue) {
+  std::string text = getEnvString(name);
+  unsigned long value = 0;
+  if (text.empty())
+    return defValue;
+  if (!parseUnsigned(text, value) || value > INT_MAX) {
+    std::cout << "Ignoring " << name << "=\"" << text << "\", using "
+              << defValue << "\n";
+    return defValue;
+  }
+  return value;
+}
+
+//------------------------------------------------------------------------------
+static WrapperConfig readWrapperConfig() {
+  WrapperConfig config;
+  config.kernelName = getEnvString(TC_KERNEL_NAME);
+  config.compilerOptions = getEnvString(OCL_COMPILER_OPTIONS);
+  config.maxCoarseningFactor = getEnvUnsigned("MAX_COARSENING_FACTOR", 0);
+  config.candidateFactors.push_back(1);
+  std::string candidateFactors = getEnvString(OCL_CANDIDATE_FACTORS);
+  if (!candidateFactors.empty()) {
+    std::istringstream factorsStream(candidateFactors);
+    std::string factor;
+    while (std::getline(factorsStream, factor, ',')) {
+      unsigned long value = 0;
+      if (!parseUnsigned(factor, value)) {
+        std::cout << "Ignoring the factor \"" << factor
+                  << "\" of " OCL_CANDIDATE_FACTORS "\n";
+        continue;
+      }
+      if (value > 1 && value <= config.maxCoarseningFactor)
+        config.candidateFactors.push_back(value);
+    }
+    std::sort(config.candidateFactors.begin(), config.candidateFactors.end());
+    config.candidateFactors.erase(std::unique(config.candidateFactors.begin(),
+                                              config.candidateFactors.end()),
+                                  config.candidateFactors.end());
+  } else {
+    for (unsigned int factor = 2; factor <= config.maxCoarseningFactor;
+         factor <<= 1)
+      config.candidateFactors.push_back(factor);
+  }
+
+  std::pair<unsigned int, unsigned int> cp =
+      getCoarseningOptions(config.compilerOptions);
+  cp.first = getEnvUnsigned("CF_OVERRIDE", cp.first);
+  if (cp.first == 0 && cp.second == 0)
+    cp = getVectorizationOptions(config.compilerOptions);
+  if (cp.first == 0 && cp.second == 0)
+    cp.first = 1;
+  config.coarseningFactor = cp.first;
+  config.coarseningDirection = cp.second;
+  if (!getCoarseningFactorsOption(config.compilerOptions,
+                                  config.coarseningFactors)) {
+    std::fill(config.coarseningFactors, config.coarseningFactors + 3, 1);
+    if (config.coarseningDirection < 3)
+      config.coarseningFactors[config.coarseningDirection] =
+          config.coarseningFactor;
+  } else if (config.maxCoarseningFactor > 0) {
+    // The sweep only rewrites -coarsening-factor, and scales the launch along
+    // one direction.
+    std::cout << "-coarsening-factors given: MAX_COARSENING_FACTOR ignored\n";
+    config.maxCoarseningFactor = 0;
+  }
+  if (config.maxCoarseningFactor > 0 &&
+      getCoarseningOptions(config.compilerOptions).first == 0) {
+    std::cout << "No -coarsening-factor in " OCL_COMPILER_OPTIONS
+                 ": MAX_COARSENING_FACTOR ignored\n";
+    config.maxCoarseningFactor = 0;
+  }
+  if (config.maxCoarseningFactor == 0)
+    config.candidateFactors.assign(1, 1);
+
+  config.repetitions = 1;
+  std::string repetitionsString = getEnvString(OCL_REPETITIONS);
+  if (repetitionsString != "")
+    std::istringstream(repetitionsString) >> config.repetitions;
+  config.compileThreads = getEnvUnsigned(OCL_COMPILE_THREADS, 0);
+
+  config.threadLevelCoarsening =
+      !getEnvString("THREAD_LEVEL_COARSENING").empty();
+  config.lazyCoarsening = !getEnvString(OCL_LAZY_COARSENING).empty();
+  config.dynamicCoarsening = !getEnvString(OCL_DYNAMIC_COARSENING).empty();
+  config.asyncProfiling = !getEnvString(OCL_ASYNC_PROFILING).empty();
+  config.traceFile = getEnvString(OCL_TRACE_FILE);
+  config.traceFormat = getEnvString(OCL_TRACE_FORMAT, "json");
+  config.launchContextFile = getEnvString(OCL_LAUNCH_CONTEXT);
+  config.cacheSimulation = !getEnvString(OCL_CACHE_SIMULATION).empty();
+
+  config.computeUnits = getEnvUnsigned("ARCH_COMPUTE_UNITS", 15);
+  config.maxActiveThreadsPerCU =
+      getEnvUnsigned("ARCH_ACTIVE_THREADS_PER_CU", 2048);
+  config.maxGroupsPerCU = getEnvUnsigned("ARCH_GROUPS_PER_CU", 16);
+  config.maxRegsPerCU = getEnvUnsigned("ARCH_REGS_PER_CU", 65536);
+  config.maxSMemPerCU = getEnvUnsigned("ARCH_SMEM_PER_CU", 49152);
+  config.l1Size = getEnvUnsigned("ARCH_L1_SIZE", 16384);
+  config.l1Ways = getEnvUnsigned("ARCH_L1_WAYS", 4);
+  config.l2Size = getEnvUnsigned("ARCH_L2_SIZE", 1572864);
+  config.l2Ways = getEnvUnsigned("ARCH_L2_WAYS", 16);
+  config.cacheLineSize = getEnvUnsigned("ARCH_CACHE_LINE_SIZE", 128);
+  return config;
+}
+
+const WrapperConfig &getWrapperConfig() {
+  static const WrapperConfig config = readWrapperConfig();
+  return config;
+}
+
 //------------------------------------------------------------------------------
 cl_device_id getDeviceFromContext(cl_context context,
                                   unsigned int deviceNumber) {
@@ -184,8 +346,7 @@ inline bool isError(cl_int valueToCheck) { return valueToCheck != CL_SUCCESS; }
 void verifyOutputCode(cl_int valueToCheck, const char *errorMessage) {
   if (isError(valueToCheck)) {
     std::cout << errorMessage << " " << valueToCheck << "\n";
-    std::string maxCoarseningFactor = getEnvString("MAX_COARSENING_FACTOR");
-    if (maxCoarseningFactor.empty()) {
+    if (getWrapperConfig().maxCoarseningFactor == 0) {
       exit(valueToCheck);
     } else {
       // do not exit if we're compiling several versions of code
@@ -219,10 +380,26 @@ std::string getKernelName(cl_kernel kernel) {
   return nameString;
 }
 
+//------------------------------------------------------------------------------
+std::string getDeviceInfoString(cl_device_id device, cl_device_info paramName) {
+  size_t valueSize;
+  cl_int errorCode = clGetDeviceInfo(device, paramName, 0, NULL, &valueSize);
+  verifyOutputCode(errorCode, "Error querying the device info size");
+  char *value = new char[valueSize];
+
+  errorCode = clGetDeviceInfo(device, paramName, valueSize, value, NULL);
+  verifyOutputCode(errorCode, "Error querying the device info");
+
+  std::string valueString(value);
+  delete[] value;
+
+  return valueString;
+}
+
 //------------------------------------------------------------------------------
 int compileWithAxtor(std::string &inputFile, std::string &clangOptions,
                      std::string &optOptions, std::string &outputFile,
-                     int seed, bool cacheLineReuseAnalysis) {
+                     int seed, const std::string &analysisOptions) {
   std::string bitcodeFile = getMangledFileName(BC_FILE, seed);
   //std::string bitcodeFilePostAxtor = getMangledFileName(BC_POST_AXTOR_FILE, seed);
   std::string clrFile = getMangledFileName(CLR_FILE, seed);
@@ -239,8 +416,9 @@ int compileWithAxtor(std::string &inputFile, std::string &clangOptions,
                          oclHeader + " -O0 " + clangOptions + " " + inputFile +
                          " -S -emit-llvm -fno-builtin -o " + bitcodeFile;
 
-  std::string clrOptions = cacheLineReuseAnalysis ? getEnvString("CLR_OPTIONS") : "";
-  std::string clrCmd = "LD_PRELOAD=\"\" opt " + clrOptions + " " + bitcodeFile + " 1> /dev/null 2> " + clrFile;
+  bool cacheLineReuseAnalysis = !analysisOptions.empty();
+  // The analyses print their results with -analyze.
+  std::string clrCmd = "LD_PRELOAD=\"\" opt -analyze " + analysisOptions + " " + bitcodeFile + " > " + clrFile + " 2>&1";
   //std::string clrClangCmd = "LD_PRELOAD=\"\" clang -x cl -target spir -include " +
   //                          oclHeader + " -O0 " + clangOptions + " " + outputFile +
   //                          " -S -emit-llvm -fno-builtin -o " + bitcodeFilePostAxtor;
@@ -339,45 +517,43 @@ int compileWithAxtor(std::string &inputFile, std::string &clangOptions,
 bool computeNDRangeDim(unsigned int dimensions, const size_t *globalSize,
                        const size_t *localSize, size_t *newGlobalSize,
                        size_t *newLocalSize) {
-  if (dimensions >= 4) {
-    std::cout << "4 or more dimensions are not supported by the wrapper.\n";
-    exit(1);
-  }
-
-  std::string compilerOptions = getEnvString(OCL_COMPILER_OPTIONS);
-  unsigned int CF = 0;
-  unsigned int CD = 0;
-  std::pair<unsigned int, unsigned int> cp =
-      getCoarseningOptions(compilerOptions);
-
-  CF = cp.first;
-  CD = cp.second;
-  
-  // this contains CF determined by model
-  std::string cfOverride = getEnvString("CF_OVERRIDE");
-  if (!cfOverride.empty()) {
-    CF = std::stoi(cfOverride);
-#ifdef __utils_verbose
-    std::cout << "Applied CF_OVERRIDE of factor " << CF << std::endl;
-#endif
-  }
+  const WrapperConfig &config = getWrapperConfig();
+  return computeNDRangeDim(dimensions, globalSize, localSize, newGlobalSize,
+                           newLocalSize, config.coarseningFactors);
+}
 
-  if (CF == 0 && CD == 0) {
-    cp = getVectorizationOptions(compilerOptions);
-    CF = cp.first;
-    CD = cp.second;
+//------------------------------------------------------------------------------
+bool computeNDRangeDim(unsigned int dimensions, const size_t *globalSize,
+                       const size_t *localSize, size_t *newGlobalSize,
+                       size_t *newLocalSize, unsigned int CF,
+                       unsigned int CD) {
+  unsigned int factors[3] = {1, 1, 1};
+  if (CD < 3) {
+    factors[CD] = CF;
+  } else if (CF != 1) {
+    std::cout << "Error specifying a coarsening direction higher "
+                 "than the number of dimensions.\n";
   }
+  return computeNDRangeDim(dimensions, globalSize, localSize, newGlobalSize,
+                           newLocalSize, factors);
+}
 
-  if (CF == 0 && CD == 0) {
-    CF = 1;
+//------------------------------------------------------------------------------
+bool computeNDRangeDim(unsigned int dimensions, const size_t *globalSize,
+                       const size_t *localSize, size_t *newGlobalSize,
+                       size_t *newLocalSize, const unsigned int *factors) {
+  if (dimensions >= 4) {
+    std::cout << "4 or more dimensions are not supported by the wrapper.\n";
+    exit(1);
   }
 
-  if (localSize == NULL && CF != 1) {
+  bool isCoarsened = factors[0] != 1 || factors[1] != 1 || factors[2] != 1;
+  if (localSize == NULL && isCoarsened) {
     std::cout << "Cannot apply coarsening when localSize is NULL.\n";
     return false;
   }
 
-  if (localSize == NULL && CF == 1) {
+  if (localSize == NULL && !isCoarsened) {
     memcpy(newGlobalSize, globalSize, dimensions * sizeof(size_t));
     return false;
   }
@@ -385,16 +561,17 @@ bool computeNDRangeDim(unsigned int dimensions, const size_t *globalSize,
   memcpy(newGlobalSize, globalSize, dimensions * sizeof(size_t));
   memcpy(newLocalSize, localSize, dimensions * sizeof(size_t));
 
-  // If the CD is higher than what it should be than do nothing.
-  if (CF != 1) {
+  for (unsigned int CD = 0; CD < 3; ++CD) {
+    unsigned int CF = factors[CD];
+    if (CF == 1)
+      continue;
+    // If the CD is higher than what it should be than do nothing.
     if (CD >= dimensions) {
       std::cout << "Error specifying a coarsening direction higher "
                    "than the number of dimensions.\n";
-      newGlobalSize[CD] = globalSize[CD];
-      newLocalSize[CD] = localSize[CD];
+      continue;
     }
-    std::string applyThreadLevelCoarsening = getEnvString("THREAD_LEVEL_COARSENING");
-    if (applyThreadLevelCoarsening.empty()) {
+    if (!getWrapperConfig().threadLevelCoarsening) {
 #ifdef __utils_verbose
       std::cout << "Using block level coarsening\n";
 #endif
@@ -424,12 +601,11 @@ void enqueueKernel(cl_command_queue command_queue, cl_kernel kernel,
                    const size_t *local_work_size,
                    cl_uint num_events_in_wait_list,
                    const cl_event *event_wait_list, cl_event *event,
-                   unsigned int repetitions, const std::string &kernelName) {
+                   unsigned int repetitions, const std::string &kernelName,
+                   const LaunchTraceInfo *traceInfo) {
 
-  // Get pointer to original function calls.
-  clEnqueueNDRangeKernelFunction originalclEnqueueKernel;
-  *(void **)(&originalclEnqueueKernel) =
-      dlsym(RTLD_NEXT, CL_ENQUEUE_NDRANGE_KERNEL_NAME);
+  clEnqueueNDRangeKernelFunction originalclEnqueueKernel =
+      getOriginalFunctions().enqueueNDRangeKernel;
 
   cl_int errorCode = 0;
 
@@ -466,16 +642,67 @@ void enqueueKernel(cl_command_queue command_queue, cl_kernel kernel,
         command_queue, kernel, work_dim, global_work_offset, global_work_size,
         local_work_size, num_events_in_wait_list, event_wait_list, event);
     verifyOutputCode(errorCode, "Error enqueuing the original kernel");
+    LaunchTraceSlot *traceSlot =
+        traceInfo != NULL ? reserveLaunchTrace(*traceInfo) : NULL;
+    if (getWrapperConfig().asyncProfiling) {
+      // Timed from the event callback, the application's queue is not
+      // synchronised. Only the last event is returned to the caller.
+      profileLaunchAsync(*event, kernelName, traceSlot);
+      if (index + 1 < repetitions)
+        clReleaseEvent(*event);
+      continue;
+    }
     clFinish(command_queue);
     cl_int eventStatus = clWaitForEvents(1, event);
     if (eventStatus == -5)
       std::cout << kernelName + " 0\n";
     else
       std::cout << kernelName << " " << computeEventDuration(event) << "\n";
+    if (traceSlot != NULL)
+      completeLaunchTrace(traceSlot, *event);
     verifyOutputCode(errorCode, "Error releasing the event");
   }
 }
 
+//------------------------------------------------------------------------------
+std::string getAnalysisOptions() {
+  std::string options = getEnvString("CLR_OPTIONS");
+  const std::string &launchContextFile = getWrapperConfig().launchContextFile;
+  if (!options.empty() && !launchContextFile.empty())
+    options += " -launch-context " + launchContextFile;
+
+  const WrapperConfig &config = getWrapperConfig();
+  if (!options.empty() && config.cacheSimulation) {
+    std::stringstream simulation;
+    simulation << " -cache-sim-factors ";
+    for (size_t index = 0; index < config.candidateFactors.size(); ++index)
+      simulation << (index > 0 ? "," : "") << config.candidateFactors[index];
+    simulation << " -cache-sim-threads " << config.maxActiveThreadsPerCU
+               << " -cache-sim-units " << config.computeUnits
+               << " -cache-sim-line-size " << config.cacheLineSize
+               << " -cache-sim-l1-size " << config.l1Size
+               << " -cache-sim-l1-ways " << config.l1Ways
+               << " -cache-sim-l2-size " << config.l2Size
+               << " -cache-sim-l2-ways " << config.l2Ways;
+    options += simulation.str();
+  }
+  return options;
+}
+
+//------------------------------------------------------------------------------
+std::string getMemoryCostOptions() {
+  std::istringstream tokens(getAnalysisOptions());
+  std::string options;
+  std::string token;
+  bool hasSymbolicExecution = false;
+  while (tokens >> token) {
+    hasSymbolicExecution = hasSymbolicExecution || token == "-symbolic-execution";
+    if (token != "-clr")
+      options += " " + token;
+  }
+  return hasSymbolicExecution ? options : "";
+}
+
 //------------------------------------------------------------------------------
 void splitCompilerOptions(std::string &clangOptions, std::string &oclOptions) {
   for (unsigned int index = 0; index < OCL_OPTIONS_NUMBER; ++index) {
@@ -534,6 +761,80 @@ getCoarseningOptions(const std::string &compilerOptions) {
                                   "-coarsening-direction");
 }
 
+//------------------------------------------------------------------------------
+bool addCoarseningFactorArg(std::string &source,
+                            const std::string &kernelName) {
+  // Either spelling of the qualifier: \b alone would not match __kernel, as
+  // there is no word boundary between _ and k. Qualifiers and attributes may
+  // come between kernel and void.
+  std::regex signature("(?:^|[^A-Za-z0-9_])(?:__)?kernel\\b[^;{]*?\\bvoid\\s+" +
+                       kernelName + "\\s*\\(");
+  std::smatch match;
+  if (kernelName.empty() || !std::regex_search(source, match, signature))
+    return false;
+
+  size_t begin = match.position(0) + match.length(0);
+  size_t end = begin;
+  for (int depth = 1; end < source.size(); ++end) {
+    if (source[end] == '(')
+      ++depth;
+    else if (source[end] == ')' && --depth == 0)
+      break;
+  }
+  if (end == source.size())
+    return false;
+
+  std::string parameters = source.substr(begin, end - begin);
+  size_t first = parameters.find_first_not_of(" \t\n\r");
+  size_t last = parameters.find_last_not_of(" \t\n\r");
+  std::string hiddenParameter =
+      "uint " COARSENING_FACTOR_ARG ", uint " COARSENING_GROUPS_ARG;
+  if (first == std::string::npos ||
+      parameters.substr(first, last - first + 1) == "void")
+    source.replace(begin, end - begin, hiddenParameter);
+  else
+    source.insert(end, ", " + hiddenParameter);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool getCoarseningFactorsOption(const std::string &compilerOptions,
+                                unsigned int *factors) {
+  const std::string flag = "-coarsening-factors";
+  std::istringstream iss(compilerOptions);
+  std::vector<std::string> tokens;
+  std::copy(std::istream_iterator<std::string>(iss),
+            std::istream_iterator<std::string>(),
+            std::back_inserter<std::vector<std::string>>(tokens));
+
+  // Both "-coarsening-factors 2,4" and "-coarsening-factors=2,4".
+  std::string list;
+  for (size_t index = 0; index < tokens.size(); ++index) {
+    if (tokens[index] == flag && index + 1 < tokens.size()) {
+      list = tokens[index + 1];
+    } else if (tokens[index].compare(0, flag.length() + 1, flag + "=") == 0) {
+      list = tokens[index].substr(flag.length() + 1);
+    }
+  }
+  if (list.empty())
+    return false;
+
+  std::fill(factors, factors + 3, 1);
+  std::istringstream listStream(list);
+  std::string factor;
+  for (unsigned int direction = 0;
+       direction < 3 && std::getline(listStream, factor, ','); ++direction) {
+    unsigned long value = 0;
+    if (!parseUnsigned(factor, value) || value == 0 || value > UINT_MAX) {
+      std::cout << "Ignoring -coarsening-factors " << list << ": \"" << factor
+                << "\" is not a factor\n";
+      return false;
+    }
+    factors[direction] = value;
+  }
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Returns vw/vd.
 std::pair<unsigned int, unsigned int>
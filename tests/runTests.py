@@ -78,16 +78,19 @@ CLR_OPTIONS = "-load " + LIB_THRUD + " -assumeRestrictArgs -domtree -gvn -basica
 ORED_OPTIONS = "-load " + LIB_THRUD + " -ored -kernel-name %s -shmem %s";
 #COMPUTE_CACHE = "~/.nv/ComputeCache";
 ORED_TMP_FILE = "/tmp/%s.txt";
+LAUNCH_CONTEXT_FILE = "/tmp/launchContext.txt";
 
 ### Modify these to control execution behaviour
 
 THREAD_LEVEL_COARSENING = False;         # False for block-level coarsening, True for thread-level coarsening
 OCCUPANCY_REDUCTION = False;             # experimental
+IN_PROCESS_COMPILATION = False;          # run clang/opt/axtor inside the wrapper, requires -DAXTOR_IN_PROCESS=ON
 tests = originalTests;
 arch = pascal;                           # use this if you have multiple GPUs and only want to run on one
 device = "1" if arch == kepler else "0";
 
 applyModel = len(sys.argv) > 1 and sys.argv[1] == "APPLY_COARSENING_MODEL"  # pass this arg to this script to run with coarsening model
+inProcessModel = len(sys.argv) > 1 and sys.argv[1] == "IN_PROCESS_MODEL"  # pass this arg to run the model in process, with two candidate factors and a launch context
 
 
 #-------------------------------------------------------------------------------
@@ -161,6 +164,9 @@ def runTest(command, kernelName, warpSize, cacheLineSize, ored, oredStr, cd, cf,
   if (THREAD_LEVEL_COARSENING):
     os.environ["THREAD_LEVEL_COARSENING"] = "true";
 
+  if (IN_PROCESS_COMPILATION or inProcessModel):
+    os.environ["IN_PROCESS_COMPILATION"] = "true";
+
   # set architectural parameters for model
   os.environ["ARCH_COMPUTE_UNITS"] = arch["computeUnits"];
   os.environ["ARCH_ACTIVE_THREADS_PER_CU"] = arch["maxActiveThreadsPerCU"];
@@ -202,6 +208,13 @@ def main():
   if (applyModel) :
     factors = ["1"];
     os.environ["MAX_COARSENING_FACTOR"] = "32";
+  elif (inProcessModel):
+    # Every candidate runs its own in-process pipeline with the same
+    # analysis options, -launch-context included.
+    factors = ["1"];
+    os.environ["MAX_COARSENING_FACTOR"] = "4";
+    os.environ["OCL_CANDIDATE_FACTORS"] = "2,4";
+    os.environ["OCL_LAUNCH_CONTEXT"] = LAUNCH_CONTEXT_FILE;
   else:
     factors = ["1", "2", "4", "8", "16", "32"];
   strides = ["32"];#, "2", "32"];
@@ -6,6 +6,8 @@
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
 
+#include <map>
+
 using namespace llvm;
 
 class DivergentRegion;
@@ -21,13 +23,25 @@ public:
 
 private:
   void extractBranches(DivergentRegion *region);
-  void isolateRegion(DivergentRegion *region);
+  bool isolateRegion(DivergentRegion *region);
+  BasicBlock *splitBlock(BasicBlock *block, Instruction *splitPoint);
+  void markChanged(BasicBlock *block);
+  void fillRegion(DivergentRegion *region);
+  bool isStale(DivergentRegion *region);
+  void verifyDominators(Function &function);
 
 private:
   LoopInfo *loopInfo;
   DominatorTree *dt;
   PostDominatorTree *pdt;
   SingleDimDivAnalysis *sdda;
+  // Set when an edit could not be applied to the post-dominator tree.
+  bool isPostDomStale;
+  // When each block was last changed and when each region listed its
+  // blocks, on the same clock.
+  unsigned int clock;
+  std::map<BasicBlock *, unsigned int> blockChanges;
+  std::map<DivergentRegion *, unsigned int> regionFills;
 };
 
 #endif
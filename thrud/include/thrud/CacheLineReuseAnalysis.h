@@ -5,10 +5,14 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 
+#include <map>
 #include <set>
 #include <vector>
 
+#include "thrud/CacheSimulator.h"
+#include "thrud/LaunchContext.h"
 #include "thrud/MemAccessDescriptor.h"
 #include "thrud/NDRange.h"
 #include "thrud/Utils.h"
@@ -21,15 +25,75 @@ class CacheLineReuseAnalysis : public FunctionPass {
     static char ID;
     const static unsigned int GLOBAL_ADDRESS_SPACE = 1;
     
-    CacheLineReuseAnalysis() : FunctionPass(ID) {}
+    CacheLineReuseAnalysis() : FunctionPass(ID), analysed(false), printed(false) {}
     //~CacheLineReuseAnalysis();
     virtual void getAnalysisUsage(AnalysisUsage &au) const;
     virtual bool runOnFunction(Function &F);
+    virtual void print(raw_ostream &out, const Module *module) const;
     //virtual bool doFinalization(Module &M);
 
   private:
+    // Cache lines first, first + stride, ..., last, numbered by line.
+    struct LineRun {
+      long long first;
+      long long last;
+      long long stride;
+
+      bool contains(long long line) const;
+      bool intersects(const LineRun &other) const;
+    };
+    // An access whose element index is offset + sum of coefficients[d] * id(d)
+    // + sum of loopSteps[l] * iteration(l). footprints holds the lines of
+    // every warp of the tile in the first iteration, then in the second
+    // iteration of each enclosing loop.
+    struct AffineAccess {
+      long long offset;
+      long long coefficients[3];
+      std::map<const Loop *, long long> loopSteps;
+      std::vector<std::vector<LineRun>> footprints;
+
+      AffineAccess() : offset(0), coefficients{0, 0, 0} {}
+      // The same value for every thread and iteration.
+      bool isUniform() const {
+        return coefficients[0] == 0 && coefficients[1] == 0 && coefficients[2] == 0 && loopSteps.empty();
+      }
+    };
+
+    // The lines re-used by the accesses to one symbol, by reuse distance:
+    // the number of distinct lines the tile touched in between.
+    struct SymbolReuse {
+      long long accesses;
+      long long reuses;
+      std::map<long long, long long> distances;
+
+      SymbolReuse() : accesses(0), reuses(0) {}
+    };
+
+    // The lines touched so far, for their reuse distances: the time of the
+    // last access to every line, and a Fenwick tree over the times marking
+    // the last accesses, which counts the lines touched since a time in
+    // logarithmic time.
+    class LineStack {
+      public:
+        LineStack() : time(0) {}
+        void clear();
+        // Records an access to the line. Returns the number of distinct
+        // lines touched since its previous access, -1 if there is none.
+        long long touch(StringRef symbolName, long long line);
+
+      private:
+        std::map<std::pair<StringRef, long long>, long long> lastAccesses;
+        std::vector<long long> marks;
+        long long time;
+
+        void mark(long long position, long long value);
+        long long countMarks(long long position) const;
+        void renumber();
+    };
+
     NDRange *ndr;
     LoopInfo *loopInfo;
+    ScalarEvolution *scalarEvolution;
     int dimensions;
     Instruction* lastInstruction;
     //std::vector<BasicBlock::Iterator> loopStack;
@@ -38,9 +102,51 @@ class CacheLineReuseAnalysis : public FunctionPass {
     std::set<Loop *> relevantLoops;
     std::vector<std::map<Instruction*, std::vector<MemAccessDescriptor>>> accessDescriptorStack;
     std::map<StringRef, std::set<int>> accessedCacheLines;
+    // Accesses analysed in closed form instead of simulated, and the lines
+    // they touch.
+    std::map<Instruction*, AffineAccess> affineAccesses;
+    std::set<Instruction*> simulatedAffineAccesses;
+    std::map<StringRef, std::vector<LineRun>> accessedLineRuns;
+    // Whether a kernel was analysed, and its results printed: opt -analyze
+    // prints after every function.
+    bool analysed;
+    mutable bool printed;
+    // Why the kernel cannot be analysed, and the first re-use found.
     std::string diagnosis;
+    std::string reuseDiagnosis;
+    // The lines touched so far, and the re-use of every symbol.
+    LineStack lineStack;
+    std::map<StringRef, SymbolReuse> symbolReuses;
+    // The accesses of every warp of the tile, and their replay for the
+    // factors of -cache-sim-factors.
+    MemoryTrace memoryTrace;
+    std::map<const Loop *, int> loopIds;
+    // Why the trace cannot be replayed, if it cannot.
+    std::string traceDiagnosis;
+    std::vector<CacheSimulationResult> cacheSimulations;
+    // Owns the values of all the descriptors of the current function.
+    MemAccessArena arena;
+    // The NDRange and the arguments the kernel is launched with, if known.
+    LaunchContext launchContext;
 
     int getDimensionality();
+    int getTileSize(int dimension) const;
+    int getTileWarps() const;
+    void touchLine(StringRef symbolName, long long line);
+    bool isTracing() const;
+    void recordWarpAccesses(StringRef symbolName, const std::vector<std::vector<long long>> &warpAddresses, const int warps[3],
+                            Loop *loop, long long step);
+    long long getTripCount(Loop *loop) const;
+    void simulateCaches();
+    int getNDRangeValue(Instruction* inst) const;
+    long long getArgumentValue(Argument* argument) const;
+    bool getUniformValue(Value* v, long long &value) const;
+    bool addAffineTerms(const SCEV* scev, long long factor, AffineAccess &access) const;
+    bool getAffineAccess(Instruction* memop, AffineAccess &access) const;
+    bool getFootprint(const AffineAccess &access, long long shift, int alignment, std::vector<LineRun> &footprint) const;
+    bool isAccessedBefore(StringRef symbolName, const std::vector<LineRun> &footprint);
+    bool isInAffineFootprints(StringRef symbolName, int cacheLine);
+    void simulateAffineAccess(Instruction* inst, const AffineAccess &access);
     inst_iterator simulate(inst_iterator inst, Instruction* fwdDef, Loop* innermostLoop);
     PHINode *getInductionVariable(Loop* loop) const;
     void preprocess(Function *function, std::set<Instruction*>& memops, std::set<Instruction*>& relevantInstructions);
@@ -51,7 +157,7 @@ class CacheLineReuseAnalysis : public FunctionPass {
     void mergeIntoStack(std::map<Instruction*, std::vector<MemAccessDescriptor>> &defs);
     bool isFwdDef(Instruction* inst);
     std::vector<MemAccessDescriptor> getOperand(Value * v);
-    void applyBinaryOp(function<int(int, int)> f, Instruction * inst);
+    template <typename Op> void applyBinaryOp(Op op, Instruction * inst);
 
     inline void addToStack(Instruction* inst, std::vector<MemAccessDescriptor> mad) {
       accessDescriptorStack.back().insert(std::pair<Instruction*, std::vector<MemAccessDescriptor>>(inst, mad));
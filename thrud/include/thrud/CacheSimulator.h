@@ -0,0 +1,122 @@
+#ifndef CACHE_SIMULATOR_H
+#define CACHE_SIMULATOR_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Sizes of one cache level.
+struct CacheGeometry {
+  int lineSize;
+  int sets;
+  int ways;
+
+  CacheGeometry() : lineSize(128), sets(1), ways(1) {}
+  CacheGeometry(int size, int ways, int lineSize);
+};
+
+// One level of a set-associative cache with LRU replacement.
+class CacheLevel {
+public:
+  CacheLevel(const CacheGeometry &geometry);
+
+public:
+  // Looks up the line of the address, filling it on a miss. Returns true on a
+  // hit.
+  bool access(long long address);
+  const CacheGeometry &getGeometry() const { return geometry; }
+
+private:
+  CacheGeometry geometry;
+  // The lines of every set, most recently used first.
+  std::vector<std::vector<long long>> sets;
+};
+
+// One memory instruction executed by one warp of the tile the cache line
+// re-use analysis simulates: the byte addresses of the lines its threads
+// touch, in the address space of the accessed array. In a loop the
+// instruction runs trips times, every iteration step bytes further; the
+// consecutive accesses of a warp in the same loop are iterated together.
+struct WarpAccess {
+  int warp;
+  int symbol;
+  int loop;
+  long long trips;
+  long long step;
+  std::vector<long long> addresses;
+
+  WarpAccess() : warp(0), symbol(0), loop(-1), trips(1), step(0) {}
+};
+
+// The accesses of every warp of the tile, in program order.
+class MemoryTrace {
+public:
+  MemoryTrace() : warps(0) {}
+
+public:
+  void clear();
+  void setWarps(int warps) { this->warps = warps; }
+  int getWarps() const { return warps; }
+  // The number of the array, given in the order they are first accessed.
+  int getSymbol(const std::string &name);
+  void add(const WarpAccess &access);
+  bool empty() const { return accesses.empty(); }
+
+  // The accesses of every warp, each a list of line addresses, with the loops
+  // unrolled up to maxTrips iterations.
+  std::vector<std::vector<std::vector<long long>>>
+  getWarpStreams(long long maxTrips) const;
+  // Whether getWarpStreams iterates every loop as a whole: no warp accesses
+  // the loop again after an access outside it, as in nested loops.
+  bool hasWholeLoops() const;
+
+  // The trace as text, for offline runs of the simulation.
+  bool write(const std::string &path) const;
+  bool read(const std::string &path);
+
+private:
+  int warps;
+  std::vector<std::string> symbols;
+  std::vector<WarpAccess> accesses;
+};
+
+// The device the trace is replayed on: the L1 of one compute unit and its
+// share of the L2, with residentThreads work-items of the kernel on it.
+struct CacheSimulationConfig {
+  CacheGeometry l1;
+  CacheGeometry l2;
+  int computeUnits;
+  int residentThreads;
+  int warpSize;
+  long long maxTrips;
+
+  CacheSimulationConfig()
+      : computeUnits(1), residentThreads(2048), warpSize(32), maxTrips(256) {}
+};
+
+// What the accesses of one coarsening factor cost: requests are the lines
+// the warps ask for, every L2 miss is a DRAM transaction. warps counts the
+// warps of the original kernel whose work was replayed.
+struct CacheSimulationResult {
+  unsigned int coarseningFactor;
+  long long warps;
+  long long requests;
+  long long l1Hits;
+  long long l2Hits;
+  long long dramTransactions;
+
+  CacheSimulationResult()
+      : coarseningFactor(1), warps(0), requests(0), l1Hits(0), l2Hits(0),
+        dramTransactions(0) {}
+};
+
+// Replays the trace on one compute unit for coarsening factor cf. Every
+// coarsened warp runs the accesses of cf warps of the original kernel, one
+// instruction of each replica in turn, and the resident warps take turns
+// instruction by instruction. The warps beyond the tile belong to other
+// work-groups and are taken to touch lines of their own.
+CacheSimulationResult simulateCoarsening(const MemoryTrace &trace,
+                                         const CacheSimulationConfig &config,
+                                         unsigned int cf);
+
+#endif
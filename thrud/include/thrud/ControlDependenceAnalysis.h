@@ -4,14 +4,18 @@
 // Implementation based on Ferrante et al. "Program Dependecene Graph and Its
 // Use in Optimization". page 324
 // The notation of the variables is taken from the paper.
+// The transitive dependences are kept as bit matrices indexed by block
+// number: queries are single bit tests.
 
 #include "thrud/DataTypes.h"
 
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+
 #include "llvm/Analysis/PostDominators.h"
 
-#include <map>
 #include <vector>
 
 using namespace llvm;
@@ -34,20 +38,21 @@ public:
   void dump();
 
 private:
-  void findS(Function &function);
-  void findLs();
-  void buildGraph();
-  void fillGraph(Function &function);
+  void numberBlocks(Function &function);
+  void buildGraph(Function &function);
   void transitiveClosure();
   void buildBackwardGraph();
+  int getIndex(BasicBlock *block) const;
+  void dumpGraph(const std::vector<BitVector> &graph);
 
 private:
-  typedef std::map<BasicBlock *, BlockVector> GraphMap;
   PostDominatorTree *pdt;
-  GraphMap forwardGraph;
-  GraphMap backwardGraph;
-  std::vector<std::pair<BasicBlock *, BasicBlock *> > s;
-  BlockVector ls;
+  BlockVector blocks;
+  DenseMap<BasicBlock *, unsigned int> blockIndices;
+  // forwardGraph[a][b]: b is control dependent on a.
+  std::vector<BitVector> forwardGraph;
+  // backwardGraph[b][a]: the same dependence, without the self loops.
+  std::vector<BitVector> backwardGraph;
 };
 
 #endif
@@ -9,6 +9,8 @@
 
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/SmallPtrSet.h"
+
 #include "llvm/Analysis/PostDominators.h"
 
 using namespace llvm;
@@ -19,6 +21,9 @@ public:
   InstVector &getOutermostDivInsts();
   InstVector getDivInsts(DivergentRegion *region);
   bool isDivergent(Instruction *inst);
+  // Keep the divergent set up to date when the CFG is rewritten.
+  void addDivInst(Instruction *inst);
+  void removeDivInst(Instruction *inst);
   GlobalsSet &getShMemGlobalsUsedIn(Function *f);
 
   RegionVector &getDivRegions();
@@ -41,6 +46,8 @@ private:
 
 protected:
   InstVector divInsts;
+  // Same content as divInsts, for constant time isDivergent.
+  SmallPtrSet<Instruction *, 64> divInstsSet;
   InstVector outermostDivInsts;
   InstVector divBranches;
   RegionVector regions;
@@ -64,6 +71,9 @@ public:
 
 public:
   virtual InstVector getTids();
+
+private:
+  unsigned int direction;
 };
 
 class MultiDimDivAnalysis : public FunctionPass, public DivergenceAnalysis {
@@ -0,0 +1,44 @@
+#ifndef LAUNCH_CONTEXT_H
+#define LAUNCH_CONTEXT_H
+
+#include <map>
+#include <string>
+
+// The launch of a kernel as the host performs it: the NDRange and the values
+// of the integer arguments. It is read from the file given with
+// -launch-context, which the interposer writes at enqueue time, one entry per
+// kernel:
+//
+//   kernel <name>
+//   work_dim <n>
+//   global_size <x> <y> <z>
+//   local_size <x> <y> <z>
+//   arg <index> <value>
+//
+// Without the option, or an entry for the kernel, the analyses keep their
+// default sizes and argument values.
+class LaunchContext {
+public:
+  LaunchContext();
+
+public:
+  // Reads the entry of the kernel. Returns false if there is none.
+  bool read(const std::string &kernelName);
+
+  bool hasSizes() const;
+  int getWorkDim() const;
+  int getLocalSize(int direction) const;
+  int getGlobalSize(int direction) const;
+  int getNumberOfGroups(int direction) const;
+
+  // The value of the argument in position index, if known.
+  bool getArgument(unsigned int index, long long &value) const;
+
+private:
+  int workDim;
+  int globalSize[3];
+  int localSize[3];
+  std::map<unsigned int, long long> arguments;
+};
+
+#endif
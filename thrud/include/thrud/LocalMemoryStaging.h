@@ -0,0 +1,101 @@
+#ifndef LOCAL_MEMORY_STAGING_H
+#define LOCAL_MEMORY_STAGING_H
+
+#include "thrud/DataTypes.h"
+
+#include "llvm/IR/IRBuilder.h"
+
+#include "llvm/Pass.h"
+
+using namespace llvm;
+
+namespace llvm {
+class CastInst;
+class GetElementPtrInst;
+class LoadInst;
+class Loop;
+class LoopInfo;
+class PHINode;
+}
+
+class MultiDimDivAnalysis;
+class NDRange;
+
+// Stages in __local memory the global loads that walk an array with the
+// iteration variable of a uniform loop, so that the work-items of a group
+// sharing the same elements, as the replicas of a kernel coarsened in y do,
+// read them from global memory once. Every T iterations of the loop, T being
+// the work-group size in x, the group loads the next T elements of each
+// array into a tile, between two barriers. The tiles are sized for the
+// work-group size given with -staging-group-size: for any other size the
+// kernel takes the original global loads.
+class LocalMemoryStaging : public FunctionPass {
+public:
+  static char ID;
+  const static unsigned int GLOBAL_ADDRESS_SPACE = 1;
+  const static unsigned int LOCAL_ADDRESS_SPACE = 3;
+  const static unsigned int CLK_LOCAL_MEM_FENCE = 1;
+
+  LocalMemoryStaging();
+
+  virtual bool runOnFunction(Function &function);
+  virtual void getAnalysisUsage(AnalysisUsage &au) const;
+
+  // Global accesses served from local memory when the kernel is staged. The
+  // cache line re-use analysis skips them.
+  static bool isStaged(const Instruction *inst);
+
+private:
+  // A staged load: address = base[cast(iv * stride + offset)], with
+  // loop-invariant stride and offset. stride is null for unit stride, cast
+  // is null when the index is not extended.
+  struct StagedLoad {
+    LoadInst *load;
+    Value *base;
+    Value *stride;
+    Value *offset;
+    CastInst *cast;
+    // Whether the offset depends on the local id in y and z: the tile has
+    // one row per work-item in those directions.
+    bool rows[3];
+  };
+
+  // The loop bounds: the loop runs while iv < upper, iv going from lower
+  // with step 1.
+  struct StagedLoop {
+    Loop *loop;
+    PHINode *iv;
+    Value *lower;
+    Value *upper;
+    bool isSigned;
+    BasicBlock *body;
+  };
+
+  bool analyzeLoop(Loop *loop, StagedLoop &stagedLoop);
+  bool isReachedUniformly(Loop *loop);
+  bool isUniform(Value *value);
+  bool dependsOnDirection(Value *value, int direction,
+                          std::set<Value *> &visited);
+  bool writesTo(Loop *loop, Value *base);
+  bool analyzeLoad(StagedLoop &stagedLoop, LoadInst *load,
+                   StagedLoad &stagedLoad);
+
+  void stageLoop(StagedLoop &stagedLoop, std::vector<StagedLoad> &loads);
+  Value *getGroupSizeGuard(IRBuilder<> &builder);
+  Value *getRowStart(const StagedLoad &stagedLoad, Value **localIds,
+                     IRBuilder<> &builder);
+  unsigned int getTileRows(const StagedLoad &stagedLoad);
+  unsigned int getTileBytes(const StagedLoad &stagedLoad);
+  void addToLoop(Loop *loop, BasicBlock *block);
+
+private:
+  unsigned int groupSize[3];
+  unsigned int stagedBytes;
+  unsigned int tileNumber;
+  Function *function;
+  LoopInfo *loopInfo;
+  NDRange *ndr;
+  MultiDimDivAnalysis *mdda;
+};
+
+#endif
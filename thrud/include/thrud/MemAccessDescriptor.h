@@ -3,34 +3,105 @@
 
 #include <vector>
 #include <list>
-#include <functional>
+#include <memory>
+#include <algorithm>
 
 using namespace std;
 
+// Bump allocator for the values of the MemAccessDescriptors of one analysis
+// run. Descriptors never free their values: everything goes away at reset.
+class MemAccessArena {
+
+  public:
+    MemAccessArena();
+    int *allocate(size_t n);
+    void reset();
+    size_t getUsedBytes() const { return usedBytes; }
+
+  private:
+    struct Chunk {
+      unique_ptr<int[]> data;
+      size_t size;
+    };
+    std::vector<Chunk> chunks;
+    size_t currentChunk;
+    size_t currentOffset;
+    size_t usedBytes;
+};
+
+// The value of an expression for every thread of a tile, stored as a flat
+// sizes[0]*sizes[1]*sizes[2] array (x fastest) in the arena. Dimensions of
+// size 1 are broadcast: their stride is 0. Descriptors are immutable once
+// computed, so copying one only copies the handle.
 class MemAccessDescriptor {
 
   private:
-    void init(const int x, const int y, const int z);
+    MemAccessDescriptor() {}
+    void init(MemAccessArena &arena, const int x, const int y, const int z);
+    const int *getData() const { return isValue ? &value : data; }
+    // Descriptor with the broadcast sizes of a and b, values left unset.
+    static MemAccessDescriptor allocate(MemAccessArena &arena, const MemAccessDescriptor &a, const MemAccessDescriptor &b);
+
+    // One x row of an element-wise op. An operand with stride 0 is
+    // broadcast; each case is a plain loop the compiler vectorises.
+    template <typename Op>
+    static void computeRow(Op op, int *__restrict__ out, const int *__restrict__ a, int aStride,
+                           const int *__restrict__ b, int bStride, int n) {
+      if (aStride != 0 && bStride != 0) {
+        for (int i = 0; i < n; i++) out[i] = op(a[i], b[i]);
+      } else if (aStride != 0) {
+        const int bValue = *b;
+        for (int i = 0; i < n; i++) out[i] = op(a[i], bValue);
+      } else if (bStride != 0) {
+        const int aValue = *a;
+        for (int i = 0; i < n; i++) out[i] = op(aValue, b[i]);
+      } else {
+        std::fill(out, out + n, (int)op(*a, *b));
+      }
+    }
 
   public:
-    static int SIZE;
     static int CACHE_SIZE;
     bool isValue;
     int value;
-    //bool hasDim[3] = {false, false, false};
     int sizes [3] = {1, 1, 1};
-    std::vector<vector<vector<int>>> mad;
-    
+    int strides [3] = {0, 0, 0};
+    int *data;
+
   public:
     MemAccessDescriptor(int value);
-    MemAccessDescriptor(int dimension, int n);
-    MemAccessDescriptor(const int x, const int y, const int z);
-    MemAccessDescriptor(function<int(int, int)> f, MemAccessDescriptor &a, MemAccessDescriptor &b);
-    MemAccessDescriptor select(MemAccessDescriptor &a, MemAccessDescriptor &b);
-    bool hasDim(int d);
-    MemAccessDescriptor compute(function<int(int, int)> f, MemAccessDescriptor &op);
-    list<int> getMemAccesses(int warpSize, int align, int cacheLineSize, bool *fullCoalescing);
-    void print();
+    MemAccessDescriptor(MemAccessArena &arena, int dimension, int n);
+    MemAccessDescriptor(MemAccessArena &arena, const int x, const int y, const int z);
+    MemAccessDescriptor select(MemAccessArena &arena, const MemAccessDescriptor &a, const MemAccessDescriptor &b) const;
+    bool hasDim(int d) const;
+    int size() const { return sizes[0] * sizes[1] * sizes[2]; }
+    // Value of thread (i, j, k); broadcast dimensions ignore their index.
+    int at(int i, int j, int k) const {
+      return getData()[i * strides[0] + j * strides[1] + k * strides[2]];
+    }
+    // Element-wise op, specialised at compile time for each opcode.
+    template <typename Op>
+    MemAccessDescriptor compute(MemAccessArena &arena, Op op, const MemAccessDescriptor &operand) const {
+      if (isValue && operand.isValue) {
+        return MemAccessDescriptor(op(value, operand.value));
+      }
+      MemAccessDescriptor result = allocate(arena, *this, operand);
+      int *out = result.data;
+      for (int k = 0; k < result.sizes[2]; k++) {
+        for (int j = 0; j < result.sizes[1]; j++) {
+          computeRow(op, out,
+                     getData() + j * strides[1] + k * strides[2], strides[0],
+                     operand.getData() + j * operand.strides[1] + k * operand.strides[2], operand.strides[0],
+                     result.sizes[0]);
+          out += result.sizes[0];
+        }
+      }
+      return result;
+    }
+    // The lines of every warp in turn. warpLines, if given, receives the
+    // number of lines of each warp.
+    list<int> getMemAccesses(int warpSize, int align, int cacheLineSize, bool *fullCoalescing, vector<int> *warpLines = NULL) const;
+    void print() const;
 };
 
 #endif
@@ -0,0 +1,41 @@
+#ifndef NDRANGE_POINT_H
+#define NDRANGE_POINT_H
+
+#include "thrud/NDRangeSpace.h"
+
+#include <string>
+#include <vector>
+
+// A work-item of an NDRangeSpace: its local id and the id of its group.
+class NDRangePoint {
+public:
+  NDRangePoint(int localX, int localY, int localZ, int groupX, int groupY,
+               int groupZ, const NDRangeSpace &ndRangeSpace);
+
+public:
+  int getLocalX() const;
+  int getLocalY() const;
+  int getLocalZ() const;
+
+  int getGlobalX() const;
+  int getGlobalY() const;
+  int getGlobalZ() const;
+
+  int getGroupX() const;
+  int getGroupY() const;
+  int getGroupZ() const;
+
+  int getLocal(int direction) const;
+  int getGlobal(int direction) const;
+  int getGroup(int direction) const;
+
+  int getCoordinate(const std::string &name, int direction) const;
+  const NDRangeSpace &getNDRangeSpace() const;
+
+private:
+  std::vector<int> local;
+  std::vector<int> group;
+  NDRangeSpace ndRangeSpace;
+};
+
+#endif
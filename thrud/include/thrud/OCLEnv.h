@@ -20,6 +20,7 @@ public:
   static const int WARP_SIZE;
   static const int CACHELINE_SIZE;
   static const int UNKNOWN_MEMORY_LOCATION;
+  static unsigned const int GLOBAL_AS;
   static unsigned const int LOCAL_AS;
 
 public:
@@ -0,0 +1,52 @@
+#ifndef REPLICA_VECTORIZATION_H
+#define REPLICA_VECTORIZATION_H
+
+#include "thrud/DataTypes.h"
+
+#include "llvm/Pass.h"
+
+using namespace llvm;
+
+namespace llvm {
+class Function;
+class ScalarEvolution;
+class StoreInst;
+}
+
+// Packs the replicas of a coarsened kernel into vector operations. With
+// thread level coarsening and stride 1 the replicas of a store write
+// consecutive addresses: they become a vstoreN, and the isomorphic
+// instructions computing the stored values become vector instructions, down
+// to the consecutive loads, which become vloadN.
+class ReplicaVectorization : public FunctionPass {
+public:
+  static char ID;
+  ReplicaVectorization();
+
+  virtual bool runOnFunction(Function &function);
+  virtual void getAnalysisUsage(AnalysisUsage &au) const;
+
+private:
+  bool vectorizeBlock(BasicBlock &block);
+  bool findStoreBundle(StoreInst *seed, std::vector<StoreInst *> &stores,
+                       std::vector<StoreInst *> &bundle);
+  bool isConsecutive(Value *first, Value *second, Type *type,
+                     unsigned int lane);
+  bool isPackable(const ValueVector &bundle);
+  bool canMoveMemoryBundle(const ValueVector &bundle, bool isStore);
+  Instruction *getLastInstruction(const ValueVector &bundle);
+
+  void vectorizeStores(const std::vector<StoreInst *> &bundle);
+  Value *vectorizeBundle(const ValueVector &bundle, Instruction *insertPoint);
+  Value *gatherBundle(const ValueVector &bundle, Instruction *insertPoint);
+  Function *getVectorMemoryFunction(Module *module, bool isStore,
+                                    Type *elementType,
+                                    unsigned int addressSpace);
+
+private:
+  unsigned int width;
+  Type *sizeType;
+  ScalarEvolution *se;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef SUBSCRIPT_ANALYSIS_H
+#define SUBSCRIPT_ANALYSIS_H
+
+#include "thrud/NDRangePoint.h"
+
+#include <vector>
+
+namespace llvm {
+class SCEV;
+class ScalarEvolution;
+class Value;
+}
+
+using namespace llvm;
+
+class OCLEnv;
+
+// Evaluates a scalar evolution expression, such as the offset of a memory
+// access, for given work-items. Integer kernel arguments take the values of
+// the OCLEnv, loop variables their value at the first iteration.
+class SubscriptAnalysis {
+public:
+  SubscriptAnalysis(ScalarEvolution *scalarEvolution, const OCLEnv *ocl);
+
+public:
+  // One value per point. Returns false if the expression depends on
+  // something other than the ids, the sizes and the integer arguments.
+  bool analyzeSubscript(const SCEV *scev,
+                        const std::vector<NDRangePoint> &points,
+                        std::vector<int> &values);
+  bool resolve(const SCEV *scev, const NDRangePoint &point, int &value);
+
+private:
+  bool resolveUnknown(Value *value, const NDRangePoint &point, int &result);
+
+private:
+  ScalarEvolution *scalarEvolution;
+  const OCLEnv *ocl;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef SYMBOLIC_EXECUTION_H
 #define SYMBOLIC_EXECUTION_H
 
+#include "thrud/NDRangePoint.h"
 #include "thrud/NDRangeSpace.h"
 
 #include "llvm/Pass.h"
@@ -29,7 +30,10 @@ class NDRange;
 class OCLEnv;
 class SubscriptAnalysis;
 
-/// Collect information about the kernel function.
+/// Collect information about the kernel function: for the first warp of the
+/// first work-group, the number of transactions of every global memory access
+/// and the bank conflicts of every local memory access. Accesses in loops are
+/// weighted by the trip count of the enclosing loops.
 namespace {
 class SymbolicExecution : public FunctionPass,
                           public InstVisitor<SymbolicExecution> {
@@ -58,15 +62,16 @@ public:
   std::vector<int> loopStoreBankConflicts;
 
 private:
-  void memoryAccessAnalysis(BasicBlock &block, std::vector<int> &loadTrans,
-                            std::vector<int> &storeTrans);
-  void init();
+  void memoryAccessAnalysis(BasicBlock &block);
+  void init(Function &function);
   void initBuffers();
-  void initOCLSpace();
+  void initOCLSpace(Function &function);
+  int getLoopWeight(BasicBlock &block);
   void visitLoadInst(LoadInst &loadInst);
   void visitStoreInst(StoreInst &storeInst);
   void visitMemoryInst(Value *pointer, std::vector<int> &resultVector);
   void visitLocalMemoryInst(Value *pointer, std::vector<int> &resultVector);
+  bool getAddresses(Value *pointer, std::vector<int> &addresses);
   void dump();
 
 private:
@@ -76,6 +81,15 @@ private:
   NDRange *ndr;
   LoopInfo *loopInfo;
   NDRangeSpace ndrSpace;
+  std::vector<NDRangePoint> warp;
+
+  // The vectors the accesses of the current block go to.
+  std::vector<int> *currentLoadTransactions;
+  std::vector<int> *currentStoreTransactions;
+  std::vector<int> *currentLoadBankConflicts;
+  std::vector<int> *currentStoreBankConflicts;
+  int currentWeight;
+  int unknownAccesses;
 };
 }
 
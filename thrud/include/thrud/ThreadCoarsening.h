@@ -12,6 +12,7 @@
 using namespace llvm;
 
 namespace llvm {
+class Argument;
 class BasicBlock;
 }
 
@@ -24,6 +25,11 @@ public:
     FullMerging
   };
 
+  enum CoarseningMode {
+    Replicate,
+    Loop
+  };
+
 public:
   static char ID;
   ThreadCoarsening();
@@ -39,6 +45,9 @@ private:
   void scaleSizes();
   void scaleIds();
   void scaleIdsThreadLevelCoarsening();
+  Instruction *insertSubThreadsMul(Value *value, Instruction *bookmark,
+                                   unsigned int multiplier);
+  Value *insertOriginalSize(Instruction *size);
 
   // Coarsening.
   void coarsenFunction();
@@ -56,7 +65,8 @@ private:
 
   void replicateRegionFalseMerging(DivergentRegion *region);
   void replicateRegionTrueMerging(DivergentRegion *region);
-  void replicateRegionMerging(DivergentRegion *region, unsigned int branch);
+  void replicateRegionMerging(DivergentRegion *region,
+                              const std::vector<unsigned int> &branches);
   void replicateRegionFullMerging(DivergentRegion *region);
   void applyCoarseningMap(DivergentRegion &region, unsigned int index);
   void applyCoarseningMap(BasicBlock *block, unsigned int index);
@@ -67,29 +77,42 @@ private:
   // Manage placeholders.
   void replacePlaceholders();
 
-  // Region merging methods.
-  BasicBlock *getExitingSubregion();
+  // Loop coarsening.
+  bool canCoarsenWithLoop(Function &function);
+  PHINode *createCoarseningLoop(Function &function);
+  void offsetScaledIds(PHINode *subThread);
 
-  BasicBlock *createTopBranch(DivergentRegion *region);
-  DivergentRegion *createCascadingFirstRegion(DivergentRegion *region,
-                                              BasicBlock *pred,
-                                              unsigned int branchIndex,
-                                              Map &valueMap);
+  // Region merging methods.
+  bool canMergeRegion(DivergentRegion *region);
+  BasicBlock *createTopBranch(DivergentRegion *region, BasicBlock *pred,
+                              unsigned int branchIndex, BasicBlock *cascade,
+                              BasicBlock *merged);
   Instruction *insertBooleanReduction(Instruction *base, InstVector &insts,
-                                      llvm::Instruction::BinaryOps binOp);
-  void updateExitPhiNodes(BasicBlock *target,
-                          BasicBlock *mergedSubregionExiting,
-                          InstVector &aliveFromMerged, Map &cloningMap,
+                                      llvm::Instruction::BinaryOps binOp,
+                                      BasicBlock *block);
+  BasicBlock *createMergedSubregion(DivergentRegion *region,
+                                    unsigned int branchIndex,
+                                    BasicBlock *join,
+                                    BasicBlock *&mergedExiting,
+                                    std::vector<ValueVector> &aliveValues);
+  void updateExitPhiNodes(DivergentRegion *region, BasicBlock *join,
                           BasicBlock *replicatedExiting,
+                          const BlockVector &mergedExitings,
+                          const std::vector<std::vector<ValueVector>> &merged,
                           CoarseningMap &aliveMap);
-  void removeRedundantBlocks(DivergentRegion *region, unsigned int branchIndex);
-  void buildPhiMap(DivergentRegion *region, InstVector &aliveFromMerged,
-                   BasicBlock *mergedSubregionExiting, Map &result);
 
 private:
   unsigned int direction;
   unsigned int factor;
   unsigned int stride;
+  // In loop mode the kernel coarsened by factor runs tripCount times.
+  unsigned int tripCount;
+  // The kernel argument holding the trip count when the factor is only known
+  // at launch, null otherwise.
+  Argument *factorArg;
+  // The kernel argument holding the number of work-groups of the original
+  // NDRange when the grid is rounded up, null otherwise.
+  Argument *groupsArg;
   DivRegionOption divRegionOption;
 
   PostDominatorTree *pdt;
@@ -103,6 +126,8 @@ private:
   Map phReplacementMap;
   GlobalsSet shMemGlobals;
   GlobalsCMap shMemGlobalsCMap;
+  // The scaled ids the replicas are computed from.
+  InstVector scaledIds;
 };
 
 #endif
@@ -148,6 +148,22 @@ Instruction *getAndInst(Value *value, unsigned int factor);
 Instruction *getDivInst(Value *value, unsigned int divisor);
 Instruction *getModuloInst(Value *value, unsigned int modulo);
 
+// Coarsening options.
+// With -coarsening-factors the passes run once per coarsened dimension, in
+// increasing order. These return the dimension and the factor of the current
+// run on the given function.
+unsigned int getCoarseningDirection(const Function *function);
+unsigned int getCoarseningFactor(const Function *function);
+// Moves the function to the next coarsened dimension.
+void completeCoarseningDirection(const Function *function);
+bool isMultiDimCoarsening();
+
+// Option lists.
+// Every parse of the command line appends to the values of a cl::list. A
+// process that parses the options of several pipelines, as the in-process
+// compiler of the wrapper does, clears them before each parse. Found by name.
+extern "C" void clearThrudOptionLists();
+
 // System Utils
 std::string getEnvString(const char *name, const char *defValue);
 static bool THREAD_LEVEL_COARSENING = !(getEnvString("THREAD_LEVEL_COARSENING", "").empty());
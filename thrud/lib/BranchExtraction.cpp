@@ -27,11 +27,13 @@
 #include <functional>
 #include <utility>
 
+#define VERIFY_DOMINATORSxxx
+
 using namespace llvm;
 
 extern cl::opt<std::string> KernelNameCL;
 cl::opt<int> CoarseningDirectionCL("coarsening-direction", cl::init(0),
-                                   cl::Hidden,
+                                   cl::Hidden, cl::ZeroOrMore,
                                    cl::desc("The coarsening direction"));
 
 //------------------------------------------------------------------------------
@@ -64,27 +66,106 @@ bool BranchExtraction::runOnFunction(Function &F) {
   sdda = &getAnalysis<SingleDimDivAnalysis>();
   RegionVector &regions = sdda->getDivRegions();
 
-  // This is terribly inefficient.
+  // The CFG edits below update dt and pdt in place. Only the regions that
+  // contain an edited block list their blocks again.
+  isPostDomStale = false;
+  clock = 0;
+  blockChanges.clear();
+  regionFills.clear();
+
   for (auto region : regions) {
+    if (isPostDomStale) {
+      pdt->DT->recalculate(F);
+      isPostDomStale = false;
+    }
     BasicBlock *newExiting = findImmediatePostDom(region->getHeader(), pdt);
-    region->setExiting(newExiting);
-    region->fillRegion();
+    if (newExiting != region->getExiting() || isStale(region)) {
+      region->setExiting(newExiting);
+      fillRegion(region);
+    }
     extractBranches(region);
-    region->fillRegion();
-    isolateRegion(region);
-    region->fillRegion();
+    fillRegion(region);
+    if (isolateRegion(region))
+      fillRegion(region);
     region->findAliveValues();
-    dt->recalculate(F);
-    pdt->DT->recalculate(F);
   }
 
-  std::for_each(
-      regions.begin(), regions.end(),
-      [this](DivergentRegion *region) { region->fillRegion(); });
+  if (isPostDomStale)
+    pdt->DT->recalculate(F);
+
+#ifdef VERIFY_DOMINATORS
+  verifyDominators(F);
+#endif
+
+  for (auto region : regions) {
+    if (isStale(region))
+      fillRegion(region);
+  }
 
   return regions.size() != 0;
 }
 
+//------------------------------------------------------------------------------
+// SplitBlock updates dt and loopInfo. In the post-dominator tree the new
+// block, which ends with the old terminator, takes the place of the old
+// one; the old block is post-dominated by it. An exit block would change
+// the roots of the tree, so the tree is rebuilt instead.
+BasicBlock *BranchExtraction::splitBlock(BasicBlock *block,
+                                         Instruction *splitPoint) {
+  DomTreeNode *node = pdt->getNode(block);
+  bool isExit = succ_begin(block) == succ_end(block);
+  BasicBlock *ipdom = nullptr;
+  if (node != nullptr && node->getIDom() != nullptr)
+    ipdom = node->getIDom()->getBlock();
+
+  BasicBlock *newBlock = SplitBlock(block, splitPoint, this);
+  markChanged(block);
+
+  if (node == nullptr || isExit || ipdom == nullptr) {
+    isPostDomStale = true;
+  } else if (!isPostDomStale) {
+    pdt->DT->addNewBlock(newBlock, ipdom);
+    pdt->DT->changeImmediateDominator(block, newBlock);
+  }
+  return newBlock;
+}
+
+//------------------------------------------------------------------------------
+void BranchExtraction::markChanged(BasicBlock *block) {
+  blockChanges[block] = ++clock;
+}
+
+//------------------------------------------------------------------------------
+void BranchExtraction::fillRegion(DivergentRegion *region) {
+  region->fillRegion();
+  regionFills[region] = ++clock;
+}
+
+//------------------------------------------------------------------------------
+bool BranchExtraction::isStale(DivergentRegion *region) {
+  unsigned int filled = regionFills[region];
+  BlockVector &blocks = region->getBlocks();
+  return std::any_of(blocks.begin(), blocks.end(),
+                     [this, filled](BasicBlock *block) {
+    auto change = blockChanges.find(block);
+    return change != blockChanges.end() && change->second > filled;
+  });
+}
+
+//------------------------------------------------------------------------------
+// Compares the incrementally updated trees with fresh ones.
+void BranchExtraction::verifyDominators(Function &function) {
+  DominatorTree freshDT;
+  freshDT.recalculate(function);
+  if (dt->compare(freshDT))
+    errs() << "BranchExtraction: dominator tree out of date\n";
+
+  DominatorTreeBase<BasicBlock> freshPDT(true);
+  freshPDT.recalculate(function);
+  if (pdt->DT->compare(freshPDT))
+    errs() << "BranchExtraction: post-dominator tree out of date\n";
+}
+
 //------------------------------------------------------------------------------
 // Isolate the exiting block from the rest of the graph.
 // If it has incoming edges coming from outside the current region
@@ -95,7 +176,7 @@ void BranchExtraction::extractBranches(DivergentRegion *region) {
   BasicBlock *newHeader = nullptr;
 
   if (!loopInfo->isLoopHeader(header))
-    newHeader = SplitBlock(header, header->getTerminator(), this);
+    newHeader = splitBlock(header, header->getTerminator());
   else {
     newHeader = header;
     Loop *loop = loopInfo->getLoopFor(header);
@@ -106,7 +187,7 @@ void BranchExtraction::extractBranches(DivergentRegion *region) {
   }
 
   Instruction *firstNonPHI = exiting->getFirstNonPHI();
-  BasicBlock *newExiting = SplitBlock(exiting, firstNonPHI, this);
+  BasicBlock *newExiting = splitBlock(exiting, firstNonPHI);
   region->setHeader(newHeader);
 
   // Check is a region in the has as header exiting.
@@ -121,12 +202,13 @@ void BranchExtraction::extractBranches(DivergentRegion *region) {
 }
 
 // -----------------------------------------------------------------------------
-void BranchExtraction::isolateRegion(DivergentRegion *region) {
+// Returns false if the region was already isolated.
+bool BranchExtraction::isolateRegion(DivergentRegion *region) {
   BasicBlock *exiting = region->getExiting();
 
   // If the header dominates the exiting bail out.
   if (dt->dominates(region->getHeader(), region->getExiting()))
-    return;
+    return false;
 
   // TODO.
   // Verify that the incoming branch from outside is pointing to the exiting
@@ -140,17 +222,55 @@ void BranchExtraction::isolateRegion(DivergentRegion *region) {
 
   // All the blocks in the region pointing to the exiting are redirected to the
   // new exiting.
-  for (auto iter = region->begin(), iterEnd = region->end(); iter != iterEnd;
-       ++iter) {
-    TerminatorInst *terminator = (*iter)->getTerminator();
+  BlockVector redirected;
+  for (auto block : region->getBlocks()) {
+    TerminatorInst *terminator = block->getTerminator();
     for (unsigned int index = 0; index < terminator->getNumSuccessors();
          ++index) {
       if (terminator->getSuccessor(index) == exiting) {
         terminator->setSuccessor(index, newExiting);
+        if (redirected.empty() || redirected.back() != block)
+          redirected.push_back(block);
       }
     }
   }
 
+  // Dominators: 'newExiting' is dominated by the common dominator of the
+  // redirected blocks; 'exiting' keeps the common dominator of its
+  // predecessors.
+  if (redirected.empty()) {
+    // 'newExiting' is unreachable.
+    dt->recalculate(*exiting->getParent());
+    isPostDomStale = true;
+  } else {
+    BasicBlock *newExitingIDom = redirected.front();
+    for (auto block : redirected) {
+      newExitingIDom = dt->findNearestCommonDominator(newExitingIDom, block);
+      markChanged(block);
+    }
+    dt->addNewBlock(newExiting, newExitingIDom);
+    BasicBlock *exitingIDom = newExiting;
+    for (pred_iterator iter = pred_begin(exiting), iterEnd = pred_end(exiting);
+         iter != iterEnd; ++iter) {
+      exitingIDom = dt->findNearestCommonDominator(exitingIDom, *iter);
+    }
+    if (dt->getNode(exiting)->getIDom()->getBlock() != exitingIDom)
+      dt->changeImmediateDominator(exiting, exitingIDom);
+  }
+
+  // Post-dominators: 'newExiting' is post-dominated by 'exiting' and takes
+  // its place for the region blocks it post-dominated.
+  if (!isPostDomStale) {
+    pdt->DT->addNewBlock(newExiting, exiting);
+    for (auto block : region->getBlocks()) {
+      DomTreeNode *node = pdt->getNode(block);
+      if (block != exiting && node != nullptr && node->getIDom() != nullptr &&
+          node->getIDom()->getBlock() == exiting)
+        pdt->DT->changeImmediateDominator(block, newExiting);
+    }
+  }
+  markChanged(exiting);
+
   // 'newExiting' will contain the phi working on the values from the blocks
   // in the region.
   // 'Exiting' will contain the phi working on the values from the blocks
@@ -160,8 +280,6 @@ void BranchExtraction::isolateRegion(DivergentRegion *region) {
   PhiVector newPhis;
   PhiVector exitPhis;
 
-  InstVector &divInsts = sdda->getDivInsts();
-
   for (auto phi: oldPhis) {
     PHINode *newPhi = PHINode::Create(phi->getType(), 0,
                                       phi->getName() + Twine(".new_exiting"),
@@ -180,11 +298,9 @@ void BranchExtraction::isolateRegion(DivergentRegion *region) {
     exitPhis.push_back(exitPhi);
 
     // Update divInsts.
-    if (std::find(divInsts.begin(), divInsts.end(),
-                  static_cast<Instruction *>(phi)) !=
-        divInsts.end()) {
-      divInsts.push_back(newPhi);
-      divInsts.push_back(exitPhi);
+    if (sdda->isDivergent(phi)) {
+      sdda->addDivInst(newPhi);
+      sdda->addDivInst(exitPhi);
     }
   }
 
@@ -203,16 +319,13 @@ void BranchExtraction::isolateRegion(DivergentRegion *region) {
   // Delete the old phi nodes.
   for (auto toDelete: oldPhis) {
     // Update divInsts.
-    InstVector::iterator iter = std::find(divInsts.begin(), divInsts.end(),
-                                          static_cast<Instruction *>(toDelete));
-    if (iter != divInsts.end()) {
-      divInsts.erase(iter);
-    }
+    sdda->removeDivInst(toDelete);
 
     toDelete->eraseFromParent();
   }
 
   region->setExiting(newExiting);
+  return true;
 }
 
 //------------------------------------------------------------------------------
@@ -1,18 +1,22 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <set>
 #include <map>
-#include <list>
 #include <functional>
+#include <iterator>
 #include <algorithm>
+#include <cstdlib>
 
 #include "thrud/CacheLineReuseAnalysis.h"
+#include "thrud/LocalMemoryStaging.h"
 #include "thrud/MemAccessDescriptor.h"
 #include "thrud/NDRange.h"
 #include "thrud/Utils.h"
@@ -25,12 +29,223 @@ using namespace llvm;
 const int MAX_DIMENSIONS[] = {32,2,2};
 
 extern cl::opt<std::string> KernelNameCL;
-cl::opt<unsigned int> WarpSize("warp-size", cl::init(32), cl::Hidden, cl::desc("The size of one warp within which threads perform lock-step execution"));
-cl::opt<unsigned int> CacheLineSize("cache-line-size", cl::init(32), cl::Hidden, cl::desc("The size of a cache line in bytes"));
+cl::opt<unsigned int> WarpSize("warp-size", cl::init(32), cl::Hidden, cl::ZeroOrMore, cl::desc("The size of one warp within which threads perform lock-step execution"));
+cl::opt<unsigned int> CacheLineSize("cache-line-size", cl::init(32), cl::Hidden, cl::ZeroOrMore, cl::desc("The size of a cache line in bytes"));
+cl::list<unsigned int> CacheSimFactors("cache-sim-factors", cl::CommaSeparated, cl::Hidden, cl::ZeroOrMore, cl::desc("Coarsening factors to replay the accesses of the tile for on a simulated cache"));
+cl::opt<std::string> CacheSimTrace("cache-sim-trace", cl::init(""), cl::Hidden, cl::ZeroOrMore, cl::desc("File to write the accesses of the tile to, for cache-sim-report"));
+cl::opt<unsigned int> CacheSimThreads("cache-sim-threads", cl::init(2048), cl::Hidden, cl::ZeroOrMore, cl::desc("Work-items resident on a compute unit in the cache simulation"));
+cl::opt<unsigned int> CacheSimUnits("cache-sim-units", cl::init(15), cl::Hidden, cl::ZeroOrMore, cl::desc("Compute units sharing the L2 in the cache simulation"));
+cl::opt<unsigned int> CacheSimLineSize("cache-sim-line-size", cl::init(128), cl::Hidden, cl::ZeroOrMore, cl::desc("The size of a line of the simulated caches in bytes"));
+cl::opt<unsigned int> CacheSimL1Size("cache-sim-l1-size", cl::init(16384), cl::Hidden, cl::ZeroOrMore, cl::desc("The size of the simulated L1 of a compute unit in bytes"));
+cl::opt<unsigned int> CacheSimL1Ways("cache-sim-l1-ways", cl::init(4), cl::Hidden, cl::ZeroOrMore, cl::desc("The associativity of the simulated L1"));
+cl::opt<unsigned int> CacheSimL2Size("cache-sim-l2-size", cl::init(1572864), cl::Hidden, cl::ZeroOrMore, cl::desc("The size of the simulated L2 in bytes"));
+cl::opt<unsigned int> CacheSimL2Ways("cache-sim-l2-ways", cl::init(16), cl::Hidden, cl::ZeroOrMore, cl::desc("The associativity of the simulated L2"));
+cl::opt<unsigned int> CacheSimTrips("cache-sim-trips", cl::init(256), cl::Hidden, cl::ZeroOrMore, cl::desc("Iterations of a loop replayed in the cache simulation, and assumed when unknown"));
+
+// The alignment of a load or store, which the simulation takes as the size of
+// the accessed elements.
+static int getAlignment(Instruction * inst) {
+  if (LoadInst * load = dyn_cast<LoadInst>(inst)) {
+    return load->getAlignment();
+  } else if (StoreInst * store = dyn_cast<StoreInst>(inst)) {
+    return store->getAlignment();
+  }
+  return -1;
+}
 
 void CacheLineReuseAnalysis::getAnalysisUsage(AnalysisUsage &au) const {
   au.addRequired<NDRange>();
   au.addRequired<LoopInfo>();
+  au.addRequired<ScalarEvolution>();
+}
+
+// The threads simulated in each dimension: at most MAX_DIMENSIONS, and no more
+// than the work-group the kernel is launched with.
+int CacheLineReuseAnalysis::getTileSize(int dimension) const {
+  if (!launchContext.hasSizes()) {
+    return MAX_DIMENSIONS[dimension];
+  }
+  return std::min(MAX_DIMENSIONS[dimension], launchContext.getLocalSize(dimension));
+}
+
+// The warps of the tile of a kernel that uses every id.
+int CacheLineReuseAnalysis::getTileWarps() const {
+  int warps = (getTileSize(0) + WarpSize - 1) / WarpSize;
+  for (int dimension = 1; dimension < dimensions; dimension++) {
+    warps *= getTileSize(dimension);
+  }
+  return warps;
+}
+
+// Records an access to the line and, if the tile touched it before, its reuse
+// distance: the position of the line in the stack of the lines touched so
+// far, most recent first.
+void CacheLineReuseAnalysis::touchLine(StringRef symbolName, long long line) {
+  SymbolReuse &symbolReuse = symbolReuses[symbolName];
+  symbolReuse.accesses++;
+  long long distance = lineStack.touch(symbolName, line);
+  if (distance >= 0) {
+    symbolReuse.reuses++;
+    symbolReuse.distances[distance]++;
+  }
+}
+
+void CacheLineReuseAnalysis::LineStack::clear() {
+  lastAccesses.clear();
+  marks.clear();
+  time = 0;
+}
+
+long long CacheLineReuseAnalysis::LineStack::touch(StringRef symbolName, long long line) {
+  if (time + 1 >= (long long)marks.size()) {
+    renumber();
+  }
+  time++;
+  long long distance = -1;
+  auto inserted = lastAccesses.insert(std::make_pair(std::make_pair(symbolName, line), time));
+  if (!inserted.second) {
+    long long previous = inserted.first->second;
+    distance = countMarks(time - 1) - countMarks(previous);
+    mark(previous, -1);
+    inserted.first->second = time;
+  }
+  mark(time, 1);
+  return distance;
+}
+
+void CacheLineReuseAnalysis::LineStack::mark(long long position, long long value) {
+  for (; position < (long long)marks.size(); position += position & -position) {
+    marks[position] += value;
+  }
+}
+
+// The marks at times 1 to position.
+long long CacheLineReuseAnalysis::LineStack::countMarks(long long position) const {
+  long long count = 0;
+  for (; position > 0; position -= position & -position) {
+    count += marks[position];
+  }
+  return count;
+}
+
+// Numbers the last accesses from 1 in the same order, with room for as many
+// new accesses, when the tree is full.
+void CacheLineReuseAnalysis::LineStack::renumber() {
+  std::vector<std::pair<long long, long long *>> times;
+  for (auto &lastAccess : lastAccesses) {
+    times.push_back(std::make_pair(lastAccess.second, &lastAccess.second));
+  }
+  std::sort(times.begin(), times.end());
+  marks.assign(std::max<size_t>(2 * times.size() + 2, 1024), 0);
+  time = 0;
+  for (auto &entry : times) {
+    *entry.second = ++time;
+    mark(time, 1);
+  }
+}
+
+// The trace is only kept for the cache simulation.
+bool CacheLineReuseAnalysis::isTracing() const {
+  return !CacheSimFactors.empty() || !CacheSimTrace.empty();
+}
+
+// Adds the lines of every warp of the tile to the trace. The accesses are
+// given for a grid of warps, of size 1 in the dimensions they do not depend
+// on: those warps stand for all the warps of the tile along the dimension.
+void CacheLineReuseAnalysis::recordWarpAccesses(StringRef symbolName, const std::vector<std::vector<long long>> &warpAddresses,
+                                                const int warps[3], Loop *loop, long long step) {
+  int tileWarps[3] = {(getTileSize(0) + (int)WarpSize - 1) / (int)WarpSize, 1, 1};
+  for (int dimension = 1; dimension < dimensions; dimension++) {
+    tileWarps[dimension] = getTileSize(dimension);
+  }
+  memoryTrace.setWarps(getTileWarps());
+
+  WarpAccess access;
+  access.symbol = memoryTrace.getSymbol(symbolName);
+  if (loop != NULL) {
+    auto loopId = loopIds.insert(std::make_pair(loop, (int)loopIds.size()));
+    access.loop = loopId.first->second;
+    access.trips = getTripCount(loop);
+    access.step = step;
+  }
+  for (int z = 0; z < tileWarps[2]; z++) {
+    for (int y = 0; y < tileWarps[1]; y++) {
+      for (int x = 0; x < tileWarps[0]; x++) {
+        int index = (std::min(z, warps[2] - 1) * warps[1] + std::min(y, warps[1] - 1)) * warps[0] + std::min(x, warps[0] - 1);
+        if (index < 0 || index >= (int)warpAddresses.size()) {
+          continue;
+        }
+        access.warp = (z * tileWarps[1] + y) * tileWarps[0] + x;
+        access.addresses = warpAddresses[index];
+        memoryTrace.add(access);
+      }
+    }
+  }
+}
+
+// The iterations of the loop, if scalar evolution can count them with the
+// launch context, otherwise -cache-sim-trips.
+long long CacheLineReuseAnalysis::getTripCount(Loop *loop) const {
+  const SCEV * backedges = scalarEvolution->getBackedgeTakenCount(loop);
+  AffineAccess count;
+  if (!isa<SCEVCouldNotCompute>(backedges) && addAffineTerms(backedges, 1, count) && count.isUniform() && count.offset >= 0) {
+    return count.offset + 1;
+  }
+  return CacheSimTrips;
+}
+
+// Replays the trace for every factor of -cache-sim-factors, and writes it to
+// -cache-sim-trace, unless its loops cannot be replayed.
+void CacheLineReuseAnalysis::simulateCaches() {
+  if (traceDiagnosis.empty() && !memoryTrace.hasWholeLoops()) {
+    traceDiagnosis = "the accesses of a loop are split by a nested loop";
+  }
+  if (!traceDiagnosis.empty()) {
+    errs() << "Skipping the cache simulation: " << traceDiagnosis << "\n";
+    return;
+  }
+  if (!CacheSimTrace.empty() && !memoryTrace.write(CacheSimTrace)) {
+    errs() << "Cannot write the memory trace to " << CacheSimTrace << "\n";
+  }
+  CacheSimulationConfig config;
+  config.l1 = CacheGeometry(CacheSimL1Size, CacheSimL1Ways, CacheSimLineSize);
+  config.l2 = CacheGeometry(CacheSimL2Size, CacheSimL2Ways, CacheSimLineSize);
+  config.computeUnits = CacheSimUnits;
+  config.residentThreads = CacheSimThreads;
+  config.warpSize = WarpSize;
+  config.maxTrips = CacheSimTrips;
+  for (unsigned int cf : CacheSimFactors) {
+    cacheSimulations.push_back(simulateCoarsening(memoryTrace, config, cf));
+  }
+}
+
+// The value of get_global_size, get_local_size, get_group_id and get_num_groups
+// in the simulation: the first work-group of the launch.
+int CacheLineReuseAnalysis::getNDRangeValue(Instruction* inst) const {
+  if (ndr->isGroupId(inst)) {
+    return 0;
+  }
+  int dimension = ndr->getDirection(inst);
+  if (ndr->isGroupsNum(inst)) {
+    return launchContext.hasSizes() ? launchContext.getNumberOfGroups(dimension) : 1;
+  }
+  if (launchContext.hasSizes()) {
+    return ndr->isGlobalSize(inst) ? launchContext.getGlobalSize(dimension) : launchContext.getLocalSize(dimension);
+  }
+  int n = 1;
+  for (int i = 0; i < dimensions; i++) {
+    n *= MAX_DIMENSIONS[i];
+  }
+  return n;
+}
+
+// Integer arguments take the value the host sets, if known.
+long long CacheLineReuseAnalysis::getArgumentValue(Argument* argument) const {
+  long long value = 10000;
+  if (argument->getType()->isIntegerTy()) {
+    launchContext.getArgument(argument->getArgNo(), value);
+  }
+  return value;
 }
 
 int CacheLineReuseAnalysis::getDimensionality() {
@@ -150,7 +365,8 @@ void CacheLineReuseAnalysis::preprocess(Function *function, std::set<Instruction
       // only process loads and stores to global memory
       errs() << "  " << *inst << "\n";
       lastInstruction = inst;
-      if ((inst->getOpcode() == Instruction::Load || inst->getOpcode() == Instruction::Store) && isCachedAddressSpace(inst)) {
+      // loads staged in local memory do not go through the cache on the staged path
+      if ((inst->getOpcode() == Instruction::Load || inst->getOpcode() == Instruction::Store) && isCachedAddressSpace(inst) && !LocalMemoryStaging::isStaged(inst)) {
 	memops.insert(inst);
 	const int paramIdx = inst->getOpcode() == Instruction::Load ? 0 : 1;
 	if (Instruction *operand = dyn_cast<Instruction>(inst->getOperand(paramIdx))) {
@@ -160,7 +376,13 @@ void CacheLineReuseAnalysis::preprocess(Function *function, std::set<Instruction
 #ifdef DEBUG_PRINT
           errs () << "preprocessing " << *operand << "\n";
 #endif
-	  defs.insert(operand);
+	  // affine accesses are analysed in closed form, their index is not simulated
+	  AffineAccess access;
+	  if (getAffineAccess(inst, access)) {
+	    affineAccesses[inst] = access;
+	  } else {
+	    defs.insert(operand);
+	  }
           StringRef symbolName = getAccessedSymbolName(operand);
           if (!symbolName.empty()) {
             accessedCacheLines.insert(std::pair<StringRef, std::set<int>>(symbolName, std::set<int>()));
@@ -240,7 +462,19 @@ bool CacheLineReuseAnalysis::runOnFunction(Function &F) {
 
   ndr = &getAnalysis<NDRange>();
   loopInfo = &getAnalysis<LoopInfo>();
-
+  scalarEvolution = &getAnalysis<ScalarEvolution>();
+  affineAccesses.clear();
+  simulatedAffineAccesses.clear();
+  accessedLineRuns.clear();
+  reuseDiagnosis.clear();
+  lineStack.clear();
+  symbolReuses.clear();
+  memoryTrace.clear();
+  loopIds.clear();
+  traceDiagnosis.clear();
+  cacheSimulations.clear();
+  launchContext = LaunchContext();
+  launchContext.read(FunctionName);
 
   dimensions = getDimensionality();
 #ifdef DEBUG_PRINT
@@ -267,19 +501,76 @@ bool CacheLineReuseAnalysis::runOnFunction(Function &F) {
   }
 #endif
 
+  // The descriptors of the previous function point into the arena.
+  accessDescriptorStack.clear();
+  arena.reset();
   accessDescriptorStack.push_back(std::map<Instruction*, vector<MemAccessDescriptor>>());
   simulate(inst_begin(F), lastInstruction, NULL);
+  if (diagnosis.empty() && isTracing()) {
+    simulateCaches();
+  }
 
 #ifdef DEBUG_PRINT
-  errs() << F.getName() << " used " << MemAccessDescriptor::SIZE << " bytes for MADs and " << MemAccessDescriptor::CACHE_SIZE << " for cache: "
-         << (MemAccessDescriptor::SIZE + MemAccessDescriptor::CACHE_SIZE) << " bytes\n";
+  errs() << F.getName() << " used " << arena.getUsedBytes() << " bytes for MADs and " << MemAccessDescriptor::CACHE_SIZE << " for cache: "
+         << (arena.getUsedBytes() + MemAccessDescriptor::CACHE_SIZE) << " bytes\n";
 #endif
-  if (diagnosis.empty()) {
-    errs() << "No cache line re-use detected, OK to coarsen\n";
+  analysed = true;
+  printed = false;
+  return false;
+}
+
+// Prints the reuse distances of every symbol, if the whole kernel could be
+// simulated, then the same verdict the wrapper looks for on the last line of
+// the external clr run. Once per analysed kernel.
+void CacheLineReuseAnalysis::print(raw_ostream &out, const Module *) const {
+  if (!analysed || printed) {
+    return;
+  }
+  printed = true;
+  if (diagnosis.empty() && !symbolReuses.empty()) {
+    long long accesses = 0;
+    for (auto const &symbolReuse : symbolReuses) {
+      accesses += symbolReuse.second.accesses;
+    }
+    out << "Reuse profile: " << getTileWarps() << " warps of " << WarpSize << " threads, " << CacheLineSize << " byte lines, " << accesses << " accesses\n";
+    for (auto const &symbolReuse : symbolReuses) {
+      const SymbolReuse &reuse = symbolReuse.second;
+      out << "Reuse distances of [" << symbolReuse.first << "]: " << reuse.accesses << " accesses, " << reuse.reuses << " reuses ("
+          << (reuse.accesses > 0 ? 100 * reuse.reuses / reuse.accesses : 0) << "%):";
+      for (auto const &distance : reuse.distances) {
+        out << " " << distance.first << ":" << distance.second;
+      }
+      out << "\n";
+    }
+    for (const CacheSimulationResult &result : cacheSimulations) {
+      long long requests = std::max(result.requests, 1LL);
+      out << "Cache simulation of CF " << result.coarseningFactor << ": " << result.warps << " warps, " << result.requests << " requests, "
+          << result.l1Hits << " L1 hits (" << 100 * result.l1Hits / requests << "%), " << result.l2Hits << " L2 hits ("
+          << 100 * result.l2Hits / requests << "%), " << result.dramTransactions << " DRAM transactions\n";
+    }
+  }
+  if (!diagnosis.empty()) {
+    out << diagnosis << "\n";
+  } else if (!reuseDiagnosis.empty()) {
+    out << reuseDiagnosis << "\n";
   } else {
-    errs() << diagnosis << "\n";
+    out << "No cache line re-use detected, OK to coarsen\n";
   }
-  return false;
+}
+
+// Instantiated once per opcode in simulate.
+template <typename Op>
+void CacheLineReuseAnalysis::applyBinaryOp(Op op, Instruction * inst) {
+  std::vector<MemAccessDescriptor> ops1 = getOperand(inst->getOperand(0));
+  std::vector<MemAccessDescriptor> ops2 = getOperand(inst->getOperand(1));
+  std::vector<MemAccessDescriptor> result;
+  result.reserve(ops1.size() * ops2.size());
+  for (const MemAccessDescriptor &op1 : ops1) {
+    for (const MemAccessDescriptor &op2 : ops2) {
+      result.push_back(op1.compute(arena, op, op2));
+    }
+  }
+  addToStack(inst, result);
 }
 
 inst_iterator
@@ -295,18 +586,10 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
     if (relevantInstructions.count(inst) > 0 && diagnosis.empty()) {
       if (ndr->isLocal(inst) || ndr->isGlobal(inst)) {
 	int dimension = ndr->getDirection(inst);
-	MemAccessDescriptor v(dimension, MAX_DIMENSIONS[dimension]);
+	MemAccessDescriptor v(arena, dimension, getTileSize(dimension));
         addToStack(inst, v);
-      } else if (ndr->isGlobalSize(inst) || ndr->isLocalSize(inst)) {
-	int n = 1;
-	for (int i = 0; i < dimensions; i++) {
-	  n *= MAX_DIMENSIONS[i];
-	}
-        addToStack(inst, MemAccessDescriptor(n));
-      } else if (ndr->isGroupId(inst)) {
-        addToStack(inst, MemAccessDescriptor(0));
-      } else if (ndr->isGroupsNum(inst)) {
-        addToStack(inst, MemAccessDescriptor(1));
+      } else if (ndr->isGlobalSize(inst) || ndr->isLocalSize(inst) || ndr->isGroupId(inst) || ndr->isGroupsNum(inst)) {
+        addToStack(inst, MemAccessDescriptor(getNDRangeValue(inst)));
       } else if (memops.count(inst) > 0) {
         StringRef accessedSymbolName = getAccessedSymbolName(inst);
         diagnosis = "Program is data dependent in access to [" + std::string(accessedSymbolName) + "]";
@@ -333,10 +616,10 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
 	std::vector<MemAccessDescriptor> ops1 = getOperand(inst->getOperand(1));
 	std::vector<MemAccessDescriptor> ops2 = getOperand(inst->getOperand(2));
 	std::vector<MemAccessDescriptor> result;
-	for (MemAccessDescriptor pred : preds) {
-	  for (MemAccessDescriptor op1 : ops1) {
-	    for (MemAccessDescriptor op2 : ops2) {
-	      result.push_back(pred.select(op1, op2));
+	for (const MemAccessDescriptor &pred : preds) {
+	  for (const MemAccessDescriptor &op1 : ops1) {
+	    for (const MemAccessDescriptor &op2 : ops2) {
+	      result.push_back(pred.select(arena, op1, op2));
 	    }
 	  }
 	}
@@ -436,18 +719,14 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
       } else {
 	diagnosis = "Unknown opcode - " + std::to_string(inst->getOpcode());
       }
+    } else if (affineAccesses.count(inst) > 0 && diagnosis.empty()) {
+      simulateAffineAccess(inst, affineAccesses[inst]);
     } else if (memops.count(inst) > 0 && diagnosis.empty()) {
 #ifdef DEBUG_PRINT
       errs() << "Simulating mem access for " << *inst << "\n";
 #endif
-      int alignment = -1;
-      bool isStore = false;
-      if (inst->getOpcode() == Instruction::Load) {
-	alignment = dyn_cast<LoadInst>(inst)->getAlignment();
-      } else if (inst->getOpcode() == Instruction::Store) {
-	alignment = dyn_cast<StoreInst>(inst)->getAlignment();
-	isStore = true;
-      }
+      int alignment = getAlignment(inst);
+      bool isStore = inst->getOpcode() == Instruction::Store;
       Value * ptr = getAccessedSymbolPtr(inst);
       StringRef accessedSymbolName = getAccessedSymbolName(ptr);
       std::vector<MemAccessDescriptor> mads = getOperand(ptr);
@@ -456,7 +735,29 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
       for (MemAccessDescriptor & mad : mads) {
 	mad.print();
 	bool fullCoalescing = true;
-	list<int> accesses = mad.getMemAccesses(WarpSize, alignment, CacheLineSize, &fullCoalescing);
+	std::vector<int> warpLines;
+	list<int> accesses = mad.getMemAccesses(WarpSize, alignment, CacheLineSize, &fullCoalescing, &warpLines);
+	if (!isStore || !fullCoalescing) {
+	  for (int line : accesses) {
+	    touchLine(accessedSymbolName, line / (int)CacheLineSize);
+	  }
+	  if (isTracing()) {
+	    std::vector<std::vector<long long>> warpAddresses;
+	    auto line = accesses.begin();
+	    for (int lines : warpLines) {
+	      auto end = std::next(line, lines);
+	      warpAddresses.push_back(std::vector<long long>(line, end));
+	      line = end;
+	    }
+	    int warps[3] = {(mad.sizes[0] + (int)WarpSize - 1) / (int)WarpSize, mad.sizes[1], mad.sizes[2]};
+	    // the simulation only runs two iterations of the loops, which cannot
+	    // be replayed for as many trips as the affine accesses
+	    if (loopInfo->getLoopFor(inst->getParent()) != NULL && traceDiagnosis.empty()) {
+	      traceDiagnosis = "the access to [" + std::string(accessedSymbolName) + "] in a loop is not affine";
+	    }
+	    recordWarpAccesses(accessedSymbolName, warpAddresses, warps, NULL, 0);
+	  }
+	}
 	int accessesNum = accesses.size();
 	accesses.sort();
 	accesses.unique();
@@ -467,6 +768,9 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
 	  std::vector<int> intersection(prevAccesses->size() + accesses.size());
 	  duplicates = set_intersection(prevAccesses->begin(), prevAccesses->end(), accesses.begin(), accesses.end(), intersection.begin()) - intersection.begin();
 	}
+	if (duplicates == 0 && uniqueAccessesNum > 1) {
+	  duplicates = count_if(accesses.begin(), accesses.end(), [&](int line) {return isInAffineFootprints(accessedSymbolName, line);});
+	}
 
 	accessesToAdd.insert(accesses.begin(), accesses.end());
 
@@ -475,8 +779,9 @@ CacheLineReuseAnalysis::simulate(inst_iterator it, Instruction* fwdDef, Loop *in
 #endif
 	if (isStore && fullCoalescing) {
 	  errs() << "Ignoring mem accesses of fully coalesced store instruction";
-	} else if (duplicates > 0 && uniqueAccessesNum > 1) {
-	  diagnosis = "Cache line re-use in access to [" + std::string(accessedSymbolName) + "]";
+	} else if (duplicates > 0 && uniqueAccessesNum > 1 && reuseDiagnosis.empty()) {
+	  // keep simulating for the reuse distances
+	  reuseDiagnosis = "Cache line re-use in access to [" + std::string(accessedSymbolName) + "]";
 	}
       }
       prevAccesses->insert(accessesToAdd.begin(), accessesToAdd.end());
@@ -505,18 +810,6 @@ void CacheLineReuseAnalysis::mergeIntoStack(std::map<Instruction*, std::vector<M
   }
 }
 
-void CacheLineReuseAnalysis::applyBinaryOp(function<int(int, int)> f, Instruction * inst) {
-  std::vector<MemAccessDescriptor> ops1 = getOperand(inst->getOperand(0));
-  std::vector<MemAccessDescriptor> ops2 = getOperand(inst->getOperand(1));
-  std::vector<MemAccessDescriptor> result;
-  for (MemAccessDescriptor op1 : ops1) {
-    for (MemAccessDescriptor op2 : ops2) {
-      result.push_back(op1.compute(f, op2));
-    }
-  }
-  addToStack(inst, result);
-}
-
 std::vector<MemAccessDescriptor> CacheLineReuseAnalysis::findInStack(Instruction* inst) {
   for (auto it = accessDescriptorStack.rbegin(); it != accessDescriptorStack.rend(); it++) {
     if (it->count(inst) > 0) return it->find(inst)->second;
@@ -536,8 +829,8 @@ std::vector<MemAccessDescriptor> CacheLineReuseAnalysis::getOperand(Value * v) {
     return std::vector<MemAccessDescriptor>{MemAccessDescriptor(intval->getValue().getSExtValue())};
   } else if (Instruction * inst = dyn_cast<Instruction>(v)) {
     return findInStack(inst);
-  } else if (isa<Argument>(v)) {
-    return std::vector<MemAccessDescriptor>{MemAccessDescriptor(10000)};
+  } else if (Argument * argument = dyn_cast<Argument>(v)) {
+    return std::vector<MemAccessDescriptor>{MemAccessDescriptor((int)getArgumentValue(argument))};
   } else if (isa<UndefValue>(v)) {
     return std::vector<MemAccessDescriptor>();
   } else {
@@ -546,5 +839,277 @@ std::vector<MemAccessDescriptor> CacheLineReuseAnalysis::getOperand(Value * v) {
   }
 }
 
+// Affine accesses.
+
+bool CacheLineReuseAnalysis::LineRun::contains(long long line) const {
+  return line >= first && line <= last && (line - first) % stride == 0;
+}
+
+bool CacheLineReuseAnalysis::LineRun::intersects(const LineRun &other) const {
+  long long lo = std::max(first, other.first);
+  long long hi = std::min(last, other.last);
+  if (lo > hi) {
+    return false;
+  } else if (stride == 1 && other.stride == 1) {
+    return true;
+  }
+  // walk the sparser run, at most a warp of lines
+  const LineRun &sparse = stride >= other.stride ? *this : other;
+  const LineRun &dense = stride >= other.stride ? other : *this;
+  for (long long line = sparse.first + (lo - sparse.first + sparse.stride - 1) / sparse.stride * sparse.stride; line <= hi; line += sparse.stride) {
+    if (dense.contains(line)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Values that are the same for every thread of the tile, as the simulation
+// sees them.
+bool CacheLineReuseAnalysis::getUniformValue(Value * v, long long &value) const {
+  if (ConstantInt * intval = dyn_cast<ConstantInt>(v)) {
+    value = intval->getValue().getSExtValue();
+    return true;
+  } else if (Argument * argument = dyn_cast<Argument>(v)) {
+    value = getArgumentValue(argument);
+    return true;
+  }
+  Instruction * inst = dyn_cast<Instruction>(v);
+  if (inst != NULL && (ndr->isGlobalSize(inst) || ndr->isLocalSize(inst) || ndr->isGroupId(inst) || ndr->isGroupsNum(inst))) {
+    value = getNDRangeValue(inst);
+    return true;
+  }
+  return false;
+}
+
+// Adds factor * scev to the access. Only sums and constant multiples of the
+// ids, of affine recurrences and of uniform values are accepted.
+bool CacheLineReuseAnalysis::addAffineTerms(const SCEV* scev, long long factor, AffineAccess &access) const {
+  if (const SCEVConstant * constant = dyn_cast<SCEVConstant>(scev)) {
+    access.offset += factor * constant->getValue()->getSExtValue();
+    return true;
+  } else if (const SCEVCastExpr * castExpr = dyn_cast<SCEVCastExpr>(scev)) {
+    // casts are no-ops in the simulation too
+    return addAffineTerms(castExpr->getOperand(), factor, access);
+  } else if (const SCEVAddExpr * add = dyn_cast<SCEVAddExpr>(scev)) {
+    for (unsigned int i = 0; i < add->getNumOperands(); i++) {
+      if (!addAffineTerms(add->getOperand(i), factor, access)) {
+        return false;
+      }
+    }
+    return true;
+  } else if (const SCEVMulExpr * mul = dyn_cast<SCEVMulExpr>(scev)) {
+    // all the operands but one must be uniform
+    const SCEV * variable = NULL;
+    for (unsigned int i = 0; i < mul->getNumOperands(); i++) {
+      AffineAccess operand;
+      if (addAffineTerms(mul->getOperand(i), 1, operand) && operand.isUniform()) {
+        factor *= operand.offset;
+      } else if (variable == NULL) {
+        variable = mul->getOperand(i);
+      } else {
+        return false;
+      }
+    }
+    if (variable == NULL) {
+      access.offset += factor;
+      return true;
+    }
+    return addAffineTerms(variable, factor, access);
+  } else if (const SCEVAddRecExpr * addRec = dyn_cast<SCEVAddRecExpr>(scev)) {
+    AffineAccess step;
+    if (!addRec->isAffine() || !addAffineTerms(addRec->getStepRecurrence(*scalarEvolution), 1, step) || !step.isUniform()) {
+      return false;
+    }
+    access.loopSteps[addRec->getLoop()] += factor * step.offset;
+    return addAffineTerms(addRec->getStart(), factor, access);
+  } else if (const SCEVUnknown * unknown = dyn_cast<SCEVUnknown>(scev)) {
+    Instruction * inst = dyn_cast<Instruction>(unknown->getValue());
+    if (inst != NULL && (ndr->isLocal(inst) || ndr->isGlobal(inst))) {
+      // the tile is the first work-group: global and local ids are the same
+      access.coefficients[ndr->getDirection(inst)] += factor;
+      return true;
+    }
+    long long value;
+    if (!getUniformValue(unknown->getValue(), value)) {
+      return false;
+    }
+    access.offset += factor * value;
+    return true;
+  }
+  return false;
+}
+
+// The index of the access in closed form, with the lines it touches in the
+// first iteration and in the second iteration of each enclosing loop. Fails,
+// leaving the access to the simulation, if any of them cannot be derived.
+bool CacheLineReuseAnalysis::getAffineAccess(Instruction* memop, AffineAccess &access) const {
+  int alignment = getAlignment(memop);
+  Value * ptr = memop->getOperand(memop->getOpcode() == Instruction::Load ? 0 : 1);
+  while (BitCastInst * bitCast = dyn_cast<BitCastInst>(ptr)) {
+    ptr = bitCast->getOperand(0);
+  }
+  // the simulation reads the index from the first operand only
+  GetElementPtrInst * gep = dyn_cast<GetElementPtrInst>(ptr);
+  if (alignment <= 0 || gep == NULL || gep->getNumOperands() != 2 || !scalarEvolution->isSCEVable(gep->getOperand(1)->getType())) {
+    return false;
+  }
+  if (!addAffineTerms(scalarEvolution->getSCEV(gep->getOperand(1)), 1, access)) {
+    return false;
+  }
+
+  access.footprints.push_back(std::vector<LineRun>());
+  if (!getFootprint(access, 0, alignment, access.footprints.back())) {
+    return false;
+  }
+  for (auto const &loopStep : access.loopSteps) {
+    if (loopStep.second == 0) {
+      continue;
+    }
+    access.footprints.push_back(std::vector<LineRun>());
+    if (!getFootprint(access, loopStep.second, alignment, access.footprints.back())) {
+      return false;
+    }
+  }
+#ifdef DEBUG_PRINT
+  errs() << "Affine access " << *memop << ": " << access.offset << " + " << access.coefficients[0] << "x + "
+         << access.coefficients[1] << "y + " << access.coefficients[2] << "z, " << access.loopSteps.size() << " loops\n";
+#endif
+  return true;
+}
+
+// The lines every warp of the tile touches, with the index shifted by shift
+// elements. A warp touches a contiguous range of lines if its threads are at
+// most a line apart, or every n-th line if they are n lines apart. Other
+// strides and negative addresses are left to the simulation.
+bool CacheLineReuseAnalysis::getFootprint(const AffineAccess &access, long long shift, int alignment, std::vector<LineRun> &footprint) const {
+  const long long lineSize = CacheLineSize;
+  const int warpSize = WarpSize;
+  int tile[3];
+  for (int d = 0; d < 3; d++) {
+    tile[d] = access.coefficients[d] != 0 ? getTileSize(d) : 1;
+  }
+  long long strideX = std::abs(access.coefficients[0] * alignment);
+  if (lineSize <= 0 || warpSize <= 0 || (strideX > lineSize && strideX % lineSize != 0)) {
+    return false;
+  }
+  for (int k = 0; k < tile[2]; k++) {
+    for (int j = 0; j < tile[1]; j++) {
+      for (int i = 0; i < tile[0]; i += warpSize) {
+        int n = std::min(warpSize, tile[0] - i);
+        long long first = access.offset + shift + access.coefficients[0] * i + access.coefficients[1] * j + access.coefficients[2] * k;
+        long long last = first + access.coefficients[0] * (n - 1);
+        long long lo = std::min(first, last) * alignment;
+        long long hi = std::max(first, last) * alignment;
+        if (lo < 0) {
+          return false;
+        }
+        LineRun run = {lo / lineSize, hi / lineSize, strideX > lineSize ? strideX / lineSize : 1};
+        footprint.push_back(run);
+      }
+    }
+  }
+  return true;
+}
+
+// Whether an earlier access to the symbol, simulated or not, touched one of
+// the lines.
+bool CacheLineReuseAnalysis::isAccessedBefore(StringRef symbolName, const std::vector<LineRun> &footprint) {
+  const long long lineSize = CacheLineSize;
+  const std::set<int> &lines = accessedCacheLines[symbolName];
+  const std::vector<LineRun> &runs = accessedLineRuns[symbolName];
+  for (const LineRun &run : footprint) {
+    for (const LineRun &previous : runs) {
+      if (run.intersects(previous)) {
+        return true;
+      }
+    }
+    // the simulated accesses are stored as line addresses
+    for (auto line = lines.lower_bound(run.first * lineSize); line != lines.end() && *line <= run.last * lineSize; line++) {
+      if (run.contains(*line / lineSize)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool CacheLineReuseAnalysis::isInAffineFootprints(StringRef symbolName, int cacheLine) {
+  const long long lineSize = CacheLineSize;
+  if (cacheLine < 0) {
+    return false;
+  }
+  for (const LineRun &run : accessedLineRuns[symbolName]) {
+    if (run.contains(cacheLine / lineSize)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The closed form counterpart of the simulation of a memory access. The
+// footprints already cover two iterations of the enclosing loops, so the
+// access is analysed once however often the simulation reaches it.
+void CacheLineReuseAnalysis::simulateAffineAccess(Instruction* inst, const AffineAccess &access) {
+  if (!simulatedAffineAccesses.insert(inst).second) {
+    return;
+  }
+  StringRef accessedSymbolName = getAccessedSymbolName(getAccessedSymbolPtr(inst));
+  bool isStore = inst->getOpcode() == Instruction::Store;
+  // consecutive threads access consecutive elements, and no group of a line's
+  // worth of threads straddles two warps
+  int elementsPerLine = CacheLineSize / getAlignment(inst);
+  bool fullCoalescing = access.coefficients[0] == 1 && elementsPerLine > 0 &&
+                        (access.footprints.front().size() == 1 || getTileSize(0) % elementsPerLine == 0);
+
+  for (const std::vector<LineRun> &footprint : access.footprints) {
+    bool isShared = false;
+    bool severalLines = false;
+    for (size_t a = 0; a < footprint.size(); a++) {
+      severalLines = severalLines || footprint[a].first != footprint[a].last || footprint[a].first != footprint.front().first;
+      for (size_t b = a + 1; b < footprint.size() && !isShared; b++) {
+        isShared = footprint[a].intersects(footprint[b]);
+      }
+    }
+    if (!isShared && severalLines) {
+      isShared = isAccessedBefore(accessedSymbolName, footprint);
+    }
+    std::vector<LineRun> &runs = accessedLineRuns[accessedSymbolName];
+    runs.insert(runs.end(), footprint.begin(), footprint.end());
+
+    if (isStore && fullCoalescing) {
+      errs() << "Ignoring mem accesses of fully coalesced store instruction";
+      continue;
+    }
+    for (const LineRun &run : footprint) {
+      for (long long line = run.first; line <= run.last; line += run.stride) {
+        touchLine(accessedSymbolName, line);
+      }
+    }
+    // the first iteration is replayed for every iteration of the innermost
+    // loop, shifted by its step
+    if (isTracing() && &footprint == &access.footprints.front()) {
+      std::vector<std::vector<long long>> warpAddresses;
+      for (const LineRun &run : footprint) {
+        warpAddresses.push_back(std::vector<long long>());
+        for (long long line = run.first; line <= run.last; line += run.stride) {
+          warpAddresses.back().push_back(line * CacheLineSize);
+        }
+      }
+      int warps[3];
+      for (int d = 0; d < 3; d++) {
+        warps[d] = access.coefficients[d] == 0 ? 1 : d == 0 ? (getTileSize(0) + (int)WarpSize - 1) / (int)WarpSize : getTileSize(d);
+      }
+      Loop * loop = loopInfo->getLoopFor(inst->getParent());
+      auto loopStep = access.loopSteps.find(loop);
+      long long step = loopStep == access.loopSteps.end() ? 0 : loopStep->second * getAlignment(inst);
+      recordWarpAccesses(accessedSymbolName, warpAddresses, warps, loop, step);
+    }
+    if (isShared && severalLines && reuseDiagnosis.empty()) {
+      reuseDiagnosis = "Cache line re-use in access to [" + std::string(accessedSymbolName) + "]";
+    }
+  }
+}
+
 char CacheLineReuseAnalysis::ID = 0;
 static RegisterPass<CacheLineReuseAnalysis> X("clr", "Cache Line Re-Use Analysis Pass");
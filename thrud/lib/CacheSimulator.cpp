@@ -0,0 +1,245 @@
+#include "thrud/CacheSimulator.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+// The arrays, and the work-groups beyond the tile, are placed this far apart
+// so that they never share a line.
+const int SYMBOL_SHIFT = 52;
+const int COPY_SHIFT = 36;
+
+//------------------------------------------------------------------------------
+CacheGeometry::CacheGeometry(int size, int ways, int lineSize)
+    : lineSize(std::max(lineSize, 1)), ways(std::max(ways, 1)) {
+  sets = std::max(size / (this->ways * this->lineSize), 1);
+}
+
+//------------------------------------------------------------------------------
+CacheLevel::CacheLevel(const CacheGeometry &geometry)
+    : geometry(geometry), sets(geometry.sets) {}
+
+bool CacheLevel::access(long long address) {
+  long long line = address / geometry.lineSize;
+  long long index = line % geometry.sets;
+  std::vector<long long> &set = sets[index < 0 ? index + geometry.sets : index];
+  std::vector<long long>::iterator iter = std::find(set.begin(), set.end(), line);
+  bool hit = iter != set.end();
+  if (hit) {
+    set.erase(iter);
+  } else if ((int)set.size() == geometry.ways) {
+    set.pop_back();
+  }
+  set.insert(set.begin(), line);
+  return hit;
+}
+
+//------------------------------------------------------------------------------
+void MemoryTrace::clear() {
+  warps = 0;
+  symbols.clear();
+  accesses.clear();
+}
+
+int MemoryTrace::getSymbol(const std::string &name) {
+  std::vector<std::string>::iterator iter =
+      std::find(symbols.begin(), symbols.end(), name);
+  if (iter != symbols.end())
+    return iter - symbols.begin();
+  symbols.push_back(name);
+  return symbols.size() - 1;
+}
+
+void MemoryTrace::add(const WarpAccess &access) {
+  accesses.push_back(access);
+  warps = std::max(warps, access.warp + 1);
+}
+
+//------------------------------------------------------------------------------
+std::vector<std::vector<std::vector<long long>>>
+MemoryTrace::getWarpStreams(long long maxTrips) const {
+  std::vector<std::vector<const WarpAccess *>> warpAccesses(warps);
+  for (const WarpAccess &access : accesses)
+    warpAccesses[access.warp].push_back(&access);
+
+  std::vector<std::vector<std::vector<long long>>> streams(warps);
+  for (int warp = 0; warp < warps; ++warp) {
+    const std::vector<const WarpAccess *> &list = warpAccesses[warp];
+    for (size_t first = 0; first < list.size();) {
+      // The accesses of the same loop run one iteration at a time.
+      size_t last = first + 1;
+      while (list[first]->loop >= 0 && last < list.size() &&
+             list[last]->loop == list[first]->loop)
+        ++last;
+      long long trips = 1;
+      for (size_t index = first; index < last; ++index)
+        trips = std::max(trips, list[index]->trips);
+      trips = std::min(trips, std::max(maxTrips, 1LL));
+
+      for (long long trip = 0; trip < trips; ++trip) {
+        for (size_t index = first; index < last; ++index) {
+          const WarpAccess &access = *list[index];
+          if (trip >= access.trips)
+            continue;
+          long long base = ((long long)access.symbol << SYMBOL_SHIFT) +
+                           trip * access.step;
+          std::vector<long long> addresses;
+          for (long long address : access.addresses)
+            addresses.push_back(base + address);
+          streams[warp].push_back(addresses);
+        }
+      }
+      first = last;
+    }
+  }
+  return streams;
+}
+
+bool MemoryTrace::hasWholeLoops() const {
+  std::vector<int> lastLoops(warps, -1);
+  std::vector<std::vector<bool>> leftLoops(warps);
+  for (const WarpAccess &access : accesses) {
+    int &lastLoop = lastLoops[access.warp];
+    std::vector<bool> &left = leftLoops[access.warp];
+    if (access.loop == lastLoop)
+      continue;
+    if (access.loop >= 0 && access.loop < (int)left.size() && left[access.loop])
+      return false;
+    if (lastLoop >= 0) {
+      left.resize(std::max((int)left.size(), lastLoop + 1), false);
+      left[lastLoop] = true;
+    }
+    lastLoop = access.loop;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Format: "warps <n>", then "symbol <name>" in symbol order, then one line
+// per access: "access <warp> <symbol> <loop> <trips> <step> <addresses>".
+bool MemoryTrace::write(const std::string &path) const {
+  std::ofstream stream(path.c_str());
+  if (!stream)
+    return false;
+  stream << "warps " << warps << "\n";
+  for (const std::string &symbol : symbols)
+    stream << "symbol " << symbol << "\n";
+  for (const WarpAccess &access : accesses) {
+    stream << "access " << access.warp << " " << access.symbol << " "
+           << access.loop << " " << access.trips << " " << access.step;
+    for (long long address : access.addresses)
+      stream << " " << address;
+    stream << "\n";
+  }
+  return (bool)stream;
+}
+
+bool MemoryTrace::read(const std::string &path) {
+  clear();
+  std::ifstream stream(path.c_str());
+  if (!stream)
+    return false;
+  int declaredWarps = 0;
+  std::string line;
+  while (std::getline(stream, line)) {
+    std::istringstream fields(line);
+    std::string field;
+    if (!(fields >> field))
+      continue;
+    if (field == "warps") {
+      fields >> declaredWarps;
+    } else if (field == "symbol") {
+      std::string name;
+      fields >> name;
+      symbols.push_back(name);
+    } else if (field == "access") {
+      WarpAccess access;
+      if (!(fields >> access.warp >> access.symbol >> access.loop >>
+            access.trips >> access.step) ||
+          access.warp < 0 || access.symbol < 0)
+        return false;
+      long long address;
+      while (fields >> address)
+        access.addresses.push_back(address);
+      add(access);
+    }
+  }
+  warps = std::max(warps, declaredWarps);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+CacheSimulationResult simulateCoarsening(const MemoryTrace &trace,
+                                         const CacheSimulationConfig &config,
+                                         unsigned int cf) {
+  CacheSimulationResult result;
+  result.coarseningFactor = std::max(cf, 1u);
+  std::vector<std::vector<std::vector<long long>>> streams =
+      trace.getWarpStreams(config.maxTrips);
+  long long tileWarps = streams.size();
+  if (tileWarps == 0)
+    return result;
+
+  // The L2 is shared evenly by the compute units.
+  CacheGeometry l2Share = config.l2;
+  l2Share.sets = std::max(l2Share.sets / std::max(config.computeUnits, 1), 1);
+  CacheLevel l1(config.l1);
+  CacheLevel l2(l2Share);
+
+  long long residentWarps =
+      std::max(config.residentThreads / std::max(config.warpSize, 1), 1);
+  long long replicas = result.coarseningFactor;
+  result.warps = residentWarps * replicas;
+
+  // Position of every coarsened warp: the instruction and the replica that
+  // runs next.
+  std::vector<size_t> instructions(residentWarps, 0);
+  std::vector<long long> nextReplicas(residentWarps, 0);
+  size_t longestStream = 0;
+  for (const std::vector<std::vector<long long>> &stream : streams)
+    longestStream = std::max(longestStream, stream.size());
+
+  std::vector<long long> lines;
+  bool running = true;
+  while (running) {
+    running = false;
+    for (long long warp = 0; warp < residentWarps; ++warp) {
+      // The next replica that still has the current instruction.
+      const std::vector<long long> *addresses = NULL;
+      long long copy = 0;
+      while (addresses == NULL && instructions[warp] < longestStream) {
+        long long original = warp * replicas + nextReplicas[warp];
+        const std::vector<std::vector<long long>> &stream =
+            streams[original % tileWarps];
+        if (instructions[warp] < stream.size()) {
+          addresses = &stream[instructions[warp]];
+          copy = original / tileWarps;
+        }
+        if (++nextReplicas[warp] == replicas) {
+          nextReplicas[warp] = 0;
+          ++instructions[warp];
+        }
+      }
+      if (addresses == NULL)
+        continue;
+      running = true;
+
+      lines.clear();
+      for (long long address : *addresses)
+        lines.push_back(((copy << COPY_SHIFT) + address) / config.l1.lineSize);
+      std::sort(lines.begin(), lines.end());
+      lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+      for (long long line : lines) {
+        long long address = line * config.l1.lineSize;
+        ++result.requests;
+        if (l1.access(address))
+          ++result.l1Hits;
+        else if (l2.access(address))
+          ++result.l2Hits;
+        else
+          ++result.dramTransactions;
+      }
+    }
+  }
+  return result;
+}
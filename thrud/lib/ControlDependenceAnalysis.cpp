@@ -22,15 +22,8 @@ void ControlDependenceAnalysis::getAnalysisUsage(AnalysisUsage &au) const {
 bool ControlDependenceAnalysis::runOnFunction(Function &function) {
   pdt = &getAnalysis<PostDominatorTree>();
 
-  forwardGraph.clear();
-  backwardGraph.clear();
-  s.clear();
-  ls.clear();
-
-  findS(function);
-  findLs();
-  buildGraph();
-  fillGraph(function);
+  numberBlocks(function);
+  buildGraph(function);
   transitiveClosure();
   buildBackwardGraph();
 
@@ -38,125 +31,96 @@ bool ControlDependenceAnalysis::runOnFunction(Function &function) {
 }
 
 // -----------------------------------------------------------------------------
-void ControlDependenceAnalysis::findS(Function &function) {
+void ControlDependenceAnalysis::numberBlocks(Function &function) {
+  blocks.clear();
+  blockIndices.clear();
   for (Function::iterator iter = function.begin(), iterEnd = function.end();
        iter != iterEnd; ++iter) {
     BasicBlock *block = iter;
-    for (succ_iterator succIter = succ_begin(block), succEnd = succ_end(block);
-         succIter != succEnd; ++succIter) {
-      BasicBlock *child = *succIter;
-      if (!pdt->dominates(child, block)) {
-        s.push_back(std::pair<BasicBlock *, BasicBlock *>(block, child));
-      }
-    }
+    blockIndices[block] = blocks.size();
+    blocks.push_back(block);
   }
 }
 
 // -----------------------------------------------------------------------------
-void ControlDependenceAnalysis::findLs() {
-  for (auto edge : s) {
-    BasicBlock *block =
-        pdt->findNearestCommonDominator(edge.first, edge.second);
-    assert(block != nullptr && "Ill-formatted function");
-    ls.push_back(block);
-  }
-  assert(ls.size() == s.size() && "Mismatching S and Ls");
-}
+// For every CFG edge a -> b where b does not post-dominate a (the set S),
+// the blocks on the post-dominator tree path from b up to, and excluding,
+// the immediate post-dominator of a are control dependent on a: a is in
+// their post-dominance frontier. L, the nearest common post-dominator of a
+// and b, is either a (loops) or its parent, so the walk always stops at the
+// parent of a.
+void ControlDependenceAnalysis::buildGraph(Function &function) {
+  unsigned int blockNumber = blocks.size();
+  forwardGraph.assign(blockNumber, BitVector(blockNumber));
 
-// -----------------------------------------------------------------------------
-void ControlDependenceAnalysis::buildGraph() {
-  unsigned int edgeNumber = s.size();
-  for (unsigned int index = 0; index < edgeNumber; ++index) {
-    std::pair<BasicBlock *, BasicBlock *> edge = s[index];
-    BasicBlock *l = ls[index];
-
-    BasicBlock *a = edge.first;
-    BasicBlock *b = edge.second;
-
-    BlockVector children;
-    BasicBlock *aParent = pdt->getNode(a)->getIDom()->getBlock();
-
-    // Case 1.
-    if (l == aParent) {
-      BasicBlock *current = b;
-      while (current != l) {
-        children.push_back(current);
-        current = pdt->getNode(current)->getIDom()->getBlock();
-      }
-    }
+  for (Function::iterator iter = function.begin(), iterEnd = function.end();
+       iter != iterEnd; ++iter) {
+    BasicBlock *a = iter;
+    DomTreeNode *aNode = pdt->getNode(a);
+    if (aNode == nullptr)
+      continue;
+    DomTreeNode *aParentNode = aNode->getIDom();
+    BasicBlock *aParent = aParentNode ? aParentNode->getBlock() : nullptr;
+    BitVector &children = forwardGraph[blockIndices[a]];
+
+    for (succ_iterator succIter = succ_begin(a), succEnd = succ_end(a);
+         succIter != succEnd; ++succIter) {
+      BasicBlock *b = *succIter;
+      if (pdt->dominates(b, a))
+        continue;
 
-    // Case 2.
-    if (l == a) {
-      BasicBlock *current = b;
-      while (current != aParent) {
-        children.push_back(current);
-        current = pdt->getNode(current)->getIDom()->getBlock();
+      for (BasicBlock *current = b; current != nullptr && current != aParent;) {
+        children.set(blockIndices[current]);
+        DomTreeNode *parentNode = pdt->getNode(current)->getIDom();
+        current = parentNode ? parentNode->getBlock() : nullptr;
       }
     }
-    forwardGraph.insert(std::pair<BasicBlock *, BlockVector>(a, children));
-  }
-}
-
-// -----------------------------------------------------------------------------
-void ControlDependenceAnalysis::fillGraph(Function &function) {
-  for (Function::iterator iter = function.begin(), iterEnd = function.end();
-       iter != iterEnd; ++iter) {
-    BasicBlock *block = iter;
-    forwardGraph[block];
   }
 }
 
 // -----------------------------------------------------------------------------
+// Warshall's algorithm on the rows: whole words are ORed at a time.
 void ControlDependenceAnalysis::transitiveClosure() {
-  for (auto graphIter : forwardGraph) {
-    BlockVector &seeds = graphIter.second;
-    // This implements a traversal of the tree starting from block.
-    BlockSet worklist(seeds.begin(), seeds.end());
-    BlockVector result;
-    while (!worklist.empty()) {
-      BlockSet::iterator iter = worklist.begin();
-      BasicBlock *current = *iter;
-      worklist.erase(iter);
-      result.push_back(current);
-      BlockVector &children = forwardGraph[current];
-
-      for (auto block : children) {
-        if (!isPresent(block, result))
-          worklist.insert(block);
-      }
+  unsigned int blockNumber = blocks.size();
+  for (unsigned int middle = 0; middle < blockNumber; ++middle) {
+    const BitVector &middleRow = forwardGraph[middle];
+    for (unsigned int index = 0; index < blockNumber; ++index) {
+      if (index != middle && forwardGraph[index].test(middle))
+        forwardGraph[index] |= middleRow;
     }
-
-    // Update block vector.
-    graphIter.second.assign(result.begin(), result.end());
   }
 }
 
 // -----------------------------------------------------------------------------
 void ControlDependenceAnalysis::buildBackwardGraph() {
-  for (auto graphIter : forwardGraph) {
-    BasicBlock *block = graphIter.first;
-    backwardGraph.insert(
-        std::pair<BasicBlock *, BlockVector>(block, BlockVector()));
-    BlockVector &result = backwardGraph[block];
-
-    for (auto graphIter2 : forwardGraph) {
-      if (graphIter.first == graphIter2.first)
-        continue;
-      BlockVector &children = graphIter2.second;
-
-      if (isPresent(block, children)) {
-        result.push_back(graphIter2.first);
-      }
+  unsigned int blockNumber = blocks.size();
+  backwardGraph.assign(blockNumber, BitVector(blockNumber));
+  for (unsigned int index = 0; index < blockNumber; ++index) {
+    const BitVector &children = forwardGraph[index];
+    for (int child = children.find_first(); child != -1;
+         child = children.find_next(child)) {
+      if (static_cast<unsigned int>(child) != index)
+        backwardGraph[child].set(index);
     }
   }
 }
 
+// -----------------------------------------------------------------------------
+// Blocks created after the analysis ran have no number.
+int ControlDependenceAnalysis::getIndex(BasicBlock *block) const {
+  DenseMap<BasicBlock *, unsigned int>::const_iterator iter =
+      blockIndices.find(block);
+  return iter == blockIndices.end() ? -1 : iter->second;
+}
+
 // Public functions.
 // -----------------------------------------------------------------------------
 bool ControlDependenceAnalysis::dependsOn(BasicBlock *first,
                                           BasicBlock *second) {
-  BlockVector &blocks = backwardGraph[first];
-  return isPresent(second, blocks);
+  int firstIndex = getIndex(first);
+  int secondIndex = getIndex(second);
+  return firstIndex != -1 && secondIndex != -1 &&
+         backwardGraph[firstIndex].test(secondIndex);
 }
 
 // -----------------------------------------------------------------------------
@@ -191,32 +155,31 @@ bool ControlDependenceAnalysis::dependsOnAny(Instruction *inst,
 // -----------------------------------------------------------------------------
 bool ControlDependenceAnalysis::controls(BasicBlock *first,
                                          BasicBlock *second) {
-  BlockVector &blocks = forwardGraph[first];
-  return isPresent(second, blocks);
+  int firstIndex = getIndex(first);
+  int secondIndex = getIndex(second);
+  return firstIndex != -1 && secondIndex != -1 &&
+         forwardGraph[firstIndex].test(secondIndex);
 }
 
 // -----------------------------------------------------------------------------
-void ControlDependenceAnalysis::dump() {
-  errs() << "Forward:\n";
-  for (auto graphIter : forwardGraph) {
-    BasicBlock *block = graphIter.first;
-    errs() << block->getName() << ": ";
-    BlockVector &children = graphIter.second;
-    for (auto child : children) {
-      errs() << child->getName() << " ";
+void ControlDependenceAnalysis::dumpGraph(const std::vector<BitVector> &graph) {
+  for (unsigned int index = 0; index < graph.size(); ++index) {
+    errs() << blocks[index]->getName() << ": ";
+    const BitVector &children = graph[index];
+    for (int child = children.find_first(); child != -1;
+         child = children.find_next(child)) {
+      errs() << blocks[child]->getName() << " ";
     }
     errs() << "\n";
   }
+}
+
+// -----------------------------------------------------------------------------
+void ControlDependenceAnalysis::dump() {
+  errs() << "Forward:\n";
+  dumpGraph(forwardGraph);
   errs() << "Backward:\n";
-  for (auto graphIter : backwardGraph) {
-    BasicBlock *block = graphIter.first;
-    errs() << block->getName() << ": ";
-    BlockVector &children = graphIter.second;
-    for (auto child : children) {
-      errs() << child->getName() << " ";
-    }
-    errs() << "\n";
-  }
+  dumpGraph(backwardGraph);
 }
 
 char ControlDependenceAnalysis::ID = 0;
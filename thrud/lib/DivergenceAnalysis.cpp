@@ -25,12 +25,11 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <utility>
 
 using namespace llvm;
 
-extern cl::opt<unsigned int> CoarseningDirectionCL;
-
 // Support functions.
 // -----------------------------------------------------------------------------
 void findUsesOf(Instruction *inst, InstSet &result);
@@ -41,6 +40,7 @@ bool isOutermost(DivergentRegion *region, RegionVector &regions);
 // -----------------------------------------------------------------------------
 void DivergenceAnalysis::init() {
   divInsts.clear();
+  divInstsSet.clear();
   outermostDivInsts.clear();
   divBranches.clear();
   regions.clear();
@@ -55,13 +55,19 @@ InstVector DivergenceAnalysis::getTids() {
 
 //------------------------------------------------------------------------------
 void DivergenceAnalysis::performAnalysis() {
-  InstVector seeds = getTids();
-  InstSet worklist(seeds.begin(), seeds.end());
+  // Instructions enter divInstsSet when they are queued, so each one is
+  // visited once.
+  InstVector worklist;
+  for (auto seed : getTids()) {
+    if (divInstsSet.count(seed) == 0) {
+      divInstsSet.insert(seed);
+      worklist.push_back(seed);
+    }
+  }
 
   while (!worklist.empty()) {
-    auto iter = worklist.begin();
-    Instruction *inst = *iter;
-    worklist.erase(iter);
+    Instruction *inst = worklist.back();
+    worklist.pop_back();
     divInsts.push_back(inst);
 
     InstSet users;
@@ -78,8 +84,10 @@ void DivergenceAnalysis::performAnalysis() {
     // Add users of the current instruction to the work list.
     for (InstSet::iterator iter = users.begin(), iterEnd = users.end();
          iter != iterEnd; ++iter) {
-      if (!isPresent(*iter, divInsts))
-        worklist.insert(*iter);
+      if (divInstsSet.count(*iter) == 0) {
+        divInstsSet.insert(*iter);
+        worklist.push_back(*iter);
+      }
     }
   }
 }
@@ -248,7 +256,22 @@ RegionVector DivergenceAnalysis::getDivRegions(DivergentRegion *region) {
 
 //------------------------------------------------------------------------------
 bool DivergenceAnalysis::isDivergent(Instruction *inst) {
-  return isPresent(inst, divInsts);
+  return divInstsSet.count(inst) != 0;
+}
+
+//------------------------------------------------------------------------------
+void DivergenceAnalysis::addDivInst(Instruction *inst) {
+  if (divInstsSet.count(inst) == 0) {
+    divInstsSet.insert(inst);
+    divInsts.push_back(inst);
+  }
+}
+
+//------------------------------------------------------------------------------
+void DivergenceAnalysis::removeDivInst(Instruction *inst) {
+  if (divInstsSet.erase(inst)) {
+    divInsts.erase(std::find(divInsts.begin(), divInsts.end(), inst));
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -353,6 +376,7 @@ bool SingleDimDivAnalysis::runOnFunction(Function &functionRef) {
     return false;
 
   init();
+  direction = getCoarseningDirection(function);
   pdt = &getAnalysis<PostDominatorTree>();
   dt = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
   loopInfo = &getAnalysis<LoopInfo>();
@@ -367,7 +391,7 @@ bool SingleDimDivAnalysis::runOnFunction(Function &functionRef) {
 }
 
 InstVector SingleDimDivAnalysis::getTids() {
-  return ndr->getDivergentIds(CoarseningDirectionCL);
+  return ndr->getDivergentIds(direction);
 }
 
 char SingleDimDivAnalysis::ID = 0;
@@ -0,0 +1,97 @@
+#include "thrud/LaunchContext.h"
+
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace llvm;
+
+// Command line options.
+cl::opt<std::string> LaunchContextCL(
+    "launch-context", cl::init(""), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("File with the NDRange and the integer arguments the kernels "
+             "are launched with"));
+
+//------------------------------------------------------------------------------
+LaunchContext::LaunchContext() : workDim(0) {
+  std::fill(globalSize, globalSize + 3, 1);
+  std::fill(localSize, localSize + 3, 1);
+}
+
+//------------------------------------------------------------------------------
+bool LaunchContext::read(const std::string &kernelName) {
+  if (LaunchContextCL.empty())
+    return false;
+  std::ifstream file(LaunchContextCL.c_str());
+  if (!file)
+    return false;
+
+  bool found = false;
+  bool isKernel = false;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream stream(line);
+    std::string field;
+    if (!(stream >> field))
+      continue;
+
+    if (field == "kernel") {
+      std::string name;
+      stream >> name;
+      isKernel = name == kernelName;
+      if (isKernel) {
+        // A later entry of the same kernel replaces the earlier one.
+        *this = LaunchContext();
+        found = true;
+      }
+    } else if (!isKernel) {
+      continue;
+    } else if (field == "work_dim") {
+      stream >> workDim;
+      workDim = std::min(std::max(workDim, 0), 3);
+    } else if (field == "global_size" || field == "local_size") {
+      int *sizes = field == "global_size" ? globalSize : localSize;
+      for (int direction = 0; direction < 3; ++direction) {
+        int size = 1;
+        stream >> size;
+        sizes[direction] = std::max(size, 1);
+      }
+    } else if (field == "arg") {
+      unsigned int index;
+      long long value;
+      if (stream >> index >> value)
+        arguments[index] = value;
+    }
+  }
+  return found;
+}
+
+//------------------------------------------------------------------------------
+bool LaunchContext::hasSizes() const { return workDim > 0; }
+
+int LaunchContext::getWorkDim() const { return workDim; }
+
+int LaunchContext::getLocalSize(int direction) const {
+  return direction < workDim ? localSize[direction] : 1;
+}
+
+int LaunchContext::getGlobalSize(int direction) const {
+  return direction < workDim ? globalSize[direction] : 1;
+}
+
+int LaunchContext::getNumberOfGroups(int direction) const {
+  int local = getLocalSize(direction);
+  return std::max((getGlobalSize(direction) + local - 1) / local, 1);
+}
+
+//------------------------------------------------------------------------------
+bool LaunchContext::getArgument(unsigned int index, long long &value) const {
+  std::map<unsigned int, long long>::const_iterator iter =
+      arguments.find(index);
+  if (iter == arguments.end())
+    return false;
+  value = iter->second;
+  return true;
+}
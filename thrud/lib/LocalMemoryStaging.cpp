@@ -0,0 +1,573 @@
+#include "thrud/LocalMemoryStaging.h"
+
+#include "thrud/DivergenceAnalysis.h"
+#include "thrud/NDRange.h"
+#include "thrud/Utils.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+extern cl::opt<std::string> KernelNameCL;
+
+// Command line options.
+cl::list<unsigned int> StagingGroupSizeCL(
+    "staging-group-size", cl::CommaSeparated, cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Work-group size the local memory tiles are sized for, as x,y,z. "
+             "Missing sizes are 1. Defaults to 16,16,1"));
+cl::opt<unsigned int> StagingMaxBytesCL(
+    "staging-max-bytes", cl::init(16384), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Upper bound on the local memory used by the staging tiles of "
+             "a kernel"));
+
+static const char *STAGED_METADATA = "thrud.staged";
+
+//------------------------------------------------------------------------------
+static void collectInnermostLoops(Loop *loop, std::vector<Loop *> &loops) {
+  if (loop->empty()) {
+    loops.push_back(loop);
+    return;
+  }
+  for (Loop::iterator iter = loop->begin(), end = loop->end(); iter != end;
+       ++iter)
+    collectInnermostLoops(*iter, loops);
+}
+
+//------------------------------------------------------------------------------
+LocalMemoryStaging::LocalMemoryStaging() : FunctionPass(ID) {}
+
+//------------------------------------------------------------------------------
+void LocalMemoryStaging::getAnalysisUsage(AnalysisUsage &au) const {
+  au.addRequired<LoopInfo>();
+  au.addRequired<NDRange>();
+  au.addRequired<MultiDimDivAnalysis>();
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::isStaged(const Instruction *inst) {
+  return inst->getMetadata(STAGED_METADATA) != nullptr;
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::runOnFunction(Function &F) {
+  function = &F;
+  if (!isKernel((const Function *)function))
+    return false;
+
+  // Apply the pass to the selected kernel only.
+  std::string functionName = function->getName();
+  if (KernelNameCL != "" && functionName != KernelNameCL)
+    return false;
+
+  for (unsigned int direction = 0; direction < 3; ++direction) {
+    if (StagingGroupSizeCL.empty())
+      groupSize[direction] = direction < 2 ? 16 : 1;
+    else if (direction < StagingGroupSizeCL.size())
+      groupSize[direction] = StagingGroupSizeCL[direction];
+    else
+      groupSize[direction] = 1;
+  }
+  if (groupSize[0] == 0 || groupSize[1] == 0 || groupSize[2] == 0) {
+    errs() << "Invalid staging group size\n";
+    return false;
+  }
+
+  loopInfo = &getAnalysis<LoopInfo>();
+  ndr = &getAnalysis<NDRange>();
+  mdda = &getAnalysis<MultiDimDivAnalysis>();
+  stagedBytes = 0;
+  tileNumber = 0;
+
+  // Collect the loops before staging: staging adds blocks to them.
+  std::vector<Loop *> loops;
+  for (LoopInfo::iterator iter = loopInfo->begin(), end = loopInfo->end();
+       iter != end; ++iter)
+    collectInnermostLoops(*iter, loops);
+
+  bool isChanged = false;
+  for (auto loop : loops) {
+    StagedLoop stagedLoop;
+    if (!analyzeLoop(loop, stagedLoop))
+      continue;
+
+    // Analyzing a load can hoist its address computation: collect the
+    // loads first.
+    std::vector<LoadInst *> candidates;
+    for (auto block : loop->getBlocks()) {
+      if (block == loop->getHeader())
+        continue;
+      for (BasicBlock::iterator iter = block->begin(), end = block->end();
+           iter != end; ++iter)
+        if (LoadInst *load = dyn_cast<LoadInst>(iter))
+          candidates.push_back(load);
+    }
+
+    std::vector<StagedLoad> loads;
+    for (auto load : candidates) {
+      StagedLoad stagedLoad;
+      if (!analyzeLoad(stagedLoop, load, stagedLoad))
+        continue;
+      unsigned int bytes = getTileBytes(stagedLoad);
+      if (bytes == 0 || stagedBytes + bytes > StagingMaxBytesCL)
+        continue;
+      stagedBytes += bytes;
+      loads.push_back(stagedLoad);
+    }
+
+    if (!loads.empty()) {
+      stageLoop(stagedLoop, loads);
+      isChanged = true;
+    }
+  }
+
+  return isChanged;
+}
+
+//------------------------------------------------------------------------------
+// Only loops tested at the top, with step 1, run by the whole work-group are
+// staged: the barriers filling the tiles are then reached by every
+// work-item, and the iterations of a tile are known when it is filled.
+bool LocalMemoryStaging::analyzeLoop(Loop *loop, StagedLoop &stagedLoop) {
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *preheader = loop->getLoopPreheader();
+  BasicBlock *latch = loop->getLoopLatch();
+  if (preheader == nullptr || latch == nullptr ||
+      loop->getExitingBlock() != header)
+    return false;
+
+  BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+  if (branch == nullptr || !branch->isConditional())
+    return false;
+  ICmpInst *cmp = dyn_cast<ICmpInst>(branch->getCondition());
+  if (cmp == nullptr)
+    return false;
+
+  bool exitsOnTrue = !loop->contains(branch->getSuccessor(0));
+  BasicBlock *body = branch->getSuccessor(exitsOnTrue ? 1 : 0);
+  if (body == header || body->getSinglePredecessor() != header ||
+      isa<PHINode>(body->begin()))
+    return false;
+
+  // The loop runs while predicate(iv, upper).
+  CmpInst::Predicate predicate =
+      exitsOnTrue ? cmp->getInversePredicate() : cmp->getPredicate();
+  Value *left = cmp->getOperand(0);
+  Value *right = cmp->getOperand(1);
+  PHINode *iv = dyn_cast<PHINode>(left);
+  if (iv == nullptr || iv->getParent() != header) {
+    std::swap(left, right);
+    predicate = CmpInst::getSwappedPredicate(predicate);
+    iv = dyn_cast<PHINode>(left);
+  }
+  if (iv == nullptr || iv->getParent() != header ||
+      iv->getNumIncomingValues() != 2)
+    return false;
+  if (predicate != CmpInst::ICMP_ULT && predicate != CmpInst::ICMP_SLT)
+    return false;
+
+  BinaryOperator *next =
+      dyn_cast<BinaryOperator>(iv->getIncomingValueForBlock(latch));
+  if (next == nullptr || next->getOpcode() != Instruction::Add)
+    return false;
+  if (next->getOperand(0) != iv && next->getOperand(1) != iv)
+    return false;
+  Value *step = next->getOperand(next->getOperand(0) == iv ? 1 : 0);
+  ConstantInt *stepValue = dyn_cast<ConstantInt>(step);
+  if (stepValue == nullptr || !stepValue->isOne())
+    return false;
+
+  Value *lower = iv->getIncomingValueForBlock(preheader);
+  bool isHoisted = false;
+  if (!loop->makeLoopInvariant(right, isHoisted))
+    return false;
+  if (!isUniform(iv) || !isUniform(lower) || !isUniform(right) ||
+      !isReachedUniformly(loop))
+    return false;
+
+  stagedLoop.loop = loop;
+  stagedLoop.iv = iv;
+  stagedLoop.lower = lower;
+  stagedLoop.upper = right;
+  stagedLoop.isSigned = predicate == CmpInst::ICMP_SLT;
+  stagedLoop.body = body;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::isReachedUniformly(Loop *loop) {
+  for (Loop *current = loop; current != nullptr;
+       current = current->getParentLoop()) {
+    SmallVector<BasicBlock *, 4> exitingBlocks;
+    current->getExitingBlocks(exitingBlocks);
+    for (auto block : exitingBlocks) {
+      BranchInst *branch = dyn_cast<BranchInst>(block->getTerminator());
+      if (branch == nullptr ||
+          (branch->isConditional() && !isUniform(branch->getCondition())))
+        return false;
+    }
+  }
+
+  BasicBlock *header = loop->getHeader();
+  RegionVector &regions = mdda->getDivRegions();
+  for (auto region : regions) {
+    BlockVector &blocks = region->getBlocks();
+    if (std::find(blocks.begin(), blocks.end(), header) != blocks.end())
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::isUniform(Value *value) {
+  Instruction *inst = dyn_cast<Instruction>(value);
+  return inst == nullptr || !mdda->isDivergent(inst);
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::dependsOnDirection(Value *value, int direction,
+                                            std::set<Value *> &visited) {
+  Instruction *inst = dyn_cast<Instruction>(value);
+  if (inst == nullptr || !visited.insert(inst).second)
+    return false;
+  if (ndr->isLocal(inst, direction) || ndr->isGlobal(inst, direction))
+    return true;
+  // A phi can depend on the ids through control flow: only uniform ones are
+  // known not to.
+  if (isa<PHINode>(inst))
+    return !isUniform(inst);
+  for (unsigned int index = 0; index < inst->getNumOperands(); ++index)
+    if (dependsOnDirection(inst->getOperand(index), direction, visited))
+      return true;
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Whether the loop can write the array read through base: a tile would then
+// hold stale values.
+bool LocalMemoryStaging::writesTo(Loop *loop, Value *base) {
+  Value *object = GetUnderlyingObject(base);
+  Argument *argument = dyn_cast<Argument>(object);
+  bool isNoAlias = argument != nullptr && argument->hasNoAliasAttr();
+
+  for (auto block : loop->getBlocks()) {
+    for (BasicBlock::iterator iter = block->begin(), end = block->end();
+         iter != end; ++iter) {
+      if (StoreInst *store = dyn_cast<StoreInst>(iter)) {
+        if (store->getPointerAddressSpace() != GLOBAL_ADDRESS_SPACE)
+          continue;
+        if (!isNoAlias ||
+            GetUnderlyingObject(store->getPointerOperand()) == object)
+          return true;
+      } else if (CallInst *call = dyn_cast<CallInst>(iter)) {
+        Function *callee = call->getCalledFunction();
+        if (callee == nullptr || !callee->isDeclaration())
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+bool LocalMemoryStaging::analyzeLoad(StagedLoop &stagedLoop, LoadInst *load,
+                                     StagedLoad &stagedLoad) {
+  if (load->isVolatile() ||
+      load->getPointerAddressSpace() != GLOBAL_ADDRESS_SPACE ||
+      load->getType()->isPointerTy() || isStaged(load))
+    return false;
+
+  GetElementPtrInst *gep =
+      dyn_cast<GetElementPtrInst>(load->getPointerOperand());
+  if (gep == nullptr || gep->getNumIndices() != 1)
+    return false;
+
+  Value *index = gep->getOperand(1);
+  CastInst *castInst = nullptr;
+  if (isa<SExtInst>(index) || isa<ZExtInst>(index)) {
+    castInst = cast<CastInst>(index);
+    index = castInst->getOperand(0);
+  }
+
+  // Match index = iv * stride + offset.
+  PHINode *iv = stagedLoop.iv;
+  BinaryOperator *add = dyn_cast<BinaryOperator>(index);
+  if (add == nullptr || add->getOpcode() != Instruction::Add)
+    return false;
+  Value *stride = nullptr;
+  Value *offset = nullptr;
+  for (unsigned int operand = 0; operand < 2 && offset == nullptr;
+       ++operand) {
+    Value *term = add->getOperand(operand);
+    Value *other = add->getOperand(1 - operand);
+    if (term == iv) {
+      offset = other;
+    } else if (BinaryOperator *mul = dyn_cast<BinaryOperator>(term)) {
+      if (mul->getOpcode() != Instruction::Mul)
+        continue;
+      if (mul->getOperand(0) == iv || mul->getOperand(1) == iv) {
+        stride = mul->getOperand(mul->getOperand(0) == iv ? 1 : 0);
+        offset = other;
+      }
+    }
+  }
+  if (offset == nullptr || offset == iv || stride == iv)
+    return false;
+
+  // The tile is filled before the loads: everything but the iteration must
+  // be available in the preheader. Work-items in x must share the offset,
+  // they fill one tile row.
+  Loop *loop = stagedLoop.loop;
+  Value *base = gep->getPointerOperand();
+  bool isHoisted = false;
+  if (!loop->makeLoopInvariant(base, isHoisted) ||
+      !loop->makeLoopInvariant(offset, isHoisted) || !isUniform(base))
+    return false;
+  if (stride != nullptr &&
+      (!loop->makeLoopInvariant(stride, isHoisted) || !isUniform(stride)))
+    return false;
+
+  std::set<Value *> visited;
+  if (dependsOnDirection(offset, 0, visited) || writesTo(loop, base))
+    return false;
+
+  stagedLoad.load = load;
+  stagedLoad.base = base;
+  stagedLoad.stride = stride;
+  stagedLoad.offset = offset;
+  stagedLoad.cast = castInst;
+  stagedLoad.rows[0] = false;
+  for (int direction = 1; direction < 3; ++direction) {
+    visited.clear();
+    stagedLoad.rows[direction] =
+        groupSize[direction] > 1 &&
+        dependsOnDirection(offset, direction, visited);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+unsigned int LocalMemoryStaging::getTileRows(const StagedLoad &stagedLoad) {
+  return (stagedLoad.rows[1] ? groupSize[1] : 1) *
+         (stagedLoad.rows[2] ? groupSize[2] : 1);
+}
+
+//------------------------------------------------------------------------------
+unsigned int LocalMemoryStaging::getTileBytes(const StagedLoad &stagedLoad) {
+  unsigned int elementBytes =
+      stagedLoad.load->getType()->getPrimitiveSizeInBits() / 8;
+  return getTileRows(stagedLoad) * groupSize[0] * elementBytes;
+}
+
+//------------------------------------------------------------------------------
+void LocalMemoryStaging::addToLoop(Loop *loop, BasicBlock *block) {
+  loop->addBasicBlockToLoop(block, loopInfo->getBase());
+}
+
+//------------------------------------------------------------------------------
+// Whether the work-group has the size the tiles are sized for.
+Value *LocalMemoryStaging::getGroupSizeGuard(IRBuilder<> &builder) {
+  Function *getLocalSize = ndr->getOclFunctionPtr(NDRange::GET_LOCAL_SIZE);
+  Value *guard = nullptr;
+  for (int direction = 0; direction < 3; ++direction) {
+    Value *size = builder.CreateCall(getLocalSize,
+                                     builder.getInt32(direction));
+    Value *isEqual = builder.CreateICmpEQ(
+        size, ConstantInt::get(size->getType(), groupSize[direction]));
+    guard = guard == nullptr ? isEqual : builder.CreateAnd(guard, isEqual);
+  }
+  return guard;
+}
+
+//------------------------------------------------------------------------------
+// First element of the tile row of the work-item.
+Value *LocalMemoryStaging::getRowStart(const StagedLoad &stagedLoad,
+                                       Value **localIds,
+                                       IRBuilder<> &builder) {
+  Type *indexType = localIds[0]->getType();
+  Value *row = nullptr;
+  if (stagedLoad.rows[2])
+    row = builder.CreateMul(
+        localIds[2], ConstantInt::get(indexType, stagedLoad.rows[1]
+                                                     ? groupSize[1]
+                                                     : 1));
+  if (stagedLoad.rows[1])
+    row = row == nullptr ? localIds[1] : builder.CreateAdd(row, localIds[1]);
+  if (row == nullptr)
+    return ConstantInt::get(indexType, 0);
+  return builder.CreateMul(row, ConstantInt::get(indexType, groupSize[0]));
+}
+
+//------------------------------------------------------------------------------
+static Value *getTileAddress(GlobalVariable *tile, Value *index,
+                             IRBuilder<> &builder) {
+  Value *indices[] = {ConstantInt::get(index->getType(), 0), index};
+  return builder.CreateInBoundsGEP(tile, indices);
+}
+
+//------------------------------------------------------------------------------
+// At the first iteration of every tile the loop takes:
+//   barrier; tile[row][x] = A[offset + (iv + x) * stride]; barrier;
+// and the loads read tile[row][(iv - lower) % T]. The fill and the loads
+// are guarded by the work-group size, the original loads remain on the
+// other side.
+void LocalMemoryStaging::stageLoop(StagedLoop &stagedLoop,
+                                   std::vector<StagedLoad> &loads) {
+  LLVMContext &context = function->getContext();
+  Module *module = function->getParent();
+  Loop *loop = stagedLoop.loop;
+  PHINode *iv = stagedLoop.iv;
+  Type *indexType = iv->getType();
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *body = stagedLoop.body;
+  MDNode *stagedNode = MDNode::get(context, None);
+
+  // Work-item coordinates and tiles, computed before the loop.
+  IRBuilder<> builder(loop->getLoopPreheader()->getTerminator());
+  Value *isGroupSize = getGroupSizeGuard(builder);
+  Function *getLocalId = ndr->getOclFunctionPtr(NDRange::GET_LOCAL_ID);
+  Value *localIds[3];
+  for (int direction = 0; direction < 3; ++direction) {
+    Value *localId = builder.CreateCall(getLocalId,
+                                        builder.getInt32(direction));
+    localIds[direction] = builder.CreateZExtOrTrunc(localId, indexType);
+  }
+
+  std::vector<GlobalVariable *> tiles;
+  std::vector<Value *> rowStarts;
+  for (auto &stagedLoad : loads) {
+    ArrayType *arrayType =
+        ArrayType::get(stagedLoad.load->getType(),
+                       getTileRows(stagedLoad) * groupSize[0]);
+    GlobalVariable *tile = new GlobalVariable(
+        *module, arrayType, false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(arrayType),
+        function->getName() + "..staging" + Twine(tileNumber++), nullptr,
+        GlobalValue::NotThreadLocal, LOCAL_ADDRESS_SPACE);
+    tile->setAlignment(stagedLoad.load->getAlignment());
+    tiles.push_back(tile);
+    rowStarts.push_back(getRowStart(stagedLoad, localIds, builder));
+  }
+
+  // Check for the first iteration of a tile at the top of the body.
+  BasicBlock *check =
+      BasicBlock::Create(context, "staging.check", function, body);
+  BasicBlock *fill = BasicBlock::Create(context, "staging.fill", function, body);
+  header->getTerminator()->replaceUsesOfWith(body, check);
+  addToLoop(loop, check);
+  addToLoop(loop, fill);
+
+  builder.SetInsertPoint(check);
+  Value *position = builder.CreateURem(
+      builder.CreateSub(iv, stagedLoop.lower),
+      ConstantInt::get(indexType, groupSize[0]), "staging.position");
+  Value *isFirst =
+      builder.CreateICmpEQ(position, ConstantInt::get(indexType, 0));
+  builder.CreateCondBr(builder.CreateAnd(isGroupSize, isFirst), fill, body);
+
+  // Fill the tiles. Work-items beyond the end of the loop do not load, the
+  // rows not indexed by the offset are filled by the first work-items only.
+  Constant *barrier = module->getOrInsertFunction(
+      "barrier", Type::getVoidTy(context), Type::getInt32Ty(context),
+      nullptr);
+  builder.SetInsertPoint(fill);
+  builder.CreateCall(barrier, builder.getInt32(CLK_LOCAL_MEM_FENCE));
+  Value *element = builder.CreateAdd(iv, localIds[0], "staging.element");
+  Value *isInRange = builder.CreateICmp(stagedLoop.isSigned
+                                            ? CmpInst::ICMP_SLT
+                                            : CmpInst::ICMP_ULT,
+                                        element, stagedLoop.upper);
+  Value *zero = ConstantInt::get(indexType, 0);
+  for (unsigned int index = 0; index < loads.size(); ++index) {
+    StagedLoad &stagedLoad = loads[index];
+    Value *isFilling = isInRange;
+    for (int direction = 1; direction < 3; ++direction)
+      if (!stagedLoad.rows[direction])
+        isFilling = builder.CreateAnd(
+            isFilling, builder.CreateICmpEQ(localIds[direction], zero));
+
+    BasicBlock *copy =
+        BasicBlock::Create(context, "staging.copy", function, body);
+    BasicBlock *next =
+        BasicBlock::Create(context, "staging.next", function, body);
+    addToLoop(loop, copy);
+    addToLoop(loop, next);
+    builder.CreateCondBr(isFilling, copy, next);
+
+    builder.SetInsertPoint(copy);
+    Value *globalIndex = element;
+    if (stagedLoad.stride != nullptr)
+      globalIndex = builder.CreateMul(globalIndex, stagedLoad.stride);
+    globalIndex = builder.CreateAdd(globalIndex, stagedLoad.offset);
+    if (stagedLoad.cast != nullptr)
+      globalIndex = builder.CreateCast(stagedLoad.cast->getOpcode(),
+                                       globalIndex,
+                                       stagedLoad.cast->getType());
+    LoadInst *value = builder.CreateLoad(
+        builder.CreateInBoundsGEP(stagedLoad.base, globalIndex));
+    value->setAlignment(stagedLoad.load->getAlignment());
+    value->setMetadata(STAGED_METADATA, stagedNode);
+    Value *tileIndex = builder.CreateAdd(rowStarts[index], localIds[0]);
+    builder.CreateStore(value,
+                        getTileAddress(tiles[index], tileIndex, builder));
+    builder.CreateBr(next);
+
+    builder.SetInsertPoint(next);
+  }
+  builder.CreateCall(barrier, builder.getInt32(CLK_LOCAL_MEM_FENCE));
+  builder.CreateBr(body);
+
+  // Read the tiles instead of global memory.
+  for (unsigned int index = 0; index < loads.size(); ++index) {
+    LoadInst *load = loads[index].load;
+    BasicBlock *block = load->getParent();
+    BasicBlock *tail = SplitBlock(block, load, this);
+    BasicBlock *tileRead =
+        BasicBlock::Create(context, "staging.read", function, tail);
+    BasicBlock *globalRead =
+        BasicBlock::Create(context, "staging.global", function, tail);
+    addToLoop(loop, tileRead);
+    addToLoop(loop, globalRead);
+
+    block->getTerminator()->eraseFromParent();
+    builder.SetInsertPoint(block);
+    builder.CreateCondBr(isGroupSize, tileRead, globalRead);
+
+    builder.SetInsertPoint(tileRead);
+    Value *tileIndex = builder.CreateAdd(rowStarts[index], position);
+    Value *tileValue =
+        builder.CreateLoad(getTileAddress(tiles[index], tileIndex, builder));
+    builder.CreateBr(tail);
+
+    builder.SetInsertPoint(globalRead);
+    load->moveBefore(builder.CreateBr(tail));
+    load->setMetadata(STAGED_METADATA, stagedNode);
+
+    builder.SetInsertPoint(tail, tail->begin());
+    PHINode *phi = builder.CreatePHI(load->getType(), 2, "staging.value");
+    load->replaceAllUsesWith(phi);
+    phi->addIncoming(tileValue, tileRead);
+    phi->addIncoming(load, globalRead);
+  }
+}
+
+//------------------------------------------------------------------------------
+char LocalMemoryStaging::ID = 0;
+static RegisterPass<LocalMemoryStaging>
+    X("stage-local", "OpenCL Local Memory Staging Pass");
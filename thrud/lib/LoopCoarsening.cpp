@@ -0,0 +1,166 @@
+#include "thrud/ThreadCoarsening.h"
+
+#include "thrud/DataTypes.h"
+#include "thrud/OCLEnv.h"
+#include "thrud/Utils.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+// In loop mode the kernel is coarsened by the unroll factor only and then
+// wrapped in a counted loop: iteration i runs the sub-threads
+// [i * factor, (i + 1) * factor) of the tripCount * factor ones assigned to
+// the work-item. The code size grows with the unroll factor, not with the
+// coarsening factor. When the factor is read from a kernel argument the
+// trip count is that argument and one sub-thread runs per iteration. With
+// the number of work-groups of the original NDRange in an argument too, the
+// iterations beyond it are skipped, so the grid can be rounded up.
+
+const unsigned int CLK_LOCAL_MEM_FENCE = 1;
+
+//------------------------------------------------------------------------------
+// Whether the work-items of a work-group share data: the kernel has barriers
+// or touches local memory.
+static bool sharesLocalMemory(Function &function) {
+  for (inst_iterator iter = inst_begin(function), iterEnd = inst_end(function);
+       iter != iterEnd; ++iter) {
+    if (isBarrier(&*iter))
+      return true;
+    for (auto &operand : iter->operands()) {
+      PointerType *type = dyn_cast<PointerType>(operand->getType());
+      if (type != nullptr && type->getAddressSpace() == OCLEnv::LOCAL_AS)
+        return true;
+    }
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+bool ThreadCoarsening::canCoarsenWithLoop(Function &function) {
+  // In block level coarsening a sub-thread is a whole work-group, which
+  // reaches its barriers within one iteration; the latch then waits for the
+  // whole work-group before the next one reuses local memory. In thread
+  // level coarsening the sub-threads belong to the same work-group: running
+  // them one after the other would deadlock on a barrier.
+  if (!THREAD_LEVEL_COARSENING)
+    return true;
+
+  for (inst_iterator iter = inst_begin(function), iterEnd = inst_end(function);
+       iter != iterEnd; ++iter) {
+    if (isBarrier(&*iter))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Everything after the allocas of the entry block becomes the body of the
+// loop; every return ends an iteration.
+PHINode *ThreadCoarsening::createCoarseningLoop(Function &function) {
+  LLVMContext &context = function.getContext();
+  bool needsBarrier = !THREAD_LEVEL_COARSENING && sharesLocalMemory(function);
+  BasicBlock *entry = &function.getEntryBlock();
+  Instruction *splitPoint = &entry->front();
+  while (isa<AllocaInst>(splitPoint))
+    splitPoint = splitPoint->getNextNode();
+  BasicBlock *header = SplitBlock(entry, splitPoint, this);
+  header->setName("coarsening.header");
+
+  Type *indexType = scaledIds.empty() ? Type::getInt32Ty(context)
+                                      : scaledIds.front()->getType();
+  PHINode *subThread =
+      PHINode::Create(indexType, 2, "sub.thread", &header->front());
+  subThread->addIncoming(ConstantInt::get(indexType, 0), entry);
+
+  BasicBlock *latch =
+      BasicBlock::Create(context, "coarsening.latch", &function);
+  BasicBlock *exit = BasicBlock::Create(context, "coarsening.exit", &function);
+
+  std::vector<ReturnInst *> returns;
+  for (auto &block : function) {
+    if (ReturnInst *ret = dyn_cast_or_null<ReturnInst>(block.getTerminator()))
+      returns.push_back(ret);
+  }
+  for (auto ret : returns) {
+    BranchInst::Create(latch, ret);
+    ret->eraseFromParent();
+  }
+  ReturnInst::Create(context, exit);
+
+  // In block level coarsening the work-items that finish a work-group must
+  // not overwrite its local memory while the others still use it. The trip
+  // count is the same for the whole work-group and every work-item reaches
+  // the latch once per iteration, so the barrier is uniform.
+  if (needsBarrier) {
+    Constant *barrier = function.getParent()->getOrInsertFunction(
+        BARRIER, Type::getVoidTy(context), Type::getInt32Ty(context),
+        nullptr);
+    IRBuilder<> builder(latch);
+    builder.CreateCall(barrier, builder.getInt32(CLK_LOCAL_MEM_FENCE));
+  }
+
+  Instruction *next = getAddInst(subThread, 1);
+  latch->getInstList().push_back(next);
+  Value *trips = ConstantInt::get(indexType, tripCount);
+  if (factorArg != nullptr) {
+    trips = factorArg;
+    if (factorArg->getType() != indexType)
+      trips = CastInst::CreateIntegerCast(factorArg, indexType, false,
+                                          "coarsening.trips", latch);
+  }
+  ICmpInst *condition = new ICmpInst(*latch, ICmpInst::ICMP_ULT, next, trips,
+                                     "sub.thread.cond");
+  BranchInst::Create(header, exit, condition, latch);
+  subThread->addIncoming(next, latch);
+
+  // The work-group of the iteration is the same for all its work-items: the
+  // ones beyond the original grid skip the body, barriers included, together.
+  InstVector groupIds = ndr->getGroupIds(direction);
+  if (groupsArg != nullptr && !groupIds.empty()) {
+    BasicBlock *body = SplitBlock(header, subThread->getNextNode(), this);
+    body->setName("coarsening.body");
+    IRBuilder<> builder(header->getTerminator());
+    Value *groupId = builder.Insert(groupIds.front()->clone());
+    Type *groupType = groupId->getType();
+    Value *firstGroup = builder.CreateMul(
+        groupId, builder.CreateIntCast(factorArg, groupType, false));
+    Value *group = builder.CreateAdd(
+        firstGroup, builder.CreateIntCast(subThread, groupType, false),
+        "coarsening.group");
+    Value *isInGrid = builder.CreateICmpULT(
+        group, builder.CreateIntCast(groupsArg, groupType, false),
+        "coarsening.in.grid");
+    header->getTerminator()->eraseFromParent();
+    BranchInst::Create(body, latch, isInGrid, header);
+  }
+
+  return subThread;
+}
+
+//------------------------------------------------------------------------------
+// Move the scaled ids to the first sub-thread of the current iteration:
+// factor ids after the previous one, factor * stride in thread level
+// coarsening.
+void ThreadCoarsening::offsetScaledIds(PHINode *subThread) {
+  unsigned int step = THREAD_LEVEL_COARSENING ? factor * stride : factor;
+  for (auto base : scaledIds) {
+    Instruction *bookmark = base;
+    Value *index = subThread;
+    if (index->getType() != base->getType()) {
+      Instruction *cast = CastInst::CreateIntegerCast(
+          subThread, base->getType(), false, "sub.thread.cast");
+      cast->insertAfter(bookmark);
+      bookmark = cast;
+      index = cast;
+    }
+    Instruction *offset = getMulInst(index, step);
+    offset->insertAfter(bookmark);
+    Instruction *shifted = getAddInst(base, offset);
+    shifted->insertAfter(offset);
+    replaceUses(base, shifted);
+  }
+}
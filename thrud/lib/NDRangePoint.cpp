@@ -0,0 +1,50 @@
+#include "thrud/NDRangePoint.h"
+
+#include "thrud/NDRange.h"
+
+NDRangePoint::NDRangePoint(int localX, int localY, int localZ, int groupX,
+                           int groupY, int groupZ,
+                           const NDRangeSpace &ndRangeSpace)
+    : ndRangeSpace(ndRangeSpace) {
+  int tmpLocal[] = {localX, localY, localZ};
+  int tmpGroup[] = {groupX, groupY, groupZ};
+
+  local.assign(tmpLocal, tmpLocal + NDRange::DIRECTION_NUMBER);
+  group.assign(tmpGroup, tmpGroup + NDRange::DIRECTION_NUMBER);
+}
+
+int NDRangePoint::getLocalX() const { return local[0]; }
+int NDRangePoint::getLocalY() const { return local[1]; }
+int NDRangePoint::getLocalZ() const { return local[2]; }
+
+int NDRangePoint::getGlobalX() const { return getGlobal(0); }
+int NDRangePoint::getGlobalY() const { return getGlobal(1); }
+int NDRangePoint::getGlobalZ() const { return getGlobal(2); }
+
+int NDRangePoint::getGroupX() const { return group[0]; }
+int NDRangePoint::getGroupY() const { return group[1]; }
+int NDRangePoint::getGroupZ() const { return group[2]; }
+
+int NDRangePoint::getLocal(int direction) const { return local[direction]; }
+
+int NDRangePoint::getGlobal(int direction) const {
+  return group[direction] * ndRangeSpace.getLocalSize(direction) +
+         local[direction];
+}
+
+int NDRangePoint::getGroup(int direction) const { return group[direction]; }
+
+int NDRangePoint::getCoordinate(const std::string &name, int direction) const {
+  if (name == NDRange::GET_LOCAL_ID)
+    return getLocal(direction);
+  if (name == NDRange::GET_GLOBAL_ID)
+    return getGlobal(direction);
+  if (name == NDRange::GET_GROUP_ID)
+    return getGroup(direction);
+
+  return -1;
+}
+
+const NDRangeSpace &NDRangePoint::getNDRangeSpace() const {
+  return ndRangeSpace;
+}
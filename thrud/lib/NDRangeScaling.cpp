@@ -3,6 +3,9 @@
 #include "thrud/DataTypes.h"
 #include "thrud/Utils.h"
 
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
 //------------------------------------------------------------------------------
 void ThreadCoarsening::scaleNDRange() {
   InstVector InstTids;
@@ -26,20 +29,78 @@ void ThreadCoarsening::scaleSizes() {
        iter != iterEnd; ++iter) {
     // Scale size.
     Instruction *inst = *iter;
-    Instruction *mul = getMulInst(inst, factor);
-    mul->insertAfter(inst);
+    Value *mul = groupsArg != nullptr ? insertOriginalSize(inst)
+                                      : insertSubThreadsMul(inst, inst, 1);
     //errs() << "Inserting " << *mul << "\n";
     // Replace uses of the old size with the scaled one.
     replaceUses(inst, mul);
   }
 }
 
+//------------------------------------------------------------------------------
+// Inserts value * multiplier * the number of sub-threads of a work-item after
+// bookmark. The number is factor * tripCount, or the factor argument when it
+// is only known at launch.
+Instruction *ThreadCoarsening::insertSubThreadsMul(Value *value,
+                                                   Instruction *bookmark,
+                                                   unsigned int multiplier) {
+  if (factorArg == nullptr) {
+    Instruction *mul = getMulInst(value, factor * tripCount * multiplier);
+    mul->insertAfter(bookmark);
+    return mul;
+  }
+
+  Value *subThreads = factorArg;
+  if (factorArg->getType() != value->getType()) {
+    Instruction *cast = CastInst::CreateIntegerCast(
+        factorArg, value->getType(), false, "coarsening.factor");
+    cast->insertAfter(bookmark);
+    bookmark = cast;
+    subThreads = cast;
+  }
+  if (multiplier != 1) {
+    Instruction *scaled = getMulInst(subThreads, multiplier);
+    scaled->insertAfter(bookmark);
+    bookmark = scaled;
+    subThreads = scaled;
+  }
+  Instruction *mul = getMulInst(value, subThreads);
+  mul->insertAfter(bookmark);
+  return mul;
+}
+
+//------------------------------------------------------------------------------
+// With the grid rounded up the scaled sizes would be those of the rounded
+// grid: the number of groups is read from the groups argument instead, and
+// the global size is that times the local size.
+Value *ThreadCoarsening::insertOriginalSize(Instruction *size) {
+  Value *groups = groupsArg;
+  Instruction *bookmark = size;
+  if (groupsArg->getType() != size->getType()) {
+    Instruction *cast = CastInst::CreateIntegerCast(
+        groupsArg, size->getType(), false, "coarsening.groups");
+    cast->insertAfter(bookmark);
+    bookmark = cast;
+    groups = cast;
+  }
+  if (ndr->isGroupsNum(size, direction))
+    return groups;
+
+  CallInst *localSize = cast<CallInst>(size->clone());
+  Module *module = size->getParent()->getParent()->getParent();
+  localSize->setCalledFunction(module->getOrInsertFunction(
+      NDRange::GET_LOCAL_SIZE,
+      localSize->getCalledFunction()->getFunctionType()));
+  localSize->insertAfter(bookmark);
+  Instruction *mul = getMulInst(groups, localSize);
+  mul->insertAfter(localSize);
+  return mul;
+}
+
 //------------------------------------------------------------------------------
 
 // Scaling function: origTid = [newTid / st] * cf * st + newTid % st + subid * st
 void ThreadCoarsening::scaleIdsThreadLevelCoarsening() {
-  unsigned int cfst = factor * stride;
-
   InstVector tids = ndr->getTids(direction);
   for (InstVector::iterator instIter = tids.begin(), instEnd = tids.end();
        instIter != instEnd; ++instIter) {
@@ -48,12 +109,12 @@ void ThreadCoarsening::scaleIdsThreadLevelCoarsening() {
     // Compute base of new tid.
     Instruction *div = getDivInst(inst, stride); 
     div->insertAfter(inst);
-    Instruction *mul = getMulInst(div, cfst);
-    mul->insertAfter(div);
+    Instruction *mul = insertSubThreadsMul(div, div, stride);
     Instruction *modulo = getModuloInst(inst, stride);
     modulo->insertAfter(mul);
     Instruction *base = getAddInst(mul, modulo);
     base->insertAfter(modulo);
+    scaledIds.push_back(base);
 
     // Replace uses of the threadId with the new base.
     replaceUses(inst, base);
@@ -144,10 +205,10 @@ void ThreadCoarsening::scaleIds() {
   for (InstVector::iterator instIter = groupIds.begin(), instEnd = groupIds.end();
        instIter != instEnd; ++instIter) {
     Instruction *inst = *instIter;
-    Instruction *base = getMulInst(inst, factor);
-    base->insertAfter(inst);
+    Instruction *base = insertSubThreadsMul(inst, inst, 1);
     replaceUses(inst, base);
     base->setOperand(0, inst);
+    scaledIds.push_back(base);
    
     cMap.insert(std::pair<Instruction *, InstVector>(inst, InstVector()));
     InstVector &current = cMap[base];
@@ -1,5 +1,7 @@
 #include "thrud/OCLEnv.h"
 
+#include "thrud/LaunchContext.h"
+
 #include "llvm/IR/Type.h"
 
 #include "llvm/IR/Function.h"
@@ -9,6 +11,7 @@ const int OCLEnv::BANK_WIDTH = 4;
 const int OCLEnv::WARP_SIZE = 32;
 const int OCLEnv::CACHELINE_SIZE = 128;
 const int OCLEnv::UNKNOWN_MEMORY_LOCATION = -1;
+const unsigned int OCLEnv::GLOBAL_AS = 1;
 const unsigned int OCLEnv::LOCAL_AS = 3;
 
 OCLEnv::OCLEnv(Function &function, const NDRange *ndRange, const NDRangeSpace &ndRangeSpace)
@@ -17,6 +20,10 @@ OCLEnv::OCLEnv(Function &function, const NDRange *ndRange, const NDRangeSpace &n
 }
 
 void OCLEnv::setup(Function &function) {
+  // The values the host sets, if the launch context has them.
+  LaunchContext context;
+  context.read(function.getName());
+
   // Go through the function arguements and setup the map.
   for (Function::arg_iterator iter = function.arg_begin(),
                               iterEnd = function.arg_end();
@@ -25,8 +32,9 @@ void OCLEnv::setup(Function &function) {
     llvm::Type *type = argument->getType();
     // Only set the value of the argument if it is an integer.
     if (type->isIntegerTy()) {
-      // FIXME! Read the input configuration from a file.
-      argumentMap.insert(std::pair<llvm::Value *, int>(argument, 1024));
+      long long value = 1024;
+      context.getArgument(iter->getArgNo(), value);
+      argumentMap.insert(std::pair<llvm::Value *, int>(argument, (int)value));
     }
   }
 }
@@ -24,7 +24,7 @@
 using namespace llvm;
 
 extern cl::opt<std::string> KernelNameCL;
-cl::opt<unsigned int> SharedMemBytes("shmem", cl::init(0), cl::Hidden, cl::desc("The amount of redundant shared memory reserved in bytes"));
+cl::opt<unsigned int> SharedMemBytes("shmem", cl::init(0), cl::Hidden, cl::ZeroOrMore, cl::desc("The amount of redundant shared memory reserved in bytes"));
 
 void OccupancyReduction::getAnalysisUsage(AnalysisUsage &au) const {
   au.addRequired<NDRange>();
@@ -38,8 +38,11 @@ void listBlocks(BasicBlock *header, BasicBlock *exiting, BlockVector &result) {
   }
 
   // Perform traversal of the tree starting from header and stopping at exiting.
+  // Blocks are marked as seen when queued.
   BlockDeque worklist;
+  BlockSet seen;
   worklist.push_back(header);
+  seen.insert(header);
 
   while (!worklist.empty()) {
     BasicBlock *block = worklist.front();
@@ -51,8 +54,7 @@ void listBlocks(BasicBlock *header, BasicBlock *exiting, BlockVector &result) {
     for (succ_iterator iter = succ_begin(block), iterEnd = succ_end(block);
          iter != iterEnd; ++iter) {
       BasicBlock *child = *iter;
-      if (!isPresent(child, result) && !isPresent(child, worklist) &&
-          child != exiting) {
+      if (child != exiting && seen.insert(child).second) {
         worklist.push_back(child);
       }
     }
@@ -5,6 +5,7 @@
 
 #include "llvm/Analysis/LoopInfo.h"
 
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -16,7 +17,20 @@ void ThreadCoarsening::replicateRegion(DivergentRegion *region) {
   assert(pdt->dominates(region->getExiting(), region->getHeader()) &&
          "Exiting does not post dominate Header");
 
-  replicateRegionClassic(region);
+  switch (divRegionOption) {
+  case FullReplication:
+    replicateRegionClassic(region);
+    break;
+  case TrueBranchMerging:
+    replicateRegionTrueMerging(region);
+    break;
+  case FalseBranchMerging:
+    replicateRegionFalseMerging(region);
+    break;
+  case FullMerging:
+    replicateRegionFullMerging(region);
+    break;
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -98,3 +112,367 @@ void ThreadCoarsening::updatePlaceholdersWithAlive(CoarseningMap &aliveMap) {
     updatePlaceholderMap(alive, coarsenedInsts);
   }
 }
+
+//------------------------------------------------------------------------------
+void ThreadCoarsening::replicateRegionTrueMerging(DivergentRegion *region) {
+  replicateRegionMerging(region, std::vector<unsigned int>(1, 0));
+}
+
+//------------------------------------------------------------------------------
+void ThreadCoarsening::replicateRegionFalseMerging(DivergentRegion *region) {
+  replicateRegionMerging(region, std::vector<unsigned int>(1, 1));
+}
+
+//------------------------------------------------------------------------------
+void ThreadCoarsening::replicateRegionFullMerging(DivergentRegion *region) {
+  std::vector<unsigned int> branches;
+  branches.push_back(0);
+  branches.push_back(1);
+  replicateRegionMerging(region, branches);
+}
+
+//------------------------------------------------------------------------------
+// The region is replicated as in the classic strategy. For each of the given
+// branches a check is added in front of it: if all the coarsened threads take
+// that branch, the replicated region is skipped and a single copy of the
+// branch, with the instructions of every thread side by side, is executed
+// instead. The two paths meet in a join block in front of the exit of the
+// region.
+//
+// pred -> top -> header ... replicatedExiting -> join -> exit
+//          |                                     ^
+//          +-> merged ---------------------------+
+void ThreadCoarsening::replicateRegionMerging(
+    DivergentRegion *region, const std::vector<unsigned int> &branches) {
+  if (factor < 2 || !canMergeRegion(region)) {
+    replicateRegionClassic(region);
+    return;
+  }
+
+  BasicBlock *header = region->getHeader();
+  BasicBlock *pred = header->getSinglePredecessor();
+  BasicBlock *exit = getExit(*region);
+
+  // Path taken when the threads disagree.
+  CoarseningMap aliveMap;
+  initAliveMap(region, aliveMap);
+  replicateRegionImpl(region, aliveMap);
+  BasicBlock *replicatedExiting = exit->getSinglePredecessor();
+
+  BasicBlock *join = BasicBlock::Create(exit->getContext(),
+                                        exit->getName() + ".join",
+                                        exit->getParent(), exit);
+  BranchInst::Create(exit, join);
+  changeBlockTarget(replicatedExiting, join);
+  remapBlocksInPHIs(exit, replicatedExiting, join);
+  dt->addNewBlock(join, replicatedExiting);
+  dt->changeImmediateDominator(exit, join);
+
+  // Paths taken when the threads agree.
+  BlockVector mergedExitings;
+  std::vector<std::vector<ValueVector>> merged(branches.size());
+  BasicBlock *top = pred;
+  BasicBlock *firstTop = nullptr;
+  for (unsigned int index = 0; index < branches.size(); ++index) {
+    BasicBlock *mergedExiting = nullptr;
+    BasicBlock *mergedEntry = createMergedSubregion(
+        region, branches[index], join, mergedExiting, merged[index]);
+    mergedExitings.push_back(mergedExiting);
+
+    top = createTopBranch(region, top, branches[index], header, mergedEntry);
+    if (firstTop == nullptr)
+      firstTop = top;
+  }
+  dt->changeImmediateDominator(join, firstTop);
+
+  updateExitPhiNodes(region, join, replicatedExiting, mergedExitings, merged,
+                     aliveMap);
+  updatePlaceholdersWithAlive(aliveMap);
+}
+
+//------------------------------------------------------------------------------
+// Merging rewrites the header and the exiting block of the region, so it
+// requires the shape produced by branch extraction. Regions that do not have
+// it are replicated with the classic strategy.
+bool ThreadCoarsening::canMergeRegion(DivergentRegion *region) {
+  BasicBlock *header = region->getHeader();
+  BasicBlock *exiting = region->getExiting();
+
+  if (loopInfo->isLoopHeader(header) ||
+      header->getSinglePredecessor() == nullptr)
+    return false;
+
+  // The header holds the divergent branch only.
+  BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
+  if (header->size() != 1 || branch == nullptr || !branch->isConditional() ||
+      !isa<Instruction>(branch->getCondition()) ||
+      branch->getSuccessor(0) == branch->getSuccessor(1))
+    return false;
+
+  // The exiting block holds the phis of the alive values only.
+  if (exiting->getFirstNonPHI() != exiting->getTerminator() ||
+      exiting->getTerminator()->getNumSuccessors() != 1)
+    return false;
+  if (getExit(*region)->getSinglePredecessor() != exiting)
+    return false;
+
+  for (auto inst : region->getAlive()) {
+    if (!isa<PHINode>(inst) || inst->getParent() != exiting)
+      return false;
+  }
+
+  // The top branches test the condition of every coarsened thread.
+  Instruction *condition = cast<Instruction>(branch->getCondition());
+  if (cMap.find(condition) == cMap.end() && !sdda->isDivergent(condition))
+    return false;
+
+  // The threads share the control flow of a merged branch: they must agree
+  // on every branch inside it.
+  for (unsigned int branchIndex = 0; branchIndex < 2; ++branchIndex) {
+    BasicBlock *subregionExiting = getSubregionExiting(region, branchIndex);
+    if (subregionExiting == nullptr)
+      continue;
+    if (subregionExiting->getTerminator()->getNumSuccessors() != 1)
+      return false;
+
+    DivergentRegion subregion(branch->getSuccessor(branchIndex),
+                              subregionExiting);
+    for (auto block : subregion) {
+      TerminatorInst *terminator = block->getTerminator();
+      if (terminator->getNumSuccessors() > 1) {
+        Instruction *inner = dyn_cast<Instruction>(terminator->getOperand(0));
+        if (inner != nullptr && sdda->isDivergent(inner))
+          return false;
+      }
+      for (auto &inst : *block) {
+        if (isBarrier(&inst))
+          return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Copy the given branch of the region once, jumping to join, and replicate
+// each of its instructions in place for the other coarsened threads.
+// aliveValues[index] holds the values of the alive phis computed by thread
+// index.
+BasicBlock *ThreadCoarsening::createMergedSubregion(
+    DivergentRegion *region, unsigned int branchIndex, BasicBlock *join,
+    BasicBlock *&mergedExiting, std::vector<ValueVector> &aliveValues) {
+  BasicBlock *header = region->getHeader();
+  BasicBlock *subregionHeader =
+      header->getTerminator()->getSuccessor(branchIndex);
+  BasicBlock *subregionExiting = getSubregionExiting(region, branchIndex);
+  BasicBlock *incomingBlock =
+      subregionExiting == nullptr ? header : subregionExiting;
+
+  ValueVector bases;
+  for (auto inst : region->getAlive()) {
+    PHINode *phi = cast<PHINode>(inst);
+    bases.push_back(phi->getIncomingValueForBlock(incomingBlock));
+  }
+
+  aliveValues.assign(factor, ValueVector());
+
+  // The branch is empty: the threads only have to reach the join block.
+  if (subregionExiting == nullptr) {
+    BasicBlock *block =
+        BasicBlock::Create(header->getContext(), header->getName() + ".merged",
+                           header->getParent(), join);
+    BranchInst::Create(join, block);
+    dt->addNewBlock(block, header);
+
+    for (unsigned int index = 0; index < factor; ++index) {
+      for (auto base : bases) {
+        Value *value = base;
+        Instruction *inst = dyn_cast<Instruction>(base);
+        if (inst != nullptr && index > 0) {
+          Instruction *coarsenedInst = getCoarsenedInstruction(inst, index - 1);
+          if (coarsenedInst != nullptr)
+            value = coarsenedInst;
+        }
+        aliveValues[index].push_back(value);
+      }
+    }
+
+    mergedExiting = block;
+    return block;
+  }
+
+  DivergentRegion subregion(subregionHeader, subregionExiting);
+  Map valueMap;
+  DivergentRegion *newRegion = subregion.clone(".merged", dt, valueMap);
+
+  // The replicas of the copied instructions, the terminators excepted.
+  CoarseningMap mergedMap;
+  for (auto block : *newRegion) {
+    InstVector insts;
+    for (auto &inst : *block) {
+      if (!isa<TerminatorInst>(&inst))
+        insts.push_back(&inst);
+    }
+    for (auto inst : insts) {
+      InstVector &replicas = mergedMap[inst];
+      Instruction *bookmark = inst;
+      for (unsigned int index = 0; index < factor - 1; ++index) {
+        Instruction *replica = inst->clone();
+        renameValueWithFactor(replica, inst->getName(), index);
+        replica->insertAfter(bookmark);
+        bookmark = replica;
+        replicas.push_back(replica);
+      }
+    }
+  }
+
+  // Every replica reads the values of its own thread, from the branch or
+  // from before the region.
+  for (auto &mapIter : mergedMap) {
+    for (unsigned int index = 0; index < factor - 1; ++index) {
+      Instruction *replica = mapIter.second[index];
+      applyCoarseningMap(replica, index);
+      for (unsigned int opIndex = 0, opEnd = replica->getNumOperands();
+           opIndex != opEnd; ++opIndex) {
+        Instruction *operand = dyn_cast<Instruction>(replica->getOperand(opIndex));
+        CoarseningMap::iterator replicas = mergedMap.find(operand);
+        if (operand != nullptr && replicas != mergedMap.end())
+          replica->setOperand(opIndex, replicas->second[index]);
+      }
+    }
+  }
+
+  for (unsigned int index = 0; index < factor; ++index) {
+    for (auto base : bases) {
+      Value *value = base;
+      Instruction *inst = dyn_cast<Instruction>(base);
+      if (inst != nullptr) {
+        if (contains(subregion, inst)) {
+          value = valueMap[inst];
+          if (index > 0)
+            value = mergedMap[cast<Instruction>(value)][index - 1];
+        } else if (index > 0) {
+          Instruction *coarsenedInst = getCoarsenedInstruction(inst, index - 1);
+          if (coarsenedInst != nullptr)
+            value = coarsenedInst;
+        }
+      }
+      aliveValues[index].push_back(value);
+    }
+  }
+
+  BasicBlock *entry = newRegion->getHeader();
+  mergedExiting = newRegion->getExiting();
+  changeBlockTarget(mergedExiting, join);
+  delete newRegion;
+  return entry;
+}
+
+//------------------------------------------------------------------------------
+// Insert a block between pred and cascade that jumps to merged if the
+// conditions of all the coarsened threads select the given branch.
+BasicBlock *ThreadCoarsening::createTopBranch(DivergentRegion *region,
+                                              BasicBlock *pred,
+                                              unsigned int branchIndex,
+                                              BasicBlock *cascade,
+                                              BasicBlock *merged) {
+  BasicBlock *top =
+      BasicBlock::Create(cascade->getContext(), cascade->getName() + ".top",
+                         cascade->getParent(), cascade);
+
+  TerminatorInst *terminator = pred->getTerminator();
+  for (unsigned int index = 0; index < terminator->getNumSuccessors();
+       ++index) {
+    if (terminator->getSuccessor(index) == cascade)
+      terminator->setSuccessor(index, top);
+  }
+  remapBlocksInPHIs(cascade, pred, top);
+  remapBlocksInPHIs(merged, region->getHeader(), top);
+
+  // canMergeRegion checked that the condition is replicated.
+  BranchInst *branch = cast<BranchInst>(region->getHeader()->getTerminator());
+  Instruction *condition = cast<Instruction>(branch->getCondition());
+  InstVector conditions;
+  for (unsigned int index = 0; index < factor - 1; ++index) {
+    Instruction *coarsenedCondition = getCoarsenedInstruction(condition, index);
+    assert(coarsenedCondition != nullptr &&
+           "Missing coarsened condition of a merged region");
+    conditions.push_back(coarsenedCondition);
+  }
+
+  // All the threads take the true branch if the and of the conditions is
+  // true, they all take the false one if the or is false.
+  if (branchIndex == 0) {
+    Instruction *all = insertBooleanReduction(condition, conditions,
+                                              Instruction::And, top);
+    BranchInst::Create(merged, cascade, all, top);
+  } else {
+    Instruction *any = insertBooleanReduction(condition, conditions,
+                                              Instruction::Or, top);
+    BranchInst::Create(cascade, merged, any, top);
+  }
+
+  dt->addNewBlock(top, pred);
+  dt->changeImmediateDominator(cascade, top);
+  dt->changeImmediateDominator(merged, top);
+  return top;
+}
+
+//------------------------------------------------------------------------------
+Instruction *ThreadCoarsening::insertBooleanReduction(
+    Instruction *base, InstVector &insts, llvm::Instruction::BinaryOps binOp,
+    BasicBlock *block) {
+  Instruction *reduction = base;
+  for (auto inst : insts) {
+    reduction = BinaryOperator::Create(binOp, reduction, inst,
+                                       base->getName() + ".reduction", block);
+  }
+  return reduction;
+}
+
+//------------------------------------------------------------------------------
+// Add to join one phi per alive value and thread, selecting between the value
+// computed by the replicated region and the ones computed by the merged
+// branches. The uses of the alive values after the region are redirected to
+// the new phis.
+void ThreadCoarsening::updateExitPhiNodes(
+    DivergentRegion *region, BasicBlock *join, BasicBlock *replicatedExiting,
+    const BlockVector &mergedExitings,
+    const std::vector<std::vector<ValueVector>> &merged,
+    CoarseningMap &aliveMap) {
+  InstVector &alive = region->getAlive();
+  for (unsigned int aliveIndex = 0; aliveIndex < alive.size(); ++aliveIndex) {
+    PHINode *phi = cast<PHINode>(alive[aliveIndex]);
+    InstVector &coarsenedInsts = aliveMap[phi];
+
+    for (unsigned int index = 0; index < factor; ++index) {
+      PHINode *joinPhi =
+          PHINode::Create(phi->getType(), mergedExitings.size() + 1, "",
+                          join->getFirstNonPHI());
+      std::string name = (phi->getName() + ".join").str();
+      if (index == 0)
+        joinPhi->setName(name);
+      else
+        renameValueWithFactor(joinPhi, name, index - 1);
+
+      Value *replicated = index == 0 ? phi : coarsenedInsts[index - 1];
+      joinPhi->addIncoming(replicated, replicatedExiting);
+      for (unsigned int branch = 0; branch < mergedExitings.size(); ++branch) {
+        joinPhi->addIncoming(merged[branch][index][aliveIndex],
+                             mergedExitings[branch]);
+      }
+
+      if (index == 0) {
+        std::vector<User *> users(phi->user_begin(), phi->user_end());
+        for (auto user : users) {
+          Instruction *inst = dyn_cast<Instruction>(user);
+          if (inst != nullptr && inst != joinPhi && !contains(*region, inst))
+            inst->replaceUsesOfWith(phi, joinPhi);
+        }
+      } else {
+        coarsenedInsts[index - 1] = joinPhi;
+      }
+    }
+  }
+}
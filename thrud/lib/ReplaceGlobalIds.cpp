@@ -7,7 +7,6 @@
 using namespace llvm;
 
 extern cl::opt<std::string> KernelNameCL;
-extern cl::opt<unsigned int> CoarseningDirectionCL;
 
 ReplaceGlobalIds::ReplaceGlobalIds() : FunctionPass(ID) {}
 
@@ -31,7 +30,7 @@ bool ReplaceGlobalIds::runOnFunction(Function &function) {
     return false;
 
   NDRange *ndr = &getAnalysis<NDRange>();
-  unsigned int direction = CoarseningDirectionCL;
+  unsigned int direction = getCoarseningDirection(functionPtr);
   InstVector gids = ndr->getGids(direction);
 
   std::vector<Instruction *> unusedInsts;
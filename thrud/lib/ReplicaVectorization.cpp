@@ -0,0 +1,388 @@
+#include "thrud/ReplicaVectorization.h"
+
+#include "thrud/Utils.h"
+
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "llvm/Transforms/Utils/Local.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+extern cl::opt<std::string> KernelNameCL;
+extern cl::opt<unsigned int> CoarseningFactorCL;
+
+// Command line options.
+cl::opt<unsigned int> VectorizingWidthCL(
+    "vectorizing-width", cl::init(0), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Number of replicas packed in a vector: 2, 3, 4, 8 or 16. "
+             "Defaults to the coarsening factor. Without -coarsening-factor "
+             "the kernel is coarsened by this width"));
+cl::opt<int> VectorizingDirectionCL(
+    "vectorizing-direction", cl::init(0), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("The coarsening direction when the kernel is coarsened by "
+             "-vectorizing-width"));
+
+//------------------------------------------------------------------------------
+// Element types of the OpenCL vector types, with their mangling.
+static std::string getTypeCode(Type *type) {
+  if (type->isFloatTy())
+    return "f";
+  if (type->isDoubleTy())
+    return "d";
+  if (!type->isIntegerTy())
+    return "";
+  switch (type->getIntegerBitWidth()) {
+  case 8:
+    return "c";
+  case 16:
+    return "s";
+  case 32:
+    return "i";
+  case 64:
+    return "l";
+  }
+  return "";
+}
+
+static bool isVectorWidth(unsigned int width) {
+  return width == 2 || width == 3 || width == 4 || width == 8 || width == 16;
+}
+
+//------------------------------------------------------------------------------
+ReplicaVectorization::ReplicaVectorization() : FunctionPass(ID) {}
+
+//------------------------------------------------------------------------------
+void ReplicaVectorization::getAnalysisUsage(AnalysisUsage &au) const {
+  au.addRequired<ScalarEvolution>();
+  au.setPreservesCFG();
+}
+
+//------------------------------------------------------------------------------
+bool ReplicaVectorization::runOnFunction(Function &function) {
+  if (!isKernel((const Function *)&function))
+    return false;
+
+  // Apply the pass to the selected kernel only.
+  std::string functionName = function.getName();
+  if (KernelNameCL != "" && functionName != KernelNameCL)
+    return false;
+
+  width = VectorizingWidthCL != 0 ? VectorizingWidthCL : CoarseningFactorCL;
+  if (width == 1)
+    return false;
+  if (!isVectorWidth(width)) {
+    errs() << "Cannot pack " << width << " replicas in an OpenCL vector\n";
+    return false;
+  }
+
+  // size_t is the offset of vloadN and vstoreN.
+  Module *module = function.getParent();
+  bool is64Bit = StringRef(module->getTargetTriple()).startswith("spir64");
+  sizeType = is64Bit ? Type::getInt64Ty(function.getContext())
+                     : Type::getInt32Ty(function.getContext());
+  se = &getAnalysis<ScalarEvolution>();
+
+  bool isModified = false;
+  for (Function::iterator block = function.begin(), end = function.end();
+       block != end; ++block) {
+    isModified |= vectorizeBlock(*block);
+  }
+  return isModified;
+}
+
+//------------------------------------------------------------------------------
+// The stores of the block are the seeds: every group of width stores to
+// consecutive addresses is packed with the tree of its stored values.
+bool ReplicaVectorization::vectorizeBlock(BasicBlock &block) {
+  std::vector<StoreInst *> stores;
+  for (BasicBlock::iterator iter = block.begin(), end = block.end();
+       iter != end; ++iter) {
+    StoreInst *store = dyn_cast<StoreInst>(iter);
+    if (store != nullptr && store->isSimple() &&
+        getTypeCode(store->getValueOperand()->getType()) != "")
+      stores.push_back(store);
+  }
+
+  std::vector<std::vector<StoreInst *>> bundles;
+  for (unsigned int index = 0; index < stores.size(); ++index) {
+    std::vector<StoreInst *> bundle;
+    if (stores[index] != nullptr &&
+        findStoreBundle(stores[index], stores, bundle))
+      bundles.push_back(bundle);
+  }
+
+  for (auto &bundle : bundles)
+    vectorizeStores(bundle);
+  return !bundles.empty();
+}
+
+//------------------------------------------------------------------------------
+// Looks for the stores to the width - 1 addresses following the one of seed.
+// The stores of a bundle are removed from stores.
+bool ReplicaVectorization::findStoreBundle(StoreInst *seed,
+                                           std::vector<StoreInst *> &stores,
+                                           std::vector<StoreInst *> &bundle) {
+  Type *type = seed->getValueOperand()->getType();
+  bundle.assign(1, seed);
+  for (unsigned int lane = 1; lane < width; ++lane) {
+    std::vector<StoreInst *>::iterator store = std::find_if(
+        stores.begin(), stores.end(), [&](StoreInst *candidate) {
+          return candidate != nullptr &&
+                 candidate->getValueOperand()->getType() == type &&
+                 candidate->getPointerAddressSpace() ==
+                     seed->getPointerAddressSpace() &&
+                 isConsecutive(seed->getPointerOperand(),
+                               candidate->getPointerOperand(), type, lane);
+        });
+    if (store == stores.end())
+      return false;
+    bundle.push_back(*store);
+  }
+
+  ValueVector values(bundle.begin(), bundle.end());
+  if (!canMoveMemoryBundle(values, true))
+    return false;
+  for (auto store : bundle)
+    *std::find(stores.begin(), stores.end(), store) = nullptr;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Whether second points lane elements of the given type after first.
+bool ReplicaVectorization::isConsecutive(Value *first, Value *second,
+                                         Type *type, unsigned int lane) {
+  const SCEV *distance =
+      se->getMinusSCEV(se->getSCEV(second), se->getSCEV(first));
+  const SCEVConstant *constant = dyn_cast<SCEVConstant>(distance);
+  if (constant == nullptr)
+    return false;
+  int64_t elementSize = type->getPrimitiveSizeInBits() / 8;
+  return constant->getValue()->getSExtValue() == lane * elementSize;
+}
+
+//------------------------------------------------------------------------------
+// The instructions of a bundle can be replaced by a vector instruction if
+// they are isomorphic, independent and only used by the next bundle.
+bool ReplicaVectorization::isPackable(const ValueVector &bundle) {
+  Instruction *first = dyn_cast<Instruction>(bundle.front());
+  if (first == nullptr || getTypeCode(first->getType()) == "")
+    return false;
+
+  for (auto value : bundle) {
+    Instruction *inst = dyn_cast<Instruction>(value);
+    if (inst == nullptr || inst->getOpcode() != first->getOpcode() ||
+        inst->getType() != first->getType() ||
+        inst->getParent() != first->getParent() || !inst->hasOneUse())
+      return false;
+    if (std::count(bundle.begin(), bundle.end(), value) != 1)
+      return false;
+    for (unsigned int index = 0; index < inst->getNumOperands(); ++index) {
+      if (std::find(bundle.begin(), bundle.end(), inst->getOperand(index)) !=
+          bundle.end())
+        return false;
+    }
+  }
+
+  if (LoadInst *load = dyn_cast<LoadInst>(first)) {
+    for (unsigned int lane = 1; lane < bundle.size(); ++lane) {
+      LoadInst *current = cast<LoadInst>(bundle[lane]);
+      if (!current->isSimple() || !load->isSimple() ||
+          current->getPointerAddressSpace() !=
+              load->getPointerAddressSpace() ||
+          !isConsecutive(load->getPointerOperand(),
+                         current->getPointerOperand(), load->getType(), lane))
+        return false;
+    }
+    return canMoveMemoryBundle(bundle, false);
+  }
+
+  if (CastInst *castInst = dyn_cast<CastInst>(first)) {
+    Type *sourceType = castInst->getSrcTy();
+    if (getTypeCode(sourceType) == "")
+      return false;
+    for (auto value : bundle) {
+      if (value->getType() != first->getType() ||
+          cast<CastInst>(value)->getSrcTy() != sourceType)
+        return false;
+    }
+    return true;
+  }
+
+  return isa<BinaryOperator>(first);
+}
+
+//------------------------------------------------------------------------------
+// The vector access replaces the bundle at the position of its last access:
+// no other access in between may write memory, or for stores access it.
+bool ReplicaVectorization::canMoveMemoryBundle(const ValueVector &bundle,
+                                               bool isStore) {
+  Instruction *last = getLastInstruction(bundle);
+  BasicBlock *block = last->getParent();
+  BasicBlock::iterator iter = block->begin();
+  while (std::find(bundle.begin(), bundle.end(), &*iter) == bundle.end())
+    ++iter;
+
+  for (; &*iter != last; ++iter) {
+    Instruction *inst = &*iter;
+    if (std::find(bundle.begin(), bundle.end(), inst) != bundle.end())
+      continue;
+    if (isStore ? inst->mayReadOrWriteMemory() : inst->mayWriteToMemory())
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+Instruction *
+ReplicaVectorization::getLastInstruction(const ValueVector &bundle) {
+  Instruction *first = cast<Instruction>(bundle.front());
+  Instruction *last = first;
+  for (BasicBlock::iterator iter = first->getParent()->begin(),
+                            end = first->getParent()->end();
+       iter != end; ++iter) {
+    if (std::find(bundle.begin(), bundle.end(), &*iter) != bundle.end())
+      last = &*iter;
+  }
+  return last;
+}
+
+//------------------------------------------------------------------------------
+void ReplicaVectorization::vectorizeStores(
+    const std::vector<StoreInst *> &bundle) {
+  StoreInst *first = bundle.front();
+  Instruction *last =
+      getLastInstruction(ValueVector(bundle.begin(), bundle.end()));
+  Type *type = first->getValueOperand()->getType();
+
+  ValueVector values;
+  for (auto store : bundle)
+    values.push_back(store->getValueOperand());
+  Value *vector = vectorizeBundle(values, last);
+
+  Function *vstore =
+      getVectorMemoryFunction(first->getParent()->getParent()->getParent(),
+                              true, type, first->getPointerAddressSpace());
+  Value *args[] = {vector, ConstantInt::get(sizeType, 0),
+                   first->getPointerOperand()};
+  CallInst::Create(vstore, args, "", last);
+
+  for (auto store : bundle)
+    store->eraseFromParent();
+  for (auto value : values)
+    RecursivelyDeleteTriviallyDeadInstructions(value);
+}
+
+//------------------------------------------------------------------------------
+// Returns the vector of the values of the bundle. Packable bundles become
+// vector instructions before their last instruction, the others are gathered
+// before insertPoint.
+Value *ReplicaVectorization::vectorizeBundle(const ValueVector &bundle,
+                                             Instruction *insertPoint) {
+  if (std::all_of(bundle.begin(), bundle.end(),
+                  [](Value *value) { return isa<Constant>(value); })) {
+    std::vector<Constant *> constants;
+    for (auto value : bundle)
+      constants.push_back(cast<Constant>(value));
+    return ConstantVector::get(constants);
+  }
+
+  if (!isPackable(bundle))
+    return gatherBundle(bundle, insertPoint);
+
+  Instruction *first = cast<Instruction>(bundle.front());
+  Instruction *last = getLastInstruction(bundle);
+  VectorType *vectorType = VectorType::get(first->getType(), bundle.size());
+
+  if (LoadInst *load = dyn_cast<LoadInst>(first)) {
+    Function *vload =
+        getVectorMemoryFunction(first->getParent()->getParent()->getParent(),
+                                false, load->getType(),
+                                load->getPointerAddressSpace());
+    Value *args[] = {ConstantInt::get(sizeType, 0), load->getPointerOperand()};
+    return CallInst::Create(vload, args, load->getName() + "..Vec", last);
+  }
+
+  std::vector<Value *> operands;
+  for (unsigned int index = 0; index < first->getNumOperands(); ++index) {
+    ValueVector operandBundle;
+    for (auto value : bundle)
+      operandBundle.push_back(cast<Instruction>(value)->getOperand(index));
+    operands.push_back(vectorizeBundle(operandBundle, last));
+  }
+
+  if (CastInst *castInst = dyn_cast<CastInst>(first))
+    return CastInst::Create(castInst->getOpcode(), operands[0], vectorType,
+                            first->getName() + "..Vec", last);
+
+  BinaryOperator *binOp = cast<BinaryOperator>(first);
+  return BinaryOperator::Create(binOp->getOpcode(), operands[0], operands[1],
+                                first->getName() + "..Vec", last);
+}
+
+//------------------------------------------------------------------------------
+Value *ReplicaVectorization::gatherBundle(const ValueVector &bundle,
+                                          Instruction *insertPoint) {
+  LLVMContext &context = insertPoint->getContext();
+  Value *vector =
+      UndefValue::get(VectorType::get(bundle.front()->getType(), bundle.size()));
+  for (unsigned int lane = 0; lane < bundle.size(); ++lane) {
+    vector = InsertElementInst::Create(
+        vector, bundle[lane], ConstantInt::get(Type::getInt32Ty(context), lane),
+        "gather", insertPoint);
+  }
+  return vector;
+}
+
+//------------------------------------------------------------------------------
+// Declares vloadN or vstoreN for the element type and address space, with
+// its SPIR mangled name.
+Function *ReplicaVectorization::getVectorMemoryFunction(
+    Module *module, bool isStore, Type *elementType,
+    unsigned int addressSpace) {
+  std::string baseName = (isStore ? "vstore" : "vload") + std::to_string(width);
+  std::string typeCode = getTypeCode(elementType);
+  std::string pointerCode =
+      "P" + (addressSpace != 0 ? "U3AS" + std::to_string(addressSpace) : "") +
+      (isStore ? "" : "K") + typeCode;
+  std::string sizeCode = sizeType->getIntegerBitWidth() == 64 ? "m" : "j";
+  std::string vectorCode = "Dv" + std::to_string(width) + "_" + typeCode;
+  std::string name = "_Z" + std::to_string(baseName.size()) + baseName +
+                     (isStore ? vectorCode : "") + sizeCode + pointerCode;
+
+  Type *vectorType = VectorType::get(elementType, width);
+  Type *pointerType = PointerType::get(elementType, addressSpace);
+  FunctionType *functionType;
+  if (isStore) {
+    Type *params[] = {vectorType, sizeType, pointerType};
+    functionType = FunctionType::get(Type::getVoidTy(module->getContext()),
+                                     params, false);
+  } else {
+    Type *params[] = {sizeType, pointerType};
+    functionType = FunctionType::get(vectorType, params, false);
+  }
+
+  Function *function =
+      cast<Function>(module->getOrInsertFunction(name, functionType));
+  function->addFnAttr(Attribute::NoUnwind);
+  if (!isStore)
+    function->addFnAttr(Attribute::ReadOnly);
+  return function;
+}
+
+//------------------------------------------------------------------------------
+char ReplicaVectorization::ID = 0;
+static RegisterPass<ReplicaVectorization>
+    X("vectorize-replicas",
+      "OpenCL Coarsened Replicas Vectorization Pass");
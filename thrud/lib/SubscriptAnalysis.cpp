@@ -0,0 +1,111 @@
+#include "thrud/SubscriptAnalysis.h"
+
+#include "thrud/NDRange.h"
+#include "thrud/OCLEnv.h"
+
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
+#include "llvm/IR/Argument.h"
+#include "llvm/IR/Instruction.h"
+
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+SubscriptAnalysis::SubscriptAnalysis(ScalarEvolution *scalarEvolution,
+                                     const OCLEnv *ocl)
+    : scalarEvolution(scalarEvolution), ocl(ocl) {}
+
+//------------------------------------------------------------------------------
+bool SubscriptAnalysis::analyzeSubscript(
+    const SCEV *scev, const std::vector<NDRangePoint> &points,
+    std::vector<int> &values) {
+  values.clear();
+  values.reserve(points.size());
+  for (auto &point : points) {
+    int value = 0;
+    if (!resolve(scev, point, value))
+      return false;
+    values.push_back(value);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool SubscriptAnalysis::resolve(const SCEV *scev, const NDRangePoint &point,
+                                int &value) {
+  switch (scev->getSCEVType()) {
+  case scConstant:
+    value = cast<SCEVConstant>(scev)->getValue()->getSExtValue();
+    return true;
+  case scTruncate:
+  case scZeroExtend:
+  case scSignExtend:
+    return resolve(cast<SCEVCastExpr>(scev)->getOperand(), point, value);
+  case scAddExpr:
+  case scMulExpr:
+  case scSMaxExpr:
+  case scUMaxExpr: {
+    const SCEVNAryExpr *nAry = cast<SCEVNAryExpr>(scev);
+    for (unsigned int index = 0; index < nAry->getNumOperands(); ++index) {
+      int operand = 0;
+      if (!resolve(nAry->getOperand(index), point, operand))
+        return false;
+      if (index == 0)
+        value = operand;
+      else if (scev->getSCEVType() == scAddExpr)
+        value += operand;
+      else if (scev->getSCEVType() == scMulExpr)
+        value *= operand;
+      else
+        value = std::max(value, operand);
+    }
+    return true;
+  }
+  case scUDivExpr: {
+    const SCEVUDivExpr *div = cast<SCEVUDivExpr>(scev);
+    int left = 0;
+    int right = 0;
+    if (!resolve(div->getLHS(), point, left) ||
+        !resolve(div->getRHS(), point, right) || right == 0)
+      return false;
+    value = left / right;
+    return true;
+  }
+  case scAddRecExpr:
+    // The first iteration of the loop.
+    return resolve(cast<SCEVAddRecExpr>(scev)->getStart(), point, value);
+  case scUnknown:
+    return resolveUnknown(cast<SCEVUnknown>(scev)->getValue(), point, value);
+  default:
+    return false;
+  }
+}
+
+//------------------------------------------------------------------------------
+bool SubscriptAnalysis::resolveUnknown(Value *value, const NDRangePoint &point,
+                                       int &result) {
+  if (Argument *argument = dyn_cast<Argument>(value)) {
+    if (!argument->getType()->isIntegerTy())
+      return false;
+    result = ocl->resolveValue(argument);
+    return true;
+  }
+
+  Instruction *inst = dyn_cast<Instruction>(value);
+  if (inst == nullptr)
+    return false;
+  const NDRange *ndr = ocl->getNDRange();
+  int direction = ndr->getDirection(inst);
+  if (direction == -1)
+    return false;
+  if (ndr->isCoordinate(inst)) {
+    result = point.getCoordinate(ndr->getType(inst), direction);
+    return true;
+  }
+  if (ndr->isSize(inst)) {
+    result = ocl->getNDRangeSpace().getSize(ndr->getType(inst), direction);
+    return true;
+  }
+  return false;
+}
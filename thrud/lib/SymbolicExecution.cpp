@@ -0,0 +1,294 @@
+#include "thrud/SymbolicExecution.h"
+
+#include "thrud/LaunchContext.h"
+#include "thrud/NDRange.h"
+#include "thrud/OCLEnv.h"
+#include "thrud/SubscriptAnalysis.h"
+#include "thrud/Utils.h"
+
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+extern cl::opt<std::string> KernelNameCL;
+
+// Command line options.
+cl::list<unsigned int> SymbolicLocalSizeCL(
+    "symbolic-local-size", cl::CommaSeparated, cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Work-group size of the symbolic execution, as x,y,z. Missing "
+             "sizes are 1. Defaults to the launch context, or 16,16,1"));
+cl::list<unsigned int> SymbolicGroupsCL(
+    "symbolic-groups", cl::CommaSeparated, cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Number of work-groups of the symbolic execution, as x,y,z. "
+             "Missing numbers are 1. Defaults to the launch context, or "
+             "64,64,1"));
+cl::opt<unsigned int> SymbolicTripCountCL(
+    "symbolic-trip-count", cl::init(16), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Weight of the loops whose trip count is not known"));
+
+//------------------------------------------------------------------------------
+static int getSize(const cl::list<unsigned int> &sizes, int direction,
+                   const int *defaults) {
+  if (sizes.empty())
+    return defaults[direction];
+  return direction < (int)sizes.size() ? std::max(1u, sizes[direction]) : 1;
+}
+
+//------------------------------------------------------------------------------
+static int getSum(const std::vector<int> &values) {
+  long long sum = 0;
+  for (auto value : values)
+    sum += value;
+  return (int)std::min(sum, (long long)INT_MAX);
+}
+
+//------------------------------------------------------------------------------
+static void printVector(const std::string &name,
+                       const std::vector<int> &values) {
+  errs() << name << ":";
+  for (auto value : values)
+    errs() << " " << value;
+  errs() << "\n";
+}
+
+//------------------------------------------------------------------------------
+SymbolicExecution::SymbolicExecution()
+    : FunctionPass(ID), subscriptAnalysis(nullptr), ocl(nullptr),
+      ndrSpace(1, 1, 1, 1, 1, 1) {}
+
+//------------------------------------------------------------------------------
+SymbolicExecution::~SymbolicExecution() {
+  delete subscriptAnalysis;
+  delete ocl;
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::getAnalysisUsage(AnalysisUsage &au) const {
+  au.addRequired<LoopInfo>();
+  au.addRequired<ScalarEvolution>();
+  au.addRequired<NDRange>();
+  au.setPreservesAll();
+}
+
+//------------------------------------------------------------------------------
+bool SymbolicExecution::runOnFunction(Function &function) {
+  if (!isKernel((const Function *)&function))
+    return false;
+
+  // Apply the pass to the selected kernel only.
+  std::string functionName = function.getName();
+  if (KernelNameCL != "" && functionName != KernelNameCL)
+    return false;
+
+  scalarEvolution = &getAnalysis<ScalarEvolution>();
+  loopInfo = &getAnalysis<LoopInfo>();
+  ndr = &getAnalysis<NDRange>();
+
+  initOCLSpace(function);
+  init(function);
+  initBuffers();
+
+  for (Function::iterator block = function.begin(), end = function.end();
+       block != end; ++block)
+    memoryAccessAnalysis(*block);
+
+  dump();
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// The explicit sizes first, then the ones the kernel is launched with.
+void SymbolicExecution::initOCLSpace(Function &function) {
+  int defaultLocalSize[] = {16, 16, 1};
+  int defaultGroups[] = {64, 64, 1};
+  LaunchContext context;
+  if (context.read(function.getName()) && context.hasSizes()) {
+    for (int direction = 0; direction < NDRange::DIRECTION_NUMBER;
+         ++direction) {
+      defaultLocalSize[direction] = context.getLocalSize(direction);
+      defaultGroups[direction] = context.getNumberOfGroups(direction);
+    }
+  }
+  ndrSpace = NDRangeSpace(getSize(SymbolicLocalSizeCL, 0, defaultLocalSize),
+                          getSize(SymbolicLocalSizeCL, 1, defaultLocalSize),
+                          getSize(SymbolicLocalSizeCL, 2, defaultLocalSize),
+                          getSize(SymbolicGroupsCL, 0, defaultGroups),
+                          getSize(SymbolicGroupsCL, 1, defaultGroups),
+                          getSize(SymbolicGroupsCL, 2, defaultGroups));
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::init(Function &function) {
+  delete subscriptAnalysis;
+  delete ocl;
+  ocl = new OCLEnv(function, ndr, ndrSpace);
+  subscriptAnalysis = new SubscriptAnalysis(scalarEvolution, ocl);
+
+  // The first warp of the first work-group, x fastest.
+  warp.clear();
+  int warpSize = std::min(OCLEnv::WARP_SIZE, ndrSpace.getGroupSize());
+  int sizeX = ndrSpace.getLocalSizeX();
+  int sizeY = ndrSpace.getLocalSizeY();
+  for (int index = 0; index < warpSize; ++index)
+    warp.push_back(NDRangePoint(index % sizeX, (index / sizeX) % sizeY,
+                                index / (sizeX * sizeY), 0, 0, 0, ndrSpace));
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::initBuffers() {
+  loadTransactions.clear();
+  storeTransactions.clear();
+  loopLoadTransactions.clear();
+  loopStoreTransactions.clear();
+  loadBankConflicts.clear();
+  storeBankConflicts.clear();
+  loopLoadBankConflicts.clear();
+  loopStoreBankConflicts.clear();
+  unknownAccesses = 0;
+}
+
+//------------------------------------------------------------------------------
+// Product of the trip counts of the loops around the block.
+int SymbolicExecution::getLoopWeight(BasicBlock &block) {
+  long long weight = 1;
+  for (Loop *loop = loopInfo->getLoopFor(&block); loop != nullptr;
+       loop = loop->getParentLoop()) {
+    int tripCount = SymbolicTripCountCL;
+    const SCEV *backedges = scalarEvolution->getBackedgeTakenCount(loop);
+    int value = 0;
+    if (!isa<SCEVCouldNotCompute>(backedges) &&
+        subscriptAnalysis->resolve(backedges, warp.front(), value))
+      tripCount = value + 1;
+    weight = std::min(weight * std::max(tripCount, 1), (long long)INT_MAX);
+  }
+  return (int)weight;
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::memoryAccessAnalysis(BasicBlock &block) {
+  bool isInLoop = loopInfo->getLoopFor(&block) != nullptr;
+  currentLoadTransactions =
+      isInLoop ? &loopLoadTransactions : &loadTransactions;
+  currentStoreTransactions =
+      isInLoop ? &loopStoreTransactions : &storeTransactions;
+  currentLoadBankConflicts =
+      isInLoop ? &loopLoadBankConflicts : &loadBankConflicts;
+  currentStoreBankConflicts =
+      isInLoop ? &loopStoreBankConflicts : &storeBankConflicts;
+  currentWeight = isInLoop ? getLoopWeight(block) : 1;
+
+  visit(block);
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::visitLoadInst(LoadInst &loadInst) {
+  Value *pointer = loadInst.getPointerOperand();
+  unsigned int addressSpace = loadInst.getPointerAddressSpace();
+  if (addressSpace == OCLEnv::GLOBAL_AS)
+    visitMemoryInst(pointer, *currentLoadTransactions);
+  else if (addressSpace == OCLEnv::LOCAL_AS)
+    visitLocalMemoryInst(pointer, *currentLoadBankConflicts);
+}
+
+//------------------------------------------------------------------------------
+void SymbolicExecution::visitStoreInst(StoreInst &storeInst) {
+  Value *pointer = storeInst.getPointerOperand();
+  unsigned int addressSpace = storeInst.getPointerAddressSpace();
+  if (addressSpace == OCLEnv::GLOBAL_AS)
+    visitMemoryInst(pointer, *currentStoreTransactions);
+  else if (addressSpace == OCLEnv::LOCAL_AS)
+    visitLocalMemoryInst(pointer, *currentStoreBankConflicts);
+}
+
+//------------------------------------------------------------------------------
+// Byte offsets from the base of the buffer accessed by the work-items of the
+// warp.
+bool SymbolicExecution::getAddresses(Value *pointer,
+                                     std::vector<int> &addresses) {
+  if (!scalarEvolution->isSCEVable(pointer->getType()))
+    return false;
+  const SCEV *scev = scalarEvolution->getSCEV(pointer);
+  const SCEV *base = scalarEvolution->getPointerBase(scev);
+  const SCEV *offset = scalarEvolution->getMinusSCEV(scev, base);
+  return subscriptAnalysis->analyzeSubscript(offset, warp, addresses);
+}
+
+//------------------------------------------------------------------------------
+// Transactions: the cache lines touched by the warp.
+void SymbolicExecution::visitMemoryInst(Value *pointer,
+                                        std::vector<int> &resultVector) {
+  Type *type = cast<PointerType>(pointer->getType())->getElementType();
+  int bytes = type->getPrimitiveSizeInBits() / 8;
+  std::vector<int> addresses;
+  if (bytes == 0 || !getAddresses(pointer, addresses)) {
+    ++unknownAccesses;
+    return;
+  }
+
+  std::set<int> lines;
+  for (auto address : addresses) {
+    lines.insert(address / OCLEnv::CACHELINE_SIZE);
+    lines.insert((address + bytes - 1) / OCLEnv::CACHELINE_SIZE);
+  }
+  long long transactions = (long long)lines.size() * currentWeight;
+  resultVector.push_back((int)std::min(transactions, (long long)INT_MAX));
+}
+
+//------------------------------------------------------------------------------
+// Bank conflicts: the largest number of distinct words the warp accesses in
+// the same bank, 1 for a conflict free access. Work-items reading the same
+// word get it by broadcast.
+void SymbolicExecution::visitLocalMemoryInst(Value *pointer,
+                                             std::vector<int> &resultVector) {
+  std::vector<int> addresses;
+  if (!getAddresses(pointer, addresses)) {
+    ++unknownAccesses;
+    return;
+  }
+
+  std::map<int, std::set<int>> banks;
+  for (auto address : addresses) {
+    int word = address / OCLEnv::BANK_WIDTH;
+    banks[word % OCLEnv::BANK_NUMBER].insert(word);
+  }
+  int conflicts = 0;
+  for (auto &bank : banks)
+    conflicts = std::max(conflicts, (int)bank.second.size());
+  long long weighted = (long long)conflicts * currentWeight;
+  resultVector.push_back((int)std::min(weighted, (long long)INT_MAX));
+}
+
+//------------------------------------------------------------------------------
+// The last line sums every access: the cost of the memory accesses of one
+// warp, in transactions and bank conflict replays.
+void SymbolicExecution::dump() {
+  printVector("Global load transactions", loadTransactions);
+  printVector("Global store transactions", storeTransactions);
+  printVector("Loop global load transactions", loopLoadTransactions);
+  printVector("Loop global store transactions", loopStoreTransactions);
+  printVector("Local load bank conflicts", loadBankConflicts);
+  printVector("Local store bank conflicts", storeBankConflicts);
+  printVector("Loop local load bank conflicts", loopLoadBankConflicts);
+  printVector("Loop local store bank conflicts", loopStoreBankConflicts);
+  errs() << "Unresolved memory accesses: " << unknownAccesses << "\n";
+
+  std::vector<int> costs = {
+      getSum(loadTransactions),      getSum(storeTransactions),
+      getSum(loopLoadTransactions),  getSum(loopStoreTransactions),
+      getSum(loadBankConflicts),     getSum(storeBankConflicts),
+      getSum(loopLoadBankConflicts), getSum(loopStoreBankConflicts)};
+  errs() << "Memory cost per warp: " << getSum(costs) << "\n";
+}
+
+//------------------------------------------------------------------------------
+char SymbolicExecution::ID = 0;
+static RegisterPass<SymbolicExecution>
+    X("symbolic-execution", "OpenCL Symbolic Execution Pass");
@@ -34,17 +34,46 @@
 using namespace llvm;
 
 // Command line options.
-extern cl::opt<unsigned int> CoarseningDirectionCL;
 cl::opt<unsigned int> CoarseningFactorCL("coarsening-factor", cl::init(1),
-                                         cl::Hidden,
+                                         cl::Hidden, cl::ZeroOrMore,
                                          cl::desc("The coarsening factor"));
+cl::list<unsigned int> CoarseningFactorsCL(
+    "coarsening-factors", cl::Hidden, cl::ZeroOrMore, cl::CommaSeparated,
+    cl::desc("The coarsening factor of each dimension, x first. Overrides "
+             "-coarsening-factor and -coarsening-direction; -be -tc must be "
+             "given once per dimension with a factor higher than 1"));
 cl::opt<unsigned int> CoarseningStrideCL("coarsening-stride", cl::init(1),
-                                         cl::Hidden,
+                                         cl::Hidden, cl::ZeroOrMore,
                                          cl::desc("The coarsening stride"));
 cl::opt<std::string> KernelNameCL("kernel-name", cl::init(""), cl::Hidden,
+                                  cl::ZeroOrMore,
                                   cl::desc("Name of the kernel to coarsen"));
+cl::opt<ThreadCoarsening::CoarseningMode> CoarseningModeCL(
+    "coarsening-mode", cl::init(ThreadCoarsening::Replicate), cl::Hidden,
+    cl::ZeroOrMore,
+    cl::desc("How the work of the coarsened threads is laid out"),
+    cl::values(clEnumValN(ThreadCoarsening::Replicate, "replicate",
+                          "Replicate the instructions of every thread"),
+               clEnumValN(ThreadCoarsening::Loop, "loop",
+                          "Run the threads in a loop"),
+               clEnumValEnd));
+cl::opt<unsigned int> CoarseningUnrollCL(
+    "coarsening-unroll", cl::init(1), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Threads replicated in each iteration of the loop mode"));
+cl::opt<std::string> CoarseningFactorArgCL(
+    "coarsening-factor-arg", cl::init(""), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Name of the kernel argument holding the coarsening factor. The "
+             "kernel is built once and runs as many sub-threads as the "
+             "argument says"));
+cl::opt<std::string> CoarseningGroupsArgCL(
+    "coarsening-groups-arg", cl::init(""), cl::Hidden, cl::ZeroOrMore,
+    cl::desc("Name of the kernel argument holding the number of work-groups "
+             "of the original NDRange in the coarsening direction. With "
+             "-coarsening-factor-arg in block level coarsening the grid can "
+             "then be rounded up: the work-groups beyond it do nothing"));
 cl::opt<ThreadCoarsening::DivRegionOption> DivRegionOptionCL(
     "div-region-mgt", cl::init(ThreadCoarsening::FullReplication), cl::Hidden,
+    cl::ZeroOrMore,
     cl::desc("Divergent region management"),
     cl::values(clEnumValN(ThreadCoarsening::FullReplication, "classic",
                           "Replicate full region"),
@@ -56,12 +85,28 @@ cl::opt<ThreadCoarsening::DivRegionOption> DivRegionOptionCL(
                           "Merge both true and false branches"),
                clEnumValEnd));
 
+//------------------------------------------------------------------------------
+// The kernel argument of the given name, if the kernel has one.
+static Argument *getKernelArg(Function &function, const std::string &name) {
+  if (name == "")
+    return nullptr;
+  for (Function::arg_iterator iter = function.arg_begin(),
+                              iterEnd = function.arg_end();
+       iter != iterEnd; ++iter) {
+    if (iter->getName() == name)
+      return &*iter;
+  }
+  return nullptr;
+}
+
 //------------------------------------------------------------------------------
 ThreadCoarsening::ThreadCoarsening() : FunctionPass(ID) {}
 
 //------------------------------------------------------------------------------
 void ThreadCoarsening::getAnalysisUsage(AnalysisUsage &au) const {
-  au.addPreserved<ReplaceGlobalIds>();
+  // The global ids of the next dimension are replaced after this pass.
+  if (!isMultiDimCoarsening())
+    au.addPreserved<ReplaceGlobalIds>();
   au.addRequired<LoopInfo>();
   au.addRequired<SingleDimDivAnalysis>();
   au.addRequired<PostDominatorTree>();
@@ -81,10 +126,11 @@ bool ThreadCoarsening::runOnFunction(Function &F) {
     return false;
 
   // Get command line options.
-  direction = CoarseningDirectionCL;
-  factor = CoarseningFactorCL;
+  direction = getCoarseningDirection(&F);
+  factor = getCoarseningFactor(&F);
   stride = CoarseningStrideCL;
   divRegionOption = DivRegionOptionCL;
+  tripCount = 1;
 
   // Perform analysis.
   loopInfo = &getAnalysis<LoopInfo>();
@@ -93,12 +139,37 @@ bool ThreadCoarsening::runOnFunction(Function &F) {
   sdda = &getAnalysis<SingleDimDivAnalysis>();
   ndr = &getAnalysis<NDRange>();
 
+  // With the factor read from an argument the loop runs one sub-thread per
+  // iteration. In loop mode only the unrolled threads are replicated.
+  factorArg = getKernelArg(F, CoarseningFactorArgCL);
+  groupsArg = nullptr;
+  if (factorArg != nullptr) {
+    if (!canCoarsenWithLoop(F)) {
+      errs() << "Cannot read the coarsening factor of " << FunctionName
+             << " from an argument: the kernel has barriers\n";
+      return false;
+    }
+    factor = 1;
+    // Only whole work-groups can be skipped.
+    if (!THREAD_LEVEL_COARSENING)
+      groupsArg = getKernelArg(F, CoarseningGroupsArgCL);
+  } else if (CoarseningModeCL == Loop && canCoarsenWithLoop(F)) {
+    unsigned int unroll = CoarseningUnrollCL;
+    if (unroll == 0 || factor % unroll != 0)
+      unroll = 1;
+    tripCount = factor / unroll;
+    factor = unroll;
+  }
+
   // Transform the kernel.
   init();
   scaleNDRange();
   coarsenFunction();
   replacePlaceholders();
+  if (tripCount > 1 || factorArg != nullptr)
+    offsetScaledIds(createCoarseningLoop(F));
 
+  completeCoarseningDirection(&F);
   return true;
 }
 
@@ -107,6 +178,7 @@ void ThreadCoarsening::init() {
   phMap.clear();
   phReplacementMap.clear();
   shMemGlobalsCMap.clear();
+  scaledIds.clear();
 }
 
 //------------------------------------------------------------------------------
@@ -19,6 +19,7 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/GlobalValue.h"
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -30,6 +31,16 @@
 // OpenCL function names.
 const char *BARRIER = "barrier";
 
+extern cl::opt<int> CoarseningDirectionCL;
+extern cl::opt<unsigned int> CoarseningFactorCL;
+extern cl::list<unsigned int> CoarseningFactorsCL;
+extern cl::opt<unsigned int> VectorizingWidthCL;
+extern cl::opt<int> VectorizingDirectionCL;
+extern cl::list<unsigned int> CacheSimFactors;
+extern cl::list<unsigned int> SymbolicLocalSizeCL;
+extern cl::list<unsigned int> SymbolicGroupsCL;
+extern cl::list<unsigned int> StagingGroupSizeCL;
+
 //------------------------------------------------------------------------------
 bool isInLoop(const Instruction &inst, LoopInfo *loopInfo) {
   const BasicBlock *block = inst.getParent();
@@ -743,6 +754,83 @@ Instruction *getModuloInst(Value *value, unsigned int modulo) {
   return moduloInst;
 }
 
+// Coarsening options.
+//------------------------------------------------------------------------------
+// The function being coarsened and how many of its dimensions are done.
+static const Function *coarsenedFunction = nullptr;
+static unsigned int completedDirections = 0;
+
+bool isMultiDimCoarsening() { return !CoarseningFactorsCL.empty(); }
+
+// Without -coarsening-factor, -vectorizing-width and -vectorizing-direction
+// give the coarsening, as they do for the NDRange in the wrappers.
+static bool isCoarsenedByVectorizing() {
+  return CoarseningFactorCL.getNumOccurrences() == 0 &&
+         VectorizingWidthCL.getNumOccurrences() != 0;
+}
+
+//------------------------------------------------------------------------------
+static std::vector<unsigned int> getCoarsenedDirections() {
+  std::vector<unsigned int> result;
+  for (unsigned int index = 0; index < CoarseningFactorsCL.size(); ++index) {
+    if (CoarseningFactorsCL[index] > 1)
+      result.push_back(index);
+  }
+  return result;
+}
+
+//------------------------------------------------------------------------------
+static unsigned int getCompletedDirections(const Function *function) {
+  if (function != coarsenedFunction) {
+    coarsenedFunction = function;
+    completedDirections = 0;
+  }
+  return completedDirections;
+}
+
+//------------------------------------------------------------------------------
+unsigned int getCoarseningDirection(const Function *function) {
+  if (!isMultiDimCoarsening())
+    return isCoarsenedByVectorizing() ? VectorizingDirectionCL
+                                      : CoarseningDirectionCL;
+
+  std::vector<unsigned int> directions = getCoarsenedDirections();
+  unsigned int completed = getCompletedDirections(function);
+  if (completed >= directions.size())
+    return 0;
+  return directions[completed];
+}
+
+//------------------------------------------------------------------------------
+unsigned int getCoarseningFactor(const Function *function) {
+  if (!isMultiDimCoarsening())
+    return isCoarsenedByVectorizing() ? VectorizingWidthCL
+                                      : CoarseningFactorCL;
+
+  std::vector<unsigned int> directions = getCoarsenedDirections();
+  unsigned int completed = getCompletedDirections(function);
+  // Extra runs of the passes leave the function as it is.
+  if (completed >= directions.size())
+    return 1;
+  return CoarseningFactorsCL[directions[completed]];
+}
+
+//------------------------------------------------------------------------------
+void completeCoarseningDirection(const Function *function) {
+  if (isMultiDimCoarsening())
+    completedDirections = getCompletedDirections(function) + 1;
+}
+
+// Option lists.
+//------------------------------------------------------------------------------
+void clearThrudOptionLists() {
+  CoarseningFactorsCL.clear();
+  CacheSimFactors.clear();
+  SymbolicLocalSizeCL.clear();
+  SymbolicGroupsCL.clear();
+  StagingGroupSizeCL.clear();
+}
+
 // System Utils
 //------------------------------------------------------------------------------
 std::string getEnvString(const char *name, const char *defValue) {
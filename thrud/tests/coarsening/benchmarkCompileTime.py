@@ -0,0 +1,138 @@
+#! /usr/bin/python
+
+# Times the coarsening pass on the kernels in kernels/ and on synthetic
+# kernels of growing size, and estimates how the compile time scales with the
+# number of instructions: an exponent close to 1 is linear, close to 2 is
+# quadratic.
+
+import math;
+import os;
+import re;
+import subprocess;
+import sys;
+import time;
+
+CLANG = "clang";
+OPT = "opt";
+LIB_THRUD = "/data/build/autocoarsening/thrud/lib/libThrud.so";
+OCLDEF = "/data/code/autocoarsening/thrud/include/opencl_spir.h";
+OPTIMIZATION = "-O0";
+REPETITIONS = 3;
+SYNTHETIC_SIZES = [500, 1000, 2000, 4000, 8000, 16000];
+KERNEL_PATTERN = re.compile(r"__kernel\s+void\s+(\w+)\s*\(");
+
+#-------------------------------------------------------------------------------
+def runCommand(arguments, toStdin = None):
+  runProcess = subprocess.Popen(arguments, stdin = subprocess.PIPE,
+                                           stdout = subprocess.PIPE,
+                                           stderr = subprocess.PIPE);
+  commandOutput = runProcess.communicate(toStdin);
+  runReturnCode = runProcess.poll();
+  return (runReturnCode, commandOutput[0], commandOutput[1]);
+
+#-------------------------------------------------------------------------------
+def compileToLLVM(fileName):
+  clangCommand = [CLANG, "-x", "cl", "-target", "spir", "-include", OCLDEF,
+                  OPTIMIZATION, fileName, "-S", "-emit-llvm", "-fno-builtin",
+                  "-o", "-"];
+  clangResult = runCommand(clangCommand);
+  if(clangResult[0] != 0):
+    print(clangResult[2]);
+    return None;
+  return clangResult[1];
+
+#-------------------------------------------------------------------------------
+def countInstructions(llvmModule):
+  return len([line for line in llvmModule.splitlines()
+              if line.startswith(b"  ") and not line.startswith(b"  ;")]);
+
+#-------------------------------------------------------------------------------
+# Best of REPETITIONS runs of the coarsening pipeline used by runTests.py.
+def timeCoarsening(llvmModule, kernelName):
+  optCommand = [OPT, "-mem2reg", "-instnamer", "-load", LIB_THRUD,
+                "-structurizecfg", "-be", "-tc",
+                "-coarsening-factor", "2",
+                "-coarsening-direction", "0",
+                "-coarsening-stride", "2",
+                "-div-region-mgt", "classic",
+                "-kernel-name", kernelName,
+                "-o", "/dev/null"];
+  best = None;
+  for repetition in range(REPETITIONS):
+    start = time.time();
+    optResult = runCommand(optCommand, llvmModule);
+    elapsed = time.time() - start;
+    if(optResult[0] != 0):
+      print(optResult[2]);
+      return None;
+    best = elapsed if best is None else min(best, elapsed);
+  return best;
+
+#-------------------------------------------------------------------------------
+# A chain of statements that all depend on the thread id, so that every
+# instruction is divergent and gets replicated.
+def writeSyntheticKernel(fileName, size):
+  lines = ["__kernel void synthetic(__global int* in, __global int* out) {",
+           "  int v0 = get_global_id(0);"];
+  for index in range(1, size):
+    lines.append("  int v%d = v%d * %d + in[v%d & 1023];" %
+                 (index, index - 1, index % 7 + 1, index - 1));
+  lines.append("  out[get_global_id(0)] = v%d;" % (size - 1));
+  lines.append("}");
+  with open(fileName, "w") as kernelFile:
+    kernelFile.write("\n".join(lines) + "\n");
+
+#-------------------------------------------------------------------------------
+# Least squares slope of log(time) over log(instructions).
+def scalingExponent(points):
+  xs = [math.log(size) for size, _ in points];
+  ys = [math.log(seconds) for _, seconds in points];
+  xMean = sum(xs) / len(xs);
+  yMean = sum(ys) / len(ys);
+  numerator = sum((x - xMean) * (y - yMean) for x, y in zip(xs, ys));
+  denominator = sum((x - xMean) ** 2 for x in xs);
+  return numerator / denominator;
+
+#-------------------------------------------------------------------------------
+def benchmarkCorpus():
+  print("file kernel instructions seconds");
+  for fileName in sorted(os.listdir("kernels")):
+    if(not fileName.endswith(".cl")):
+      continue;
+    path = os.path.join("kernels", fileName);
+    llvmModule = compileToLLVM(path);
+    if(llvmModule is None):
+      continue;
+    with open(path) as sourceFile:
+      kernelNames = KERNEL_PATTERN.findall(sourceFile.read());
+    for kernelName in kernelNames:
+      seconds = timeCoarsening(llvmModule, kernelName);
+      if(seconds is not None):
+        print("%s %s %d %.3f" % (fileName, kernelName,
+                                 countInstructions(llvmModule), seconds));
+
+#-------------------------------------------------------------------------------
+def benchmarkScaling():
+  print("statements instructions seconds");
+  fileName = "/tmp/thrud_synthetic.cl";
+  points = [];
+  for size in SYNTHETIC_SIZES:
+    writeSyntheticKernel(fileName, size);
+    llvmModule = compileToLLVM(fileName);
+    if(llvmModule is None):
+      return;
+    seconds = timeCoarsening(llvmModule, "synthetic");
+    if(seconds is None):
+      return;
+    instructions = countInstructions(llvmModule);
+    points.append((instructions, seconds));
+    print("%d %d %.3f" % (size, instructions, seconds));
+  print("Scaling exponent: %.2f" % scalingExponent(points));
+
+def main():
+  if(len(sys.argv) < 2 or sys.argv[1] == "corpus"):
+    benchmarkCorpus();
+  if(len(sys.argv) < 2 or sys.argv[1] == "scaling"):
+    benchmarkScaling();
+
+main();
@@ -0,0 +1,62 @@
+// Kernels whose branches depend on the thread id, for the divergent region
+// management strategies (-div-region-mgt).
+
+// One divergent branch, with a value alive after it.
+__kernel void clamp(__global float *input, __global float *output,
+                    uint width, float threshold) {
+  uint row = get_global_id(1);
+  uint column = get_global_id(0);
+  uint index = row * width + column;
+
+  float value = input[index];
+  if (value > threshold)
+    value = threshold;
+  else
+    value = value * 2.f;
+
+  output[index] = value;
+}
+
+// A branch on the id with an empty false branch.
+__kernel void border(__global float *output, uint width, uint height) {
+  uint row = get_global_id(1);
+  uint column = get_global_id(0);
+
+  float value = 1.f;
+  if (column == 0 || column == width - 1)
+    value = 0.f;
+
+  output[row * width + column] = value;
+}
+
+// A uniform loop inside a divergent branch.
+__kernel void rowSum(__global float *input, __global float *output,
+                     uint width, uint limit) {
+  uint row = get_global_id(1);
+  uint column = get_global_id(0);
+
+  float sum = 0.f;
+  if (column < limit) {
+    for (uint index = 0; index < width; ++index)
+      sum += input[row * width + index];
+  }
+
+  output[row * width + column] = sum;
+}
+
+// A divergent branch nested in another one.
+__kernel void nested(__global float *input, __global float *output,
+                     uint width) {
+  uint row = get_global_id(1);
+  uint column = get_global_id(0);
+  uint index = row * width + column;
+
+  float value = input[index];
+  if (column % 2 == 0) {
+    if (row % 2 == 0)
+      value = -value;
+    value += 1.f;
+  }
+
+  output[index] = value;
+}
@@ -26,7 +26,8 @@ tests = {
 "syr2k.cl" : ["syr2k_kernel"],
 "syrk.cl" : ["syrk_kernel"],
 "spmv.cl" : ["spmv_jds_naive"],
-"stencil.cl" : ["naive_kernel"]
+"stencil.cl" : ["naive_kernel"],
+"divergentRegions.cl" : ["clamp", "border", "rowSum", "nested"]
 }; 
 
 HOME = os.environ["HOME"]; 
@@ -55,7 +56,7 @@ def runCommand(arguments, toStdin = None):
   return (runReturnCode, commandOutput[0], commandOutput[1]);
 
 #-------------------------------------------------------------------------------
-def runTest(fileName, kernelName, cd, cf, st):
+def runTest(fileName, kernelName, cd, cf, st, dr):
   fileName = os.path.join("kernels", fileName);
   clangCommand = [CLANG, "-x", "cl", "-target", "spir", "-include", OCLDEF, 
                   OPTIMIZATION, fileName, "-S", "-emit-llvm", "-fno-builtin", 
@@ -65,7 +66,7 @@ def runTest(fileName, kernelName, cd, cf, st):
                 "-coarsening-factor", cf, 
                 "-coarsening-direction", cd, 
                 "-coarsening-stride", st,
-                "-div-region-mgt", "classic",
+                "-div-region-mgt", dr,
                 "-kernel-name", kernelName,
                 "-o", "/dev/null"];
   clangResult = runCommand(clangCommand);
@@ -73,22 +74,23 @@ def runTest(fileName, kernelName, cd, cf, st):
     llvmModule = clangResult[1];
     optResult = runCommand(optCommand, llvmModule);
     if(optResult[0] == 0):
-      printGreen(" ".join([fileName, kernelName, cd, cf, st, "Ok"])); 
+      printGreen(" ".join([fileName, kernelName, cd, cf, st, dr, "Ok"])); 
     else:
       print(optResult[2]);
-      printRed(" ".join([fileName, kernelName, cd, cf, st, "opt Failed!"])); 
+      printRed(" ".join([fileName, kernelName, cd, cf, st, dr, "opt Failed!"])); 
   else:
     print(clangResult[2]);
-    printRed(" ".join([fileName, kernelName, cd, cf, st, "clang Failed!"])); 
+    printRed(" ".join([fileName, kernelName, cd, cf, st, dr, "clang Failed!"])); 
 
 def main():
   directions = ["0", "1"];
-  factors = ["1", "2", "4", "8", "16", "32"];
+  factors = ["1", "2", "3", "4", "5", "6", "8", "16", "32"];
   strides = ["1", "2", "4", "8", "16", "32"]; 
-  factors = ["2"];
+  factors = ["2", "3", "5", "6"];
   strides = ["2"]; 
+  regionOptions = ["classic", "merge-true", "merge-false", "merge"];
 
-  configs = itertools.product(directions, factors, strides);
+  configs = itertools.product(directions, factors, strides, regionOptions);
   configs = [x for x in configs];
 
   for test in tests:
@@ -0,0 +1,98 @@
+// Replays the memory trace written by -clr with -cache-sim-trace on simulated
+// caches, for several coarsening factors and devices, without rerunning the
+// analysis. The options are the -cache-sim-* ones of -clr without the prefix:
+//
+//   cache-sim-report trace [-factors 1,2,4,8] [-threads 2048] [-units 15]
+//                    [-line-size 128] [-l1-size 16384] [-l1-ways 4]
+//                    [-l2-size 1572864] [-l2-ways 16] [-warp-size 32]
+//                    [-trips 256]
+
+#include "thrud/CacheSimulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static void printUsage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " trace [-factors f,f,...] [-threads n] [-units n]"
+               " [-line-size n] [-l1-size n] [-l1-ways n] [-l2-size n]"
+               " [-l2-ways n] [-warp-size n] [-trips n]\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  std::map<std::string, long long> values;
+  values["-threads"] = 2048;
+  values["-units"] = 15;
+  values["-line-size"] = 128;
+  values["-l1-size"] = 16384;
+  values["-l1-ways"] = 4;
+  values["-l2-size"] = 1572864;
+  values["-l2-ways"] = 16;
+  values["-warp-size"] = 32;
+  values["-trips"] = 256;
+  std::vector<unsigned int> factors = {1, 2, 4, 8, 16, 32};
+
+  for (int index = 2; index < argc; index += 2) {
+    std::string option = argv[index];
+    if (index + 1 == argc ||
+        (option != "-factors" && values.count(option) == 0)) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if (option == "-factors") {
+      factors.clear();
+      std::istringstream list(argv[index + 1]);
+      std::string factor;
+      while (std::getline(list, factor, ','))
+        factors.push_back(atoi(factor.c_str()));
+    } else {
+      values[option] = atoll(argv[index + 1]);
+    }
+  }
+
+  MemoryTrace trace;
+  if (!trace.read(argv[1])) {
+    std::cerr << "Cannot read the memory trace " << argv[1] << "\n";
+    return 1;
+  }
+  if (!trace.hasWholeLoops()) {
+    std::cerr << "The accesses of a loop are split by a nested loop in "
+              << argv[1] << "\n";
+    return 1;
+  }
+
+  CacheSimulationConfig config;
+  config.l1 = CacheGeometry(values["-l1-size"], values["-l1-ways"],
+                            values["-line-size"]);
+  config.l2 = CacheGeometry(values["-l2-size"], values["-l2-ways"],
+                            values["-line-size"]);
+  config.computeUnits = values["-units"];
+  config.residentThreads = values["-threads"];
+  config.warpSize = values["-warp-size"];
+  config.maxTrips = values["-trips"];
+
+  printf("%4s %8s %10s %7s %7s %10s %12s\n", "cf", "warps", "requests",
+         "L1 hit", "L2 hit", "DRAM", "DRAM / warp");
+  for (unsigned int cf : factors) {
+    CacheSimulationResult result = simulateCoarsening(trace, config, cf);
+    double requests = result.requests > 0 ? result.requests : 1;
+    double warps = result.warps > 0 ? result.warps : 1;
+    printf("%4u %8lld %10lld %6.1f%% %6.1f%% %10lld %12.2f\n",
+           result.coarseningFactor, result.warps, result.requests,
+           100.0 * result.l1Hits / requests, 100.0 * result.l2Hits / requests,
+           result.dramTransactions, result.dramTransactions / warps);
+  }
+  return 0;
+}